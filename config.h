@@ -89,6 +89,16 @@
 #define THROTTLE_INTERLACING
 #endif
 
+// If defined, the driver favors low latency over showing every frame: when the SPI bus cannot keep up and a new frame arrives
+// while the newest frame in the SPI task queue has not yet started to be sent, that queued frame is dropped. The SPI thread skips
+// its tasks, and the new frame is diffed against the display contents without it, so the new frame repaints its pixels as well.
+// Useful with emulators, where input lag matters more than smoothness. Requires USE_SPI_THREAD.
+// #define DROP_STALE_FRAMES
+
+#if defined(DROP_STALE_FRAMES) && (!defined(USE_SPI_THREAD) || defined(KERNEL_MODULE) || defined(KERNEL_MODULE_CLIENT))
+#error DROP_STALE_FRAMES requires USE_SPI_THREAD, and is not compatible with the kernel module!
+#endif
+
 // If defined, DMA usage is foremost used to save power consumption and CPU usage. If not defined,
 // DMA usage is tailored towards maximum performance.
 // #define ALL_TASKS_SHOULD_DMA
@@ -125,6 +135,33 @@
 #endif
 #endif
 
+// If defined, all SPI tasks of a frame (set window, cursor and pixel writes) are compiled into one chain of DMA control
+// blocks, instead of the CPU sending the command byte of each task in polled mode and then starting a DMA transfer for the
+// task data. The chain also toggles the Data/Control GPIO line and restarts the SPI transfer between each command and its
+// data, so the CPU only needs to start the chain once per frame. Requires ALL_TASKS_SHOULD_DMA.
+// #define SEND_FRAMES_AS_ONE_DMA_CHAIN
+
+#if defined(SEND_FRAMES_AS_ONE_DMA_CHAIN) && !defined(ALL_TASKS_SHOULD_DMA)
+#error SEND_FRAMES_AS_ONE_DMA_CHAIN requires ALL_TASKS_SHOULD_DMA to be enabled!
+#endif
+#if defined(SEND_FRAMES_AS_ONE_DMA_CHAIN) && (defined(KERNEL_MODULE) || defined(KERNEL_MODULE_CLIENT))
+#error SEND_FRAMES_AS_ONE_DMA_CHAIN is not compatible with the kernel module!
+#endif
+
+// If defined, the changed span rectangles of each frame are converted to big endian RGB565 into a framebuffer in GPU memory, and
+// pixel tasks are sent from there with the DMA 2D mode, which reads the span rectangle scanline by scanline with a stride. This
+// replaces gathering the pixels of each span into the task (or into the DMA source buffer with OFFLOAD_PIXEL_COPY_TO_DMA_CPP), so
+// that the tasks stay small and a multiline span goes out with a few DMA control blocks. Requires ALL_TASKS_SHOULD_DMA on a single threaded
+// build, and a DMA TX channel that is not a lite channel (e.g. -DDMA_TX_CHANNEL=5), since lite channels do not have the 2D mode.
+// #define SEND_PIXELS_WITH_DMA_2D_STRIDE
+
+#if defined(SEND_PIXELS_WITH_DMA_2D_STRIDE) && (!defined(ALL_TASKS_SHOULD_DMA) || !defined(SINGLE_CORE_BOARD))
+#error SEND_PIXELS_WITH_DMA_2D_STRIDE requires ALL_TASKS_SHOULD_DMA and SINGLE_CORE_BOARD to be enabled!
+#endif
+#if defined(SEND_PIXELS_WITH_DMA_2D_STRIDE) && (defined(KERNEL_MODULE) || defined(KERNEL_MODULE_CLIENT))
+#error SEND_PIXELS_WITH_DMA_2D_STRIDE is not compatible with the kernel module!
+#endif
+
 // If per-pixel diffing is enabled (neither UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF or UPDATE_FRAMES_WITHOUT_DIFFING
 // are enabled), the following variable controls whether to lean towards more precise pixel diffing, or faster, but
 // coarser pixel diffing. Coarse method is twice as fast than the precise method, but submits slightly more pixels.
@@ -135,11 +172,81 @@
 #define FAST_BUT_COARSE_PIXEL_DIFF
 #endif
 
+// If enabled, pixel diffing is done at the granularity of DIFF_TILE_SIZE x DIFF_TILE_SIZE pixel tiles instead of scanlines.
+// A dirty bitmap of tiles is built in a single streaming pass over the framebuffers, and each horizontal run of dirty
+// tiles is then submitted as one rectangle. This produces much fewer spans than per-scanline diffing when small
+// scattered areas change (e.g. animated sprites), at the expense of submitting more unchanged pixels. Takes precedence
+// over FAST_BUT_COARSE_PIXEL_DIFF when enabled.
+// #define TILED_PIXEL_DIFF
+
+// If enabled, per-scanline pixel diffing (and counting of changed pixels) is split into horizontal bands
+// that are processed in parallel on NUM_DIFF_THREADS threads (the main thread + NUM_DIFF_THREADS-1 workers).
+// This reduces the per-frame diff latency on multicore Pis with large framebuffers, but the GPU polling and
+// SPI threads already occupy two cores, so the gain depends on how busy the system otherwise is.
+#if !defined(SINGLE_CORE_BOARD)
+// #define PARALLEL_PIXEL_DIFF
+#endif
+
+#if defined(PARALLEL_PIXEL_DIFF) && !defined(NUM_DIFF_THREADS)
+#define NUM_DIFF_THREADS 2
+#endif
+
+// If enabled, frames are checked for content that has scrolled vertically since the previous frame (e.g. terminals, lists), and
+// when a clear vertical displacement is found, the display is scrolled in hardware with the Vertical Scrolling Start Address
+// command, so that only the newly exposed scanlines need to be sent. Only works on display controllers that support hardware
+// vertical scrolling (ILI9341), and only when the framebuffer scanlines run in the native scan direction of the panel, so this is
+// not compatible with flipping or rotating the display orientation in hardware, nor with TILED_PIXEL_DIFF. If the orientation is
+// flipped in software (e.g. landscape output on a portrait panel), the panel scrolls along the columns of the output image, so only
+// horizontal scrolling of the image is detected.
+// #define DISPLAY_VERTICAL_SCROLL_DETECTION
+
+// If enabled, a 64-bit hash of each scanline is computed while the frame is captured, and the hashes of the
+// frame that the display is currently showing are kept alongside it. Scanlines whose hash has not changed are
+// skipped without comparing their pixels, which roughly halves the memory traffic of diffing mostly static frames.
+// #define SCANLINE_HASH_DIFF
+
+#ifdef TILED_PIXEL_DIFF
+// Size of a single diff tile in pixels, both horizontally and vertically. Either 8 or 16 are good choices.
+#define DIFF_TILE_SIZE 16
+#endif
+
 #if defined(ALL_TASKS_SHOULD_DMA)
 // This makes all submitted tasks go through DMA, and not use a hybrid Polled SPI + DMA approach.
 #define ALIGN_TASKS_FOR_DMA_TRANSFERS
 #endif
 
+// If defined, the SPI task queue is allocated in the same uncached GPU memory that the DMA controller reads from, and DMA
+// transfers are sent straight out of the queued tasks, instead of first memcpy()ing each task to a separate DMA source buffer
+// on the SPI thread. The main thread writes the converted pixels straight into the queue with aligned word stores, but every
+// access to the queue bypasses the CPU caches, so whether this is a win depends on the Pi model and the display. Profile with
+// and without before leaving this on. Requires USE_DMA_TRANSFERS, and is not compatible with ALL_TASKS_SHOULD_DMA (enabled by
+// default on single core Pis), 3-wire SPI displays or the kernel module.
+// #define SPI_TASK_QUEUE_IN_DMA_MEMORY
+
+#ifdef SPI_TASK_QUEUE_IN_DMA_MEMORY
+#if !defined(USE_DMA_TRANSFERS)
+#error SPI_TASK_QUEUE_IN_DMA_MEMORY requires USE_DMA_TRANSFERS to be enabled!
+#endif
+#if defined(ALL_TASKS_SHOULD_DMA) || defined(KERNEL_MODULE) || defined(KERNEL_MODULE_CLIENT)
+#error SPI_TASK_QUEUE_IN_DMA_MEMORY is not compatible with ALL_TASKS_SHOULD_DMA or the kernel module!
+#endif
+#endif
+
+// If defined, the SPI thread sleeps until the final control block of each DMA transfer raises an interrupt, which it receives
+// through the given Userspace I/O device, instead of sleeping for an estimated transfer time and then polling the DMA channel
+// until it has finished. Transfers shorter than DMA_COMPLETION_INTERRUPT_MIN_USECS are still polled, since waking up from the
+// interrupt would take longer than they do. This needs a device tree overlay that binds the interrupt line of DMA_RX_CHANNEL to the generic-uio
+// driver. Pass -DDMA_COMPLETION_UIO_DEVICE=<path> to CMake to enable. In SIMULATE_PERIPHERALS builds, the device is not
+// opened, but the simulator models the interrupt instead.
+// #define DMA_COMPLETION_UIO_DEVICE "/dev/uio0"
+
+#if defined(DMA_COMPLETION_UIO_DEVICE) && !defined(USE_DMA_TRANSFERS) && !defined(SIMULATE_PERIPHERALS)
+#error DMA_COMPLETION_UIO_DEVICE requires USE_DMA_TRANSFERS to be enabled!
+#endif
+#if defined(DMA_COMPLETION_UIO_DEVICE) && (defined(KERNEL_MODULE) || defined(KERNEL_MODULE_CLIENT))
+#error DMA_COMPLETION_UIO_DEVICE is not compatible with the kernel module!
+#endif
+
 // If defined, the GPU polling thread will be put to sleep for 1/TARGET_FRAMERATE seconds after receiving
 // each new GPU frame, to wait for the earliest moment that the next frame could arrive.
 #define SAVE_BATTERY_BY_SLEEPING_UNTIL_TARGET_FRAME
@@ -148,8 +255,8 @@
 // frames will be polled first at 10fps, and ultimately at only 2fps.
 #define SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE
 
-// Builds a histogram of observed frame intervals and uses that to sync to a known update rate. This aims
-// to detect if an application uses a non-60Hz update rate, and synchronizes to that instead.
+// Tracks the interval and the phase of the observed frame arrivals with a phase-locked loop, and uses that to sync to the
+// update rate of the content. This aims to detect if an application uses a non-60Hz update rate, and synchronizes to that instead.
 #define SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES
 
 // If defined, rotates the display 180 degrees. This might not rotate the panel scan order though,
@@ -234,6 +341,25 @@
 // as a self-contained userland program.
 // #define KERNEL_MODULE_CLIENT
 
+// If defined, frames are streamed from the given prerecorded file or pipe ("-" for stdin) instead of being
+// captured from the GPU with DispmanX. This is used to profile and test the rest of the pipeline with a
+// repeatable input. See frame_source.h for the stream format. Usually set with -DFRAME_SOURCE_REPLAY=<path> to CMake.
+// #define FRAME_SOURCE_REPLAY "frames.raw"
+
+// If defined, the SPI bus and the display are simulated in software instead of driving the BCM2835 peripherals, so that the whole
+// driver can be run and profiled on a host computer against a FRAME_SOURCE_REPLAY recording. Bus timing follows SIMULATED_CORE_FREQ and
+// SPI_BUS_CLOCK_DIVISOR. At exit, statistics of the bus traffic are printed, and the display contents are optionally written to the file
+// SIMULATOR_DISPLAY_DUMP. See simulator.h. Usually set with -DSIMULATE_PERIPHERALS=ON to CMake.
+// #define SIMULATE_PERIPHERALS
+
+#if defined(SIMULATE_PERIPHERALS) && !defined(FRAME_SOURCE_REPLAY)
+#error SIMULATE_PERIPHERALS has no GPU to capture frames from, so FRAME_SOURCE_REPLAY must be defined as well!
+#endif
+
+#if defined(SIMULATE_PERIPHERALS) && ((defined(USE_DMA_TRANSFERS) && !defined(SEND_FRAMES_AS_ONE_DMA_CHAIN)) || defined(KERNEL_MODULE_CLIENT))
+#error SIMULATE_PERIPHERALS only simulates polled SPI transfers and SEND_FRAMES_AS_ONE_DMA_CHAIN DMA chains driven from userland. Build with -DUSE_DMA_TRANSFERS=OFF and without KERNEL_MODULE_CLIENT.
+#endif
+
 #endif
 
 // Experimental/debugging: If defined, let the userland side program create and run the SPI peripheral
@@ -4,9 +4,53 @@
 #include "display.h"
 #include "gpu.h"
 #include "spi.h"
+#include "mem_alloc.h"
+#include "vertical_scroll.h"
+
+#include <memory.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <linux/futex.h> // FUTEX_WAIT, FUTEX_WAKE
+#include <sys/syscall.h> // SYS_futex
+#include <unistd.h> // syscall
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+// If building with NEON available, the scanline diffing functions process 16 pixels at a time with SIMD
+#define DIFF_USE_NEON
+#endif
 
 Span *spans = 0;
 
+int changedScanlinesStart = 0;
+int changedScanlinesEnd = 0;
+
+#ifdef SCANLINE_HASH_DIFF
+uint64_t *framebufferScanlineHashes[2] = {};
+
+// Scanlines that have the same hash in both framebuffers are identical, so their pixels do not need to be compared.
+#define SCANLINE_UNCHANGED(y) ((y) < changedScanlinesStart || (y) >= changedScanlinesEnd || framebufferScanlineHashes[0][(y)] == framebufferScanlineHashes[1][(y)])
+
+void InvalidatePrevFramebufferScanlineHashes()
+{
+  for(int y = 0; y < gpuFrameHeight; ++y)
+    framebufferScanlineHashes[1][y] = ~framebufferScanlineHashes[0][y];
+}
+
+void UpdatePrevFramebufferScanlineHashes(bool interlacedUpdate, int interlacedFieldParity)
+{
+  if (interlacedUpdate)
+    for(int y = interlacedFieldParity; y < gpuFrameHeight; y += 2)
+      framebufferScanlineHashes[1][y] = framebufferScanlineHashes[0][y];
+  else
+    memcpy(framebufferScanlineHashes[1], framebufferScanlineHashes[0], gpuFrameHeight*sizeof(uint64_t));
+}
+#else
+#define SCANLINE_UNCHANGED(y) ((y) < changedScanlinesStart || (y) >= changedScanlinesEnd)
+#endif
+
 #ifdef UPDATE_FRAMES_WITHOUT_DIFFING
 // Naive non-diffing functionality: just submit the whole display contents
 void NoDiffChangedRectangle(Span *&head)
@@ -26,6 +70,11 @@ void NoDiffChangedRectangle(Span *&head)
 // Finds the first changed pixel, coarse result aligned down to 8 pixels boundary
 static int coarse_linear_diff(uint16_t *framebuffer, uint16_t *prevFramebuffer, uint16_t *framebufferEnd)
 {
+#ifdef SIMULATE_PERIPHERALS
+  // The host computer that runs the simulator does not have the ARM instructions below, so compare 8 pixels at a time in C
+  uint16_t *endPtr = framebuffer;
+  for(; endPtr < framebufferEnd && !memcmp(endPtr, prevFramebuffer, 16); endPtr += 8) prevFramebuffer += 8;
+#else
   uint16_t *endPtr;
   asm volatile(
     "mov r0, %[framebufferEnd]\n" // r0 <- pointer to end of current framebuffer
@@ -67,6 +116,7 @@ static int coarse_linear_diff(uint16_t *framebuffer, uint16_t *prevFramebuffer,
     : [framebuffer]"r"(framebuffer), [prevFramebuffer]"r"(prevFramebuffer), [framebufferEnd]"r"(framebufferEnd)
     : "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "cc"
   );
+#endif
   return endPtr - framebuffer;
 }
 
@@ -74,6 +124,11 @@ static int coarse_linear_diff(uint16_t *framebuffer, uint16_t *prevFramebuffer,
 // Finds the last changed pixel, coarse result aligned up to 8 pixels boundary
 static int coarse_backwards_linear_diff(uint16_t *framebuffer, uint16_t *prevFramebuffer, uint16_t *framebufferEnd)
 {
+#ifdef SIMULATE_PERIPHERALS
+  uint16_t *endPtr = framebufferEnd;
+  uint16_t *prevEndPtr = prevFramebuffer + (framebufferEnd - framebuffer);
+  for(; endPtr > framebuffer && !memcmp(endPtr-8, prevEndPtr-8, 16); endPtr -= 8) prevEndPtr -= 8;
+#else
   uint16_t *endPtr;
   asm volatile(
     "mov r0, %[framebufferBegin]\n" // r0 <- pointer to beginning of current framebuffer
@@ -115,6 +170,7 @@ static int coarse_backwards_linear_diff(uint16_t *framebuffer, uint16_t *prevFra
     : [framebuffer]"r"(framebufferEnd), [prevFramebuffer]"r"(prevFramebuffer+(framebufferEnd-framebuffer)), [framebufferBegin]"r"(framebuffer)
     : "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "cc"
   );
+#endif
   return endPtr - framebuffer;
 }
 
@@ -280,175 +336,500 @@ found_right:
 }
 #endif
 
-void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head)
+#ifdef DIFF_USE_NEON
+// Compares 16 adjacent pixels of the two scanlines in one go, and returns a 64-bit mask that has four bits set for each pixel that is unchanged.
+// (pixel i maps to bits [4*i, 4*i+3] of the mask, so __builtin_ctzll(mask)>>2 gives the index of a pixel)
+static inline uint64_t UnchangedPixelMask16(const uint16_t *scanline, const uint16_t *prevScanline)
+{
+  uint16x8_t eqLo = vceqq_u16(vld1q_u16(scanline), vld1q_u16(prevScanline));
+  uint16x8_t eqHi = vceqq_u16(vld1q_u16(scanline+8), vld1q_u16(prevScanline+8));
+  uint8x16_t eq = vcombine_u8(vmovn_u16(eqLo), vmovn_u16(eqHi)); // 0xFF for each unchanged pixel, 0x00 for each changed pixel
+  return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0); // Squash each 8-bit lane down to 4 bits
+}
+#endif
+
+// Returns the index of the first pixel in range [x, endX[ that differs between the two scanlines, or endX if all the pixels are the same.
+static inline int FirstChangedPixel(const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX)
+{
+#ifdef DIFF_USE_NEON
+  for(; x + 16 <= endX; x += 16)
+  {
+    uint64_t unchanged = UnchangedPixelMask16(scanline+x, prevScanline+x);
+    if (unchanged != ~0ull)
+      return x + (__builtin_ctzll(~unchanged) >> 2);
+  }
+#else
+  // Scanlines are 8 byte aligned, so compare unaligned head pixels one by one, and then 4 pixels at a time
+  while(x < endX && (x & 3))
+  {
+    if (scanline[x] != prevScanline[x]) return x;
+    ++x;
+  }
+  for(; x + 4 <= endX; x += 4)
+  {
+    uint64_t diff = *(const uint64_t*)(scanline+x) ^ *(const uint64_t*)(prevScanline+x);
+    if (diff)
+      return x + (__builtin_ctzll(diff) >> 4);
+  }
+#endif
+  while(x < endX && scanline[x] == prevScanline[x]) ++x;
+  return x;
+}
+
+// Returns the index of the first pixel in range [x, endX[ that is the same in both scanlines, or endX if all the pixels have changed.
+static inline int FirstUnchangedPixel(const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX)
+{
+#ifdef DIFF_USE_NEON
+  for(; x + 16 <= endX; x += 16)
+  {
+    uint64_t unchanged = UnchangedPixelMask16(scanline+x, prevScanline+x);
+    if (unchanged)
+      return x + (__builtin_ctzll(unchanged) >> 2);
+  }
+#else
+  while(x < endX && (x & 3))
+  {
+    if (scanline[x] == prevScanline[x]) return x;
+    ++x;
+  }
+  for(; x + 4 <= endX; x += 4)
+  {
+    uint64_t diff = *(const uint64_t*)(scanline+x) ^ *(const uint64_t*)(prevScanline+x);
+    // Flag 16-bit lanes that are zero, i.e. pixels that are unchanged. This can produce false positives, but only in lanes above the first zero lane,
+    // so the lowest flagged lane is always exact.
+    uint64_t unchanged = (diff - 0x0001000100010001ull) & ~diff & 0x8000800080008000ull;
+    if (unchanged)
+      return x + (__builtin_ctzll(unchanged) >> 4);
+  }
+#endif
+  while(x < endX && scanline[x] != prevScanline[x]) ++x;
+  return x;
+}
+
+// Diffs the scanlines y, y+yInc, y+2*yInc, ... < endY, and writes the found spans to the array starting at output, each span
+// linking to the next one in the array. Returns the number of spans written. At most MAX_SPANS_PER_SCANLINE spans are produced per scanline.
+static int DiffScanlineBandFastAndCoarse4Wide(uint16_t *framebuffer, uint16_t *prevFramebuffer, int y, int endY, int yInc, Span *output)
 {
   int numSpans = 0;
-  int y = interlacedDiff ? interlacedFieldParity : 0;
-  int yInc = interlacedDiff ? 2 : 1;
-  // If doing an interlaced update, skip over every second scanline.
-  int scanlineInc = interlacedDiff ? (gpuFramebufferScanlineStrideBytes>>2) : (gpuFramebufferScanlineStrideBytes>>3);
+  int scanlineInc = yInc * (gpuFramebufferScanlineStrideBytes>>3);
   uint64_t *scanline = (uint64_t *)(framebuffer + y*(gpuFramebufferScanlineStrideBytes>>1));
   uint64_t *prevScanline = (uint64_t *)(prevFramebuffer + y*(gpuFramebufferScanlineStrideBytes>>1)); // (same scanline from previous frame, not preceding scanline)
 
   const int W = gpuFrameWidth>>2;
 
-  Span *span = spans;
-  while(y < gpuFrameHeight)
+  Span *span = output;
+  for(; y < endY; y += yInc, scanline += scanlineInc, prevScanline += scanlineInc)
   {
+    if (SCANLINE_UNCHANGED(y))
+      continue;
     uint16_t *scanlineStart = (uint16_t *)scanline;
 
     for(int x = 0; x < W;)
     {
-      if (scanline[x] != prevScanline[x])
-      {
-        uint16_t *spanStart = (uint16_t *)(scanline + x) + (__builtin_ctzll(scanline[x] ^ prevScanline[x]) >> 4);
-        ++x;
+      // Fast forward over the unchanged 4-pixel blocks
+      x = FirstChangedPixel(scanlineStart, (uint16_t *)prevScanline, x<<2, gpuFrameWidth) >> 2;
+      if (x >= W)
+        break;
+
+      uint16_t *spanStart = (uint16_t *)(scanline + x) + (__builtin_ctzll(scanline[x] ^ prevScanline[x]) >> 4);
+      ++x;
 
-        // We've found a start of a span of different pixels on this scanline, now find where this span ends
-        uint16_t *spanEnd;
-        for(;;)
+      // We've found a start of a span of different pixels on this scanline, now find where this span ends
+      uint16_t *spanEnd;
+      for(;;)
+      {
+        if (x < W)
         {
-          if (x < W)
+          if (scanline[x] != prevScanline[x])
           {
-            if (scanline[x] != prevScanline[x])
-            {
-              ++x;
-              continue;
-            }
-            else
-            {
-              spanEnd = (uint16_t *)(scanline + x) + 1 - (__builtin_clzll(scanline[x-1] ^ prevScanline[x-1]) >> 4);
-              ++x;
-              break;
-            }
+            ++x;
+            continue;
           }
           else
           {
-            spanEnd = scanlineStart + gpuFrameWidth;
+            spanEnd = (uint16_t *)(scanline + x) + 1 - (__builtin_clzll(scanline[x-1] ^ prevScanline[x-1]) >> 4);
+            ++x;
             break;
           }
         }
-
-        // Submit the span update task
-        span->x = spanStart - scanlineStart;
-        span->endX = span->lastScanEndX = spanEnd - scanlineStart;
-        span->y = y;
-        span->endY = y+1;
-        span->size = spanEnd - spanStart;
-        span->next = span+1;
-        ++span;
-        ++numSpans;
+        else
+        {
+          spanEnd = scanlineStart + gpuFrameWidth;
+          break;
+        }
       }
-      else
+
+      // Submit the span update task
+      span->x = spanStart - scanlineStart;
+      span->endX = span->lastScanEndX = spanEnd - scanlineStart;
+      span->y = y;
+      span->endY = y+1;
+      span->size = spanEnd - spanStart;
+      span->next = span+1;
+      ++span;
+      ++numSpans;
+    }
+  }
+  return numSpans;
+}
+
+static int DiffScanlineBandExact(uint16_t *framebuffer, uint16_t *prevFramebuffer, int y, int endY, int yInc, Span *output)
+{
+  int numSpans = 0;
+  int scanlineInc = yInc * (gpuFramebufferScanlineStrideBytes>>1);
+  uint16_t *scanline = framebuffer + y*(gpuFramebufferScanlineStrideBytes>>1);
+  uint16_t *prevScanline = prevFramebuffer + y*(gpuFramebufferScanlineStrideBytes>>1); // (same scanline from previous frame, not preceding scanline)
+  const int W = gpuFrameWidth;
+
+  Span *span = output;
+  for(; y < endY; y += yInc, scanline += scanlineInc, prevScanline += scanlineInc)
+  {
+    if (SCANLINE_UNCHANGED(y))
+      continue;
+    int x = 0;
+    while(x < W)
+    {
+      int firstChanged = FirstChangedPixel(scanline, prevScanline, x, W);
+      if (firstChanged >= W)
+        break;
+
+      // Pixels are scanned in pairs starting from x, so a span always starts at the first pixel of the pair that contains a changed pixel.
+      int spanStart = x + ((firstChanged - x) & ~1);
+
+      // We've found a start of a span of different pixels on this scanline, now find where this span ends: it ends when more than
+      // SPAN_MERGE_THRESHOLD consecutive unchanged pixels follow, and the scan then resumes right after those unchanged pixels.
+      int lastChanged = firstChanged;
+      int spanEnd;
+      for(;;)
       {
-        ++x;
+        int firstUnchanged = FirstUnchangedPixel(scanline, prevScanline, lastChanged + 1, W);
+        int mergeEnd = MIN(W, firstUnchanged + SPAN_MERGE_THRESHOLD + 1);
+        int nextChanged = FirstChangedPixel(scanline, prevScanline, firstUnchanged, mergeEnd);
+        if (nextChanged >= mergeEnd)
+        {
+          spanEnd = firstUnchanged;
+          x = mergeEnd;
+          break;
+        }
+        lastChanged = nextChanged;
       }
+
+      // Submit the span update task
+      span->x = spanStart;
+      span->endX = span->lastScanEndX = spanEnd;
+      span->y = y;
+      span->endY = y+1;
+      span->size = spanEnd - spanStart;
+      span->next = span+1;
+      ++span;
+      ++numSpans;
     }
-    y += yInc;
-    scanline += scanlineInc;
-    prevScanline += scanlineInc;
   }
+  return numSpans;
+}
+
+typedef int (*DiffScanlineBandFunc)(uint16_t *framebuffer, uint16_t *prevFramebuffer, int y, int endY, int yInc, Span *output);
+
+#ifdef PARALLEL_PIXEL_DIFF
+
+static pthread_t diffThreads[NUM_DIFF_THREADS-1];
+static volatile bool diffThreadsRunning = false;
+// Incremented by the main thread each time it hands out a new job to the diff threads.
+static int diffJobGeneration = 0;
+// Number of diff threads that have not yet finished processing their band of the current job.
+static int diffBandsRemaining = 0;
+static void (*diffJob)(int band, int y, int endY) = 0;
+
+static void RunDiffJobBand(int band)
+{
+  diffJob(band, gpuFrameHeight * band / NUM_DIFF_THREADS, gpuFrameHeight * (band+1) / NUM_DIFF_THREADS);
+}
+
+static void *diff_thread(void *arg)
+{
+  const int band = (int)(intptr_t)arg;
+  int generation = 0;
+  for(;;)
+  {
+    int newGeneration;
+    while((newGeneration = __atomic_load_n(&diffJobGeneration, __ATOMIC_ACQUIRE)) == generation)
+      syscall(SYS_futex, &diffJobGeneration, FUTEX_WAIT, generation, 0, 0, 0); // Sleep until the main thread gives us work
+    generation = newGeneration;
+    if (!diffThreadsRunning)
+      break;
+
+    RunDiffJobBand(band);
+
+    if (__atomic_sub_fetch(&diffBandsRemaining, 1, __ATOMIC_ACQ_REL) == 0)
+      syscall(SYS_futex, &diffBandsRemaining, FUTEX_WAKE, 1, 0, 0, 0); // Wake the main thread if it is waiting for us to finish
+  }
+  pthread_exit(0);
+}
+
+void RunDiffJobInParallel(void (*job)(int band, int y, int endY))
+{
+  diffJob = job;
+  __atomic_store_n(&diffBandsRemaining, NUM_DIFF_THREADS-1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&diffJobGeneration, 1, __ATOMIC_SEQ_CST);
+  syscall(SYS_futex, &diffJobGeneration, FUTEX_WAKE, NUM_DIFF_THREADS-1, 0, 0, 0);
+
+  // The main thread processes the topmost band itself
+  RunDiffJobBand(0);
+
+  int remaining;
+  while((remaining = __atomic_load_n(&diffBandsRemaining, __ATOMIC_ACQUIRE)) != 0)
+    syscall(SYS_futex, &diffBandsRemaining, FUTEX_WAIT, remaining, 0, 0, 0);
+}
+
+void InitDiffThreads()
+{
+  diffThreadsRunning = true;
+  for(int i = 0; i < NUM_DIFF_THREADS-1; ++i)
+  {
+    int rc = pthread_create(&diffThreads[i], NULL, diff_thread, (void*)(intptr_t)(i+1));
+    if (rc != 0) FATAL_ERROR("Failed to create pixel diff thread!");
+  }
+  LOG("Using %d threads for pixel diffing", NUM_DIFF_THREADS);
+}
 
+void DeinitDiffThreads()
+{
+  if (!diffThreadsRunning) return;
+  diffThreadsRunning = false;
+  __atomic_fetch_add(&diffJobGeneration, 1, __ATOMIC_SEQ_CST);
+  syscall(SYS_futex, &diffJobGeneration, FUTEX_WAKE, NUM_DIFF_THREADS-1, 0, 0, 0);
+  for(int i = 0; i < NUM_DIFF_THREADS-1; ++i)
+    pthread_join(diffThreads[i], NULL);
+}
+
+// Parameters of the scanline diff job that is currently being processed in parallel
+static DiffScanlineBandFunc bandDiffFunc;
+static uint16_t *bandFramebuffer, *bandPrevFramebuffer;
+static int bandYInc, bandFieldParity;
+static int numBandSpans[NUM_DIFF_THREADS];
+
+static void DiffScanlineBand(int band, int y, int endY)
+{
+  // Start from the first scanline of the band that belongs to the field that is being diffed
+  if (bandYInc == 2 && (y & 1) != bandFieldParity) ++y;
+  // Each band writes its spans to its own disjoint section of the spans array, based on the max number of spans that its scanlines could produce
+  numBandSpans[band] = bandDiffFunc(bandFramebuffer, bandPrevFramebuffer, y, endY, bandYInc, spans + y * MAX_SPANS_PER_SCANLINE);
+}
+
+#endif
+
+static void DiffFramebuffersToScanlineSpans(DiffScanlineBandFunc diffFunc, uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head)
+{
+  // If doing an interlaced update, skip over every second scanline.
+  const int yInc = interlacedDiff ? 2 : 1;
+  head = 0;
+#ifdef PARALLEL_PIXEL_DIFF
+  bandDiffFunc = diffFunc;
+  bandFramebuffer = framebuffer;
+  bandPrevFramebuffer = prevFramebuffer;
+  bandYInc = yInc;
+  bandFieldParity = interlacedFieldParity;
+  RunDiffJobInParallel(DiffScanlineBand);
+
+  // Stitch the span lists of each band together in top-to-bottom order, so that the resulting list is the same as if it was diffed serially
+  Span *tail = 0;
+  for(int band = 0; band < NUM_DIFF_THREADS; ++band)
+  {
+    if (numBandSpans[band] == 0) continue;
+    int y = gpuFrameHeight * band / NUM_DIFF_THREADS;
+    if (interlacedDiff && (y & 1) != interlacedFieldParity) ++y;
+    Span *bandSpans = spans + y * MAX_SPANS_PER_SCANLINE;
+    if (tail) tail->next = bandSpans;
+    else head = bandSpans;
+    tail = bandSpans + numBandSpans[band] - 1;
+  }
+  if (tail) tail->next = 0;
+#else
+  int numSpans = diffFunc(framebuffer, prevFramebuffer, interlacedDiff ? interlacedFieldParity : 0, gpuFrameHeight, yInc, spans);
   if (numSpans > 0)
   {
-    head = &spans[0];
+    head = spans;
     spans[numSpans-1].next = 0;
   }
-  else
-    head = 0;
+#endif
+}
+
+void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head)
+{
+  DiffFramebuffersToScanlineSpans(DiffScanlineBandFastAndCoarse4Wide, framebuffer, prevFramebuffer, interlacedDiff, interlacedFieldParity, head);
 }
 
 void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head)
 {
-  int numSpans = 0;
-  int y = interlacedDiff ? interlacedFieldParity : 0;
-  int yInc = interlacedDiff ? 2 : 1;
-  // If doing an interlaced update, skip over every second scanline.
-  int scanlineInc = interlacedDiff ? gpuFramebufferScanlineStrideBytes : (gpuFramebufferScanlineStrideBytes>>1);
-  int scanlineEndInc = scanlineInc - gpuFrameWidth;
-  uint16_t *scanline = framebuffer + y*(gpuFramebufferScanlineStrideBytes>>1);
-  uint16_t *prevScanline = prevFramebuffer + y*(gpuFramebufferScanlineStrideBytes>>1); // (same scanline from previous frame, not preceding scanline)
+  DiffFramebuffersToScanlineSpans(DiffScanlineBandExact, framebuffer, prevFramebuffer, interlacedDiff, interlacedFieldParity, head);
+}
 
-  while(y < gpuFrameHeight)
-  {
-    uint16_t *scanlineStart = scanline;
-    uint16_t *scanlineEnd = scanline + gpuFrameWidth;
-    while(scanline < scanlineEnd)
-    {
-      uint16_t *spanStart;
-      uint16_t *spanEnd;
-      int numConsecutiveUnchangedPixels = 0;
+#ifdef TILED_PIXEL_DIFF
 
-      if (scanline + 1 < scanlineEnd)
-      {
-        uint32_t diff = (*(uint32_t *)scanline) ^ (*(uint32_t *)prevScanline);
-        scanline += 2;
-        prevScanline += 2;
+// Dirty bitmap of DIFF_TILE_SIZE x DIFF_TILE_SIZE sized tiles, one bit per tile, tileBitmapStride uint32s per row of tiles.
+static uint32_t *tileBitmap = 0;
+static int tileBitmapStride = 0;
+// For each row of tiles, the first and last scanline that had changed pixels.
+static uint16_t *tileRowMinY = 0;
+static uint16_t *tileRowMaxY = 0;
 
-        if (diff == 0) // Both 1st and 2nd pixels are the same
-          continue;
+#define NUM_TILES_X ((gpuFrameWidth + DIFF_TILE_SIZE - 1) / DIFF_TILE_SIZE)
+#define NUM_TILES_Y ((gpuFrameHeight + DIFF_TILE_SIZE - 1) / DIFF_TILE_SIZE)
 
-        if (diff & 0xFFFF == 0) // 1st pixels are the same, 2nd pixels are not
-        {
-          spanStart = scanline - 1;
-          spanEnd = scanline;
-        }
-        else // 1st pixels are different
+int MaxNumTiledDiffSpans()
+{
+  // Runs of dirty tiles are separated by at least one clean tile, so there are at most ceil(numTilesX/2) runs per row of tiles. In progressive
+  // mode, each run produces one span, and in interlaced mode, one span on each scanline of the field, i.e. on ceil(gpuFrameHeight/2) scanlines.
+  const int maxRunsPerTileRow = (NUM_TILES_X + 1) / 2;
+#ifdef NO_INTERLACING
+  return maxRunsPerTileRow * NUM_TILES_Y;
+#else
+  return maxRunsPerTileRow * ((gpuFrameHeight + 1) / 2);
+#endif
+}
+
+void DiffFramebuffersToTiledSpans(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head)
+{
+  const int numTilesX = NUM_TILES_X;
+  const int numTilesY = NUM_TILES_Y;
+  if (!tileBitmap)
+  {
+    tileBitmapStride = (numTilesX + 31) / 32;
+    tileBitmap = (uint32_t *)Malloc(tileBitmapStride * numTilesY * sizeof(uint32_t), "diff.cpp tile bitmap");
+    tileRowMinY = (uint16_t *)Malloc(numTilesY * sizeof(uint16_t), "diff.cpp tile row min y");
+    tileRowMaxY = (uint16_t *)Malloc(numTilesY * sizeof(uint16_t), "diff.cpp tile row max y");
+  }
+  memset(tileBitmap, 0, tileBitmapStride * numTilesY * sizeof(uint32_t));
+
+  const int W = gpuFrameWidth;
+  const int stride = gpuFramebufferScanlineStrideBytes>>1; // Stride as uint16 elements.
+  const int yInc = interlacedDiff ? 2 : 1; // If doing an interlaced update, skip over every second scanline.
+
+  // Pass 1: Stream through the scanlines of both framebuffers once, top to bottom, and mark dirty tiles. Tiles that have already
+  // been found dirty on an earlier scanline are only compared again until some tile on the scanline is found changed, since that
+  // scanline then extends the changed scanlines of the row of tiles anyway.
+  bool anyDirty = false;
+  for(int ty = 0; ty < numTilesY; ++ty)
+  {
+    uint32_t *tileRow = tileBitmap + ty * tileBitmapStride;
+    int numDirtyTiles = 0;
+    int minY = -1, maxY = -1;
+    int y = ty * DIFF_TILE_SIZE;
+    if (interlacedDiff && (y & 1) != interlacedFieldParity) ++y;
+    const int endY = MIN(gpuFrameHeight, (ty + 1) * DIFF_TILE_SIZE);
+    for(; y < endY; y += yInc)
+    {
+      if (SCANLINE_UNCHANGED(y))
+        continue;
+      const uint16_t *scanline = framebuffer + y*stride;
+      const uint16_t *prevScanline = prevFramebuffer + y*stride;
+      bool scanlineChanged = false;
+      for(int tx = 0; tx < numTilesX; ++tx)
+      {
+        const int x = tx * DIFF_TILE_SIZE;
+        const int endX = MIN(W, x + DIFF_TILE_SIZE);
+        if ((tileRow[tx>>5] & (1u << (tx&31))))
         {
-          spanStart = scanline - 2;
-          if ((diff & 0xFFFF0000u) != 0) // 2nd pixels are different?
-          {
-            spanEnd = scanline;
-          }
-          else
-          {
-            spanEnd = scanline - 1;
-            numConsecutiveUnchangedPixels = 1;
-          }
+          // Already dirty, but still need to know whether this scanline changed to track the vertical extents of the row of tiles
+          if (!scanlineChanged)
+            scanlineChanged = FirstChangedPixel(scanline, prevScanline, x, endX) < endX;
+          continue;
         }
-
-        // We've found a start of a span of different pixels on this scanline, now find where this span ends
-        while(scanline < scanlineEnd)
+        if (FirstChangedPixel(scanline, prevScanline, x, endX) < endX)
         {
-          if (*scanline++ != *prevScanline++)
-          {
-            spanEnd = scanline;
-            numConsecutiveUnchangedPixels = 0;
-          }
-          else
-          {
-            if (++numConsecutiveUnchangedPixels > SPAN_MERGE_THRESHOLD)
-              break;
-          }
+          tileRow[tx>>5] |= 1u << (tx&31);
+          ++numDirtyTiles;
+          scanlineChanged = true;
         }
       }
-      else // handle the single last pixel on the row
+      if (scanlineChanged)
       {
-        if (*scanline++ == *prevScanline++)
-          break;
-
-        spanStart = scanline - 1;
-        spanEnd = scanline;
+        if (minY < 0) minY = y;
+        maxY = y;
+      }
+      if (numDirtyTiles == numTilesX)
+      {
+        // All tiles on this row are dirty, no need to look at the remaining scanlines.
+        maxY = endY - 1;
+        if (interlacedDiff && (maxY & 1) != interlacedFieldParity) --maxY;
+        break;
       }
+    }
+    tileRowMinY[ty] = (uint16_t)MAX(minY, 0);
+    tileRowMaxY[ty] = (uint16_t)MAX(maxY, 0);
+    if (numDirtyTiles > 0) anyDirty = true;
+  }
 
-      // Submit the span update task
-      Span *span = spans + numSpans;
-      span->x = spanStart - scanlineStart;
-      span->endX = span->lastScanEndX = spanEnd - scanlineStart;
-      span->y = y;
-      span->endY = y+1;
-      span->size = spanEnd - spanStart;
-      if (numSpans > 0) span[-1].next = span;
-      else head = span;
-      span->next = 0;
-      ++numSpans;
+  head = 0;
+  if (!anyDirty)
+    return;
+
+  // Pass 2: Convert horizontal runs of dirty tiles to spans. Progressive updates produce one rectangle per run of tiles, spanning
+  // the changed scanlines of that row of tiles, interlaced updates produce one span per scanline of the current field.
+  int numSpans = 0;
+  for(int ty = 0; ty < numTilesY; ++ty)
+  {
+    const uint32_t *tileRow = tileBitmap + ty * tileBitmapStride;
+    bool rowDirty = false;
+    for(int i = 0; i < tileBitmapStride; ++i)
+      if (tileRow[i]) rowDirty = true;
+    if (!rowDirty) continue;
+
+    const int minY = tileRowMinY[ty];
+    const int endY = interlacedDiff ? tileRowMaxY[ty] + 1 : minY + 1;
+    for(int y = minY; y < endY; y += yInc)
+    {
+      int tx = 0;
+      while(tx < numTilesX)
+      {
+        if (!(tileRow[tx>>5] & (1u << (tx&31)))) { ++tx; continue; }
+        int runStart = tx;
+        while(tx < numTilesX && (tileRow[tx>>5] & (1u << (tx&31)))) ++tx;
+
+        Span *span = spans + numSpans;
+        span->x = runStart * DIFF_TILE_SIZE;
+        span->endX = span->lastScanEndX = MIN(W, tx * DIFF_TILE_SIZE);
+        span->y = y;
+        span->endY = interlacedDiff ? y + 1 : tileRowMaxY[ty] + 1;
+        span->size = (span->endX - span->x) * (span->endY - span->y);
+        if (numSpans > 0) span[-1].next = span;
+        else head = span;
+        span->next = 0;
+        ++numSpans;
+      }
     }
-    y += yInc;
-    scanline += scanlineEndInc;
-    prevScanline += scanlineEndInc;
   }
 }
 
+#endif
+
+int NumPixelsInSpans(Span *listHead)
+{
+  int numPixels = 0;
+  for(Span *i = listHead; i; i = i->next)
+    numPixels += i->size;
+  return numPixels;
+}
+
+void SelectInterlacedFieldSpans(Span *&head, int interlacedFieldParity)
+{
+  Span **prevNext = &head;
+  for(Span *i = head; i; i = i->next)
+    if ((i->y & 1) == interlacedFieldParity)
+    {
+      *prevNext = i;
+      prevNext = &i->next;
+    }
+  *prevNext = 0;
+}
+
+// Predicts the SPI bus cost, in bytes, of submitting a span on scanlines [y, endY[ with the given number of pixels as its own set of tasks:
+// moving the Y cursor to the span, setting the X cursor (single line spans) or the X window (multiline spans), and writing the pixels.
+static inline int PredictSpanSubmitCost(int y, int endY, int size)
+{
+  return SPAN_COST_CURSOR_MOVE_TASK + ((endY > y+1) ? SPAN_COST_SET_WINDOW_TASK : SPAN_COST_CURSOR_MOVE_TASK) + SPAN_COST_WRITE_PIXELS_TASK + size*SPI_BYTESPERPIXEL;
+}
+
 void MergeScanlineSpanList(Span *listHead)
 {
   for(Span *i = listHead; i; i = i->next)
@@ -460,15 +841,17 @@ void MergeScanlineSpanList(Span *listHead)
       // (the list is nondecreasing with respect to Span::y)
       if (j->y > i->endY) break;
 
-      // Merge the spans i and j, and figure out the wastage of doing so
+      // Merge the spans i and j, and figure out whether the merged span is predicted to be cheaper to submit than the two separate spans
       int x = MIN(i->x, j->x);
       int y = MIN(i->y, j->y);
       int endX = MAX(i->endX, j->endX);
       int endY = MAX(i->endY, j->endY);
       int lastScanEndX = (endY > i->endY) ? j->lastScanEndX : ((endY > j->endY) ? i->lastScanEndX : MAX(i->lastScanEndX, j->lastScanEndX));
       int newSize = (endX-x)*(endY-y-1) + (lastScanEndX - x);
-      int wastedPixels = newSize - i->size - j->size;
-      if (wastedPixels <= SPAN_MERGE_THRESHOLD
+      int separateCost = PredictSpanSubmitCost(i->y, i->endY, i->size) + PredictSpanSubmitCost(j->y, j->endY, j->size);
+      if (j->y == i->y) separateCost -= SPAN_COST_CURSOR_MOVE_TASK; // Span j would not need to move the Y cursor if it starts on the same scanline as i
+      int mergedCost = PredictSpanSubmitCost(y, endY, newSize);
+      if (mergedCost <= separateCost && !SpanCrossesScrollWrap(y, endY)
 #ifdef MAX_SPI_TASK_SIZE
         && newSize*SPI_BYTESPERPIXEL <= MAX_SPI_TASK_SIZE
 #endif
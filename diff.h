@@ -12,6 +12,25 @@ struct Span
 
 extern Span *spans;
 
+// The scanline diffing functions only compare the scanlines in [changedScanlinesStart, changedScanlinesEnd[, and treat the rest as unchanged.
+// Set to the whole frame, unless it is known that the other scanlines of the current frame match the previous framebuffer.
+extern int changedScanlinesStart, changedScanlinesEnd;
+
+#ifdef SCANLINE_HASH_DIFF
+// Hashes of each scanline of the current frame [0], and of the frame contents that the previous framebuffer holds [1]. The hashes are
+// computed from the captured frame before the statistics overlay and the low battery icon are drawn on it. If the hashes of a scanline
+// are equal, the scanline is identical in both framebuffers and the diffing functions skip it.
+extern uint64_t *framebufferScanlineHashes[2];
+
+// Marks all scanlines of the previous framebuffer as changed, e.g. after its contents were modified by something else than a frame update.
+void InvalidatePrevFramebufferScanlineHashes(void);
+
+// Called after the diffed spans have been submitted and copied to the previous framebuffer, to record that the scanlines that were diffed
+// (all, or only the given field if interlacedUpdate) now hold the contents of the current frame.
+void UpdatePrevFramebufferScanlineHashes(bool interlacedUpdate, int interlacedFieldParity);
+#endif
+
+// Spans are merged and split based on a cost model of the SPI bus, where all costs are measured in bytes worth of SPI bus time.
 // Looking at SPI communication in a logic analyzer, it is observed that waiting for the finish of an SPI command FIFO causes pretty exactly one byte of delay to the command stream.
 // Therefore the time/bandwidth cost of ending the current span and starting a new span is as follows:
 // 1 byte to wait for the current SPI FIFO batch to finish,
@@ -23,16 +42,60 @@ extern Span *spans;
 // +1 byte to wait for that FIFO to flush,
 // after which the communication is ready to start pushing pixels. This totals to 8 bytes, or 4 pixels, meaning that if there are 4 unchanged pixels or less between two adjacent dirty
 // spans, it is all the same to just update through those pixels as well to not have to wait to flush the FIFO.
+// The following per-controller calibration table gives the components of this cost:
+// SPAN_COST_FIFO_FLUSH: delay of waiting for the SPI FIFO to flush,
+// SPAN_COST_COMMAND: cost of sending a command byte,
+// SPAN_COST_COORDINATE: cost of sending a single cursor coordinate,
+// SPAN_COST_TASK_SETUP: any additional fixed cost of starting a new SPI task (e.g. DMA setup)
+// With this table, SPAN_MERGE_THRESHOLD below comes out as 4 pixels on most displays, 6 on HX8357D, 10 on displays with a 16-bit wide bus,
+// and 320 if all tasks are sent with DMA. The exception are the displays that take 3 bytes per pixel (ILI9486L, ILI9488): their 10 bytes of
+// span overhead are worth 3.33 pixels, so the threshold is 3 pixels there, where it used to be the 4 pixels of the 2 bytes per pixel displays.
+#if defined(DISPLAY_SPI_BUS_IS_16BITS_WIDE)
+// Commands and coordinates are sent as 16-bit words on these displays, and FIFO flushes were observed to be slightly slower.
+#define SPAN_COST_FIFO_FLUSH 2
+#define SPAN_COST_COMMAND 2
+#define SPAN_COST_COORDINATE 4
+#else
+#define SPAN_COST_FIFO_FLUSH 1
+#define SPAN_COST_COMMAND 1
+#ifdef DISPLAY_SET_CURSOR_IS_8_BIT
+#define SPAN_COST_COORDINATE 1
+#else
+#define SPAN_COST_COORDINATE 2
+#endif
+#endif
+
+// Cost of the commands that move the write cursor on one axis. Displays that need to always send the full window send two coordinates.
+#ifdef MUST_SEND_FULL_CURSOR_WINDOW
+#define SPAN_COST_CURSOR_MOVE_COMMANDS (SPAN_COST_FIFO_FLUSH + SPAN_COST_COMMAND + SPAN_COST_FIFO_FLUSH + 2*SPAN_COST_COORDINATE)
+#else
+#define SPAN_COST_CURSOR_MOVE_COMMANDS (SPAN_COST_FIFO_FLUSH + SPAN_COST_COMMAND + SPAN_COST_FIFO_FLUSH + SPAN_COST_COORDINATE)
+#endif
+// Cost of the commands that set both the start and end of the write window on one axis.
+#define SPAN_COST_SET_WINDOW_COMMANDS (SPAN_COST_FIFO_FLUSH + SPAN_COST_COMMAND + SPAN_COST_FIFO_FLUSH + 2*SPAN_COST_COORDINATE)
+// Cost of the command that starts writing pixels, excluding the pixel data itself.
+#define SPAN_COST_WRITE_PIXELS_COMMANDS (SPAN_COST_FIFO_FLUSH + SPAN_COST_COMMAND + SPAN_COST_FIFO_FLUSH)
+
 #if defined(ALL_TASKS_SHOULD_DMA)
-#define SPAN_MERGE_THRESHOLD 320
-#elif defined(DISPLAY_SPI_BUS_IS_16BITS_WIDE)
-#define SPAN_MERGE_THRESHOLD 10
+// Each DMA transfer needs to set up a new control block chain and wait for the previous transfer to finish, which dominates the cost of a task.
+// Measured as a whole, it is cheaper to send up to 320 unchanged pixels than to start a new span (a cursor move and a pixel write task).
+#define SPAN_COST_TASK_SETUP ((320*SPI_BYTESPERPIXEL - SPAN_COST_CURSOR_MOVE_COMMANDS - SPAN_COST_WRITE_PIXELS_COMMANDS) / 2)
 #elif defined(HX8357D)
-#define SPAN_MERGE_THRESHOLD 6
+#define SPAN_COST_TASK_SETUP 1
 #else
-#define SPAN_MERGE_THRESHOLD 4
+#define SPAN_COST_TASK_SETUP 0
 #endif
 
+// Cost of a task that moves the write cursor on one axis.
+#define SPAN_COST_CURSOR_MOVE_TASK (SPAN_COST_TASK_SETUP + SPAN_COST_CURSOR_MOVE_COMMANDS)
+// Cost of a task that sets both the start and end of the write window on one axis.
+#define SPAN_COST_SET_WINDOW_TASK (SPAN_COST_TASK_SETUP + SPAN_COST_SET_WINDOW_COMMANDS)
+// Fixed cost of the pixel write task, excluding the pixel data itself.
+#define SPAN_COST_WRITE_PIXELS_TASK (SPAN_COST_TASK_SETUP + SPAN_COST_WRITE_PIXELS_COMMANDS)
+
+// Number of unchanged pixels between two changed pixels on the same scanline that it is cheaper to send than to start a new span.
+#define SPAN_MERGE_THRESHOLD ((SPAN_COST_CURSOR_MOVE_TASK + SPAN_COST_WRITE_PIXELS_TASK) / SPI_BYTESPERPIXEL)
+
 void DiffFramebuffersToSingleChangedRectangle(uint16_t *framebuffer, uint16_t *prevFramebuffer, Span *&head);
 
 void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head);
@@ -41,4 +104,29 @@ void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, ui
 
 void NoDiffChangedRectangle(Span *&head);
 
+#ifdef TILED_PIXEL_DIFF
+// Returns the max number of spans that DiffFramebuffersToTiledSpans() can produce for the current framebuffer size.
+int MaxNumTiledDiffSpans(void);
+
+void DiffFramebuffersToTiledSpans(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head);
+#endif
+
 void MergeScanlineSpanList(Span *listHead);
+
+// Returns the total number of pixels covered by the given span list.
+int NumPixelsInSpans(Span *listHead);
+
+// Removes all spans from a list of single scanline spans that do not lie on the given interlaced field.
+void SelectInterlacedFieldSpans(Span *&head, int interlacedFieldParity);
+
+// Upper bound for the number of spans that the scanline diffing functions produce on a single scanline.
+#define MAX_SPANS_PER_SCANLINE (gpuFrameWidth/2 + 1)
+
+#ifdef PARALLEL_PIXEL_DIFF
+void InitDiffThreads(void);
+void DeinitDiffThreads(void);
+
+// Splits the framebuffer into NUM_DIFF_THREADS horizontal bands, and calls job(band, y, endY) for each band [y, endY[ in parallel.
+// The calling thread processes band 0, and the call returns after all bands have finished.
+void RunDiffJobInParallel(void (*job)(int band, int y, int endY));
+#endif
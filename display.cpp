@@ -4,6 +4,12 @@
 
 #include <memory.h>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+// If building with NEON available, pixels are converted to the display format 16 pixels at a time with SIMD
+#define DISPLAY_USE_NEON
+#endif
+
 void ClearScreen()
 {
   for(int y = 0; y < DISPLAY_HEIGHT; ++y)
@@ -37,3 +43,232 @@ void ClearScreen()
 #endif
 }
 
+// Converts the given framebuffer pixels to the format that the display takes, and optionally copies them to prev on the same pass, so that
+// each pixel is only read once. updatePrev is known at compile time at each call site, so the branches on it are hoisted away.
+static inline void CopyPixels(const uint16_t *src, uint16_t *prev, uint8_t *dst, int numPixels, bool updatePrev)
+{
+#ifdef DISPLAY_USE_NEON
+  while(numPixels >= 16)
+  {
+    uint16x8_t lo = vld1q_u16(src);
+    uint16x8_t hi = vld1q_u16(src + 8);
+    if (updatePrev)
+    {
+      vst1q_u16(prev, lo);
+      vst1q_u16(prev + 8, hi);
+      prev += 16;
+    }
+#ifdef DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2
+    // Narrow 16 pixels into one vector per color channel, and let vst3q_u8() interleave them to packed 24-bit pixels
+    uint8x16x3_t rgb;
+    uint8x16_t r = vandq_u8(vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)), vdupq_n_u8(0xF8));
+    uint8x16_t b = vshlq_n_u8(vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)), 3);
+    rgb.val[0] = vorrq_u8(r, vshrq_n_u8(r, 5));
+    rgb.val[1] = vandq_u8(vcombine_u8(vshrn_n_u16(lo, 3), vshrn_n_u16(hi, 3)), vdupq_n_u8(0xFC));
+    rgb.val[2] = vorrq_u8(b, vshrq_n_u8(b, 5));
+    vst3q_u8(dst, rgb);
+    dst += 48;
+#else
+    vst1q_u8(dst, vrev16q_u8(vreinterpretq_u8_u16(lo)));
+    vst1q_u8(dst + 16, vrev16q_u8(vreinterpretq_u8_u16(hi)));
+    dst += 32;
+#endif
+    src += 16;
+    numPixels -= 16;
+  }
+#endif
+
+#ifdef DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2
+  while(numPixels-- > 0)
+  {
+    uint16_t pixel = *src++;
+    if (updatePrev) *prev++ = pixel;
+    uint16_t r = (pixel >> 8) & 0xF8;
+    uint16_t g = (pixel >> 3) & 0xFC;
+    uint16_t b = (pixel << 3) & 0xF8;
+    dst[0] = r | (r >> 5); // On red and blue color channels, need to expand 5 bits to 6 bits. Do that by duplicating the highest bit as lowest bit.
+    dst[1] = g;
+    dst[2] = b | (b >> 5);
+    dst += 3;
+  }
+#else
+  uint16_t *data = (uint16_t*)dst;
+  if (numPixels > 0 && ((uintptr_t)src & 2))
+  {
+    if (updatePrev) *prev++ = *src;
+    *data++ = __builtin_bswap16(*src++);
+    --numPixels;
+  }
+  for(; numPixels >= 2; numPixels -= 2)
+  {
+    uint32_t u = *(uint32_t*)src;
+    if (updatePrev)
+    {
+      *(uint32_t*)prev = u;
+      prev += 2;
+    }
+    *(uint32_t*)data = ((u & 0xFF00FF00U) >> 8) | ((u & 0x00FF00FFU) << 8);
+    data += 2;
+    src += 2;
+  }
+  if (numPixels > 0)
+  {
+    if (updatePrev) *prev = *src;
+    *data = __builtin_bswap16(*src);
+  }
+#endif
+}
+
+void CopyPixelsToSPITask(const uint16_t *pixels, uint16_t *prevPixels, uint8_t *dst, int numPixels)
+{
+  if (prevPixels) CopyPixels(pixels, prevPixels, dst, numPixels, true);
+  else CopyPixels(pixels, 0, dst, numPixels, false);
+}
+
+#ifdef DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2
+static inline uint32_t PixelToR6X2G6X2B6X2(uint16_t pixel)
+{
+  uint32_t r = (pixel >> 8) & 0xF8;
+  uint32_t g = (pixel >> 3) & 0xFC;
+  uint32_t b = (pixel << 3) & 0xF8;
+  return (r | (r >> 5)) | (g << 8) | ((b | (b >> 5)) << 16);
+}
+
+// Stores the whole blocks of four pixels after the pendingBytes bytes in pending, and returns the next word to store to
+static inline uint32_t *CopyPixelBlocksToWords(const uint16_t *src, uint16_t *prev, uint32_t *dst, int numPixels, uint64_t &pending, const int pendingBytes, bool updatePrev)
+{
+  for(; numPixels >= 4; numPixels -= 4, src += 4)
+  {
+    if (updatePrev)
+    {
+      memcpy(prev, src, 4*sizeof(uint16_t));
+      prev += 4;
+    }
+    uint32_t rgb0 = PixelToR6X2G6X2B6X2(src[0]), rgb1 = PixelToR6X2G6X2B6X2(src[1]), rgb2 = PixelToR6X2G6X2B6X2(src[2]), rgb3 = PixelToR6X2G6X2B6X2(src[3]);
+    pending |= (uint64_t)(rgb0 | (rgb1 << 24)) << (8*pendingBytes);
+    *dst++ = (uint32_t)pending;
+    pending = (pending >> 32) | ((uint64_t)((rgb1 >> 8) | (rgb2 << 16)) << (8*pendingBytes));
+    *dst++ = (uint32_t)pending;
+    pending = (pending >> 32) | ((uint64_t)((rgb2 >> 16) | (rgb3 << 8)) << (8*pendingBytes));
+    *dst++ = (uint32_t)pending;
+    pending >>= 32;
+  }
+  return dst;
+}
+#endif
+
+static inline void CopyPixelsToWords(const uint16_t *src, uint16_t *prev, SPITaskWordWriter *writer, int numPixels, bool updatePrev)
+{
+  uint32_t *dst = writer->dst;
+#ifdef DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2
+  // Four pixels fill three words, so accumulate the 3-byte pixels to 64 bits after the pending bytes, and store out the words that fill up.
+  // Blocks of four pixels leave the number of pending bytes unchanged, so each possible number gets its own loop with constant shifts.
+  uint64_t pending = writer->pending;
+  int pendingBytes = writer->pendingBytes;
+  switch(pendingBytes)
+  {
+  case 0: dst = CopyPixelBlocksToWords(src, prev, dst, numPixels, pending, 0, updatePrev); break;
+  case 1: dst = CopyPixelBlocksToWords(src, prev, dst, numPixels, pending, 1, updatePrev); break;
+  case 2: dst = CopyPixelBlocksToWords(src, prev, dst, numPixels, pending, 2, updatePrev); break;
+  default: dst = CopyPixelBlocksToWords(src, prev, dst, numPixels, pending, 3, updatePrev); break;
+  }
+  src += numPixels & ~3;
+  if (updatePrev) prev += numPixels & ~3;
+  numPixels &= 3;
+  while(numPixels-- > 0)
+  {
+    uint16_t pixel = *src++;
+    if (updatePrev) *prev++ = pixel;
+    pending |= (uint64_t)PixelToR6X2G6X2B6X2(pixel) << (8*pendingBytes);
+    pendingBytes += 3;
+    if (pendingBytes >= 4)
+    {
+      *dst++ = (uint32_t)pending;
+      pending >>= 32;
+      pendingBytes -= 4;
+    }
+  }
+  writer->pending = (uint32_t)pending;
+  writer->pendingBytes = pendingBytes;
+#else
+  // Each word holds two big endian pixels. After an odd number of pixels, the first pixel of a word is the pending one
+  bool odd = writer->pendingBytes != 0;
+  uint32_t pending = writer->pending;
+#ifdef DISPLAY_USE_NEON
+  if (numPixels >= 16)
+  {
+    // Shift the byte swapped pixels by one lane through the pending pixel, so that each vector store writes whole words
+    uint16x8_t carry = vsetq_lane_u16((uint16_t)pending, vdupq_n_u16(0), 7);
+    while(numPixels >= 16)
+    {
+      uint16x8_t lo = vld1q_u16(src);
+      uint16x8_t hi = vld1q_u16(src + 8);
+      if (updatePrev)
+      {
+        vst1q_u16(prev, lo);
+        vst1q_u16(prev + 8, hi);
+        prev += 16;
+      }
+      lo = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(lo)));
+      hi = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(hi)));
+      if (odd)
+      {
+        vst1q_u32(dst, vreinterpretq_u32_u16(vextq_u16(carry, lo, 7)));
+        vst1q_u32(dst + 4, vreinterpretq_u32_u16(vextq_u16(lo, hi, 7)));
+        carry = hi;
+      }
+      else
+      {
+        vst1q_u32(dst, vreinterpretq_u32_u16(lo));
+        vst1q_u32(dst + 4, vreinterpretq_u32_u16(hi));
+      }
+      dst += 8;
+      src += 16;
+      numPixels -= 16;
+    }
+    pending = vgetq_lane_u16(carry, 7);
+  }
+#endif
+  if (odd && numPixels > 0)
+  {
+    if (updatePrev) *prev++ = *src;
+    *dst++ = pending | ((uint32_t)__builtin_bswap16(*src++) << 16);
+    --numPixels;
+    odd = false;
+  }
+  for(; numPixels >= 2; numPixels -= 2)
+  {
+    uint32_t u = src[0] | ((uint32_t)src[1] << 16);
+    if (updatePrev)
+    {
+      prev[0] = src[0];
+      prev[1] = src[1];
+      prev += 2;
+    }
+    *dst++ = ((u & 0xFF00FF00U) >> 8) | ((u & 0x00FF00FFU) << 8);
+    src += 2;
+  }
+  if (numPixels > 0)
+  {
+    if (updatePrev) *prev = *src;
+    pending = __builtin_bswap16(*src);
+    odd = true;
+  }
+  writer->pending = pending;
+  writer->pendingBytes = odd ? 2 : 0;
+#endif
+  writer->dst = dst;
+}
+
+void CopyPixelsToSPITaskWords(const uint16_t *pixels, uint16_t *prevPixels, SPITaskWordWriter *writer, int numPixels)
+{
+  if (prevPixels) CopyPixelsToWords(pixels, prevPixels, writer, numPixels, true);
+  else CopyPixelsToWords(pixels, 0, writer, numPixels, false);
+}
+
+void FlushSPITaskWords(SPITaskWordWriter *writer)
+{
+  if (writer->pendingBytes > 0) *writer->dst++ = writer->pending;
+  writer->pending = 0;
+  writer->pendingBytes = 0;
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <inttypes.h>
+
 #include "config.h"
 
 // Configure the desired display update rate. Use 120 for max performance/minimized latency, and 60/50/30/24 etc. for regular content, or to save battery.
@@ -79,6 +81,27 @@
 #define DISPLAY_DRAWABLE_WIDTH (DISPLAY_WIDTH-DISPLAY_COVERED_LEFT_SIDE-DISPLAY_COVERED_RIGHT_SIDE)
 #define DISPLAY_DRAWABLE_HEIGHT (DISPLAY_HEIGHT-DISPLAY_COVERED_TOP_SIDE-DISPLAY_COVERED_BOTTOM_SIDE)
 
+// Hardware scrolling runs in the native scanline direction of the panel, so it can only be used if framebuffer scanlines map directly to panel scanlines.
+#ifdef DISPLAY_VERTICAL_SCROLL_DETECTION
+#if !defined(DISPLAY_SUPPORTS_VERTICAL_SCROLLING)
+#error DISPLAY_VERTICAL_SCROLL_DETECTION requires a display controller that supports hardware vertical scrolling (ILI9341)!
+#elif defined(DISPLAY_FLIP_ORIENTATION_IN_HARDWARE) || defined(DISPLAY_ROTATE_180_DEGREES)
+#error DISPLAY_VERTICAL_SCROLL_DETECTION is not compatible with flipping or rotating the display orientation in hardware! Enable DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE and disable DISPLAY_ROTATE_180_DEGREES.
+#elif defined(TILED_PIXEL_DIFF)
+#error DISPLAY_VERTICAL_SCROLL_DETECTION is not compatible with TILED_PIXEL_DIFF!
+#elif defined(ALL_TASKS_SHOULD_DMA) && (defined(UPDATE_FRAMES_WITHOUT_DIFFING) || defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF))
+#error DISPLAY_VERTICAL_SCROLL_DETECTION requires per-scanline diffing, and is not compatible with UPDATE_FRAMES_WITHOUT_DIFFING or UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF!
+#elif defined(DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE)
+// The software flip transposes the framebuffer, so its scanlines, and the scroll direction of the panel, are the columns of the output image.
+#warning DISPLAY_VERTICAL_SCROLL_DETECTION with DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE scrolls along the native orientation of the panel, so only horizontal scrolling of the output image is detected, not vertical!
+#endif
+#endif
+
+// Scanline hashes only speed up the per-scanline and tiled diffing functions.
+#if defined(SCANLINE_HASH_DIFF) && defined(ALL_TASKS_SHOULD_DMA) && (defined(UPDATE_FRAMES_WITHOUT_DIFFING) || defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF))
+#error SCANLINE_HASH_DIFF requires per-scanline or tiled diffing, and is not compatible with UPDATE_FRAMES_WITHOUT_DIFFING or UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF!
+#endif
+
 #ifndef DISPLAY_SPI_DRIVE_SETTINGS
 #define DISPLAY_SPI_DRIVE_SETTINGS (0)
 #endif
@@ -91,7 +114,11 @@
 #define SPI_BYTESPERPIXEL 2
 #endif
 
-#if (DISPLAY_DRAWABLE_WIDTH % 16 == 0) && defined(ALL_TASKS_SHOULD_DMA) &&!defined(USE_SPI_THREAD) && defined(USE_GPU_VSYNC) && !defined(DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2) && !defined(SPI_3WIRE_PROTOCOL)
+#if defined(SEND_PIXELS_WITH_DMA_2D_STRIDE) && defined(DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2)
+#error SEND_PIXELS_WITH_DMA_2D_STRIDE sends the pixels as they are in the framebuffer, so it is not compatible with displays that take R6X2G6X2B6X2 pixels!
+#endif
+
+#if (DISPLAY_DRAWABLE_WIDTH % 16 == 0) && defined(ALL_TASKS_SHOULD_DMA) &&!defined(USE_SPI_THREAD) && defined(USE_GPU_VSYNC) && !defined(DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2) && !defined(SPI_3WIRE_PROTOCOL) && !defined(SEND_PIXELS_WITH_DMA_2D_STRIDE)
 // If conditions are suitable, defer moving pixels until the very last moment in dma.cpp when we are about
 // to kick off DMA tasks.
 // TODO: 3-wire SPI displays are not yet compatible with this path. Implement support for this to optimize performance of 3-wire SPI displays on Pi Zero. (Pi 3B does not care that much)
@@ -107,6 +134,25 @@ void TurnDisplayOff(void);
 
 void DeinitSPIDisplay(void);
 
+// Converts the given RGB565 framebuffer pixels to the SPI_BYTESPERPIXEL format that the display takes (big endian RGB565, or packed R6X2G6X2B6X2),
+// and writes them to dst. If prevPixels is not null, the pixels are also copied there on the same pass, to update the previous framebuffer.
+void CopyPixelsToSPITask(const uint16_t *pixels, uint16_t *prevPixels, uint8_t *dst, int numPixels);
+
+// Writes converted pixels like CopyPixelsToSPITask(), but only with aligned 32-bit stores, so that they can be written straight into the
+// uncached SPI task queue, where unaligned accesses fault. (See SPI_TASK_QUEUE_IN_DMA_MEMORY in config.h) The pixels of consecutive calls
+// are packed back to back, so the bytes that do not fill a whole word yet are held in the writer until FlushSPITaskWords() stores them.
+typedef struct SPITaskWordWriter
+{
+  uint32_t *dst; // Next word to store to
+  uint32_t pending; // Converted bytes that do not fill a whole word yet, starting from the lowest byte
+  int pendingBytes;
+} SPITaskWordWriter;
+
+void CopyPixelsToSPITaskWords(const uint16_t *pixels, uint16_t *prevPixels, SPITaskWordWriter *writer, int numPixels);
+
+// Stores the pending bytes of the writer, padded to a whole word.
+void FlushSPITaskWords(SPITaskWordWriter *writer);
+
 #if !defined(SPI_BUS_CLOCK_DIVISOR)
 #error Please define -DSPI_BUS_CLOCK_DIVISOR=<some even number> on the CMake command line! This parameter along with core_freq=xxx in /boot/config.txt defines the SPI display speed. (spi speed = core_freq / SPI_BUS_CLOCK_DIVISOR)
 #endif
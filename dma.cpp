@@ -5,6 +5,10 @@
 #include <inttypes.h> // uint32_t
 #include <syslog.h> // syslog
 #include <sys/mman.h> // mmap, munmap, PROT_READ, PROT_WRITE
+#include <fcntl.h> // open, O_RDWR
+#include <unistd.h> // read, write, close
+#include <poll.h> // poll, POLLIN
+#include <errno.h> // errno, EINTR
 #endif
 
 #include "config.h"
@@ -13,6 +17,7 @@
 #include "gpu.h"
 #include "util.h"
 #include "mailbox.h"
+#include "simulator.h"
 
 #ifdef USE_DMA_TRANSFERS
 
@@ -38,8 +43,30 @@ struct GpuMemory
   uint32_t sizeBytes;
 };
 
+#ifdef SEND_FRAMES_AS_ONE_DMA_CHAIN
+// Each task of a frame takes up to a dozen control blocks in the chain
+#define NUM_DMA_CBS 4096
+#else
 #define NUM_DMA_CBS 1024
+#endif
 GpuMemory dmaCb, dmaSourceBuffer, dmaConstantData;
+#ifdef SPI_TASK_QUEUE_IN_DMA_MEMORY
+GpuMemory spiTaskQueue;
+#endif
+
+#ifdef DMA_COMPLETION_UIO_DEVICE
+// Userspace I/O device that delivers the interrupt of the DMA RX channel
+static int dmaCompletionFd = -1;
+// True if a DMA transfer has been started whose completion interrupt has not yet been waited for
+static bool dmaCompletionInterruptPending = false;
+
+// Writing 1 to an UIO device unmasks its interrupt line, which the kernel masks again each time the interrupt fires
+static void EnableDMACompletionInterrupt()
+{
+  uint32_t enable = 1;
+  if (write(dmaCompletionFd, &enable, sizeof(enable)) != sizeof(enable)) FATAL_ERROR("Failed to enable DMA completion interrupt on " DMA_COMPLETION_UIO_DEVICE "!");
+}
+#endif
 
 volatile DMAControlBlock *dmaSendTail = 0;
 volatile DMAControlBlock *dmaRecvTail = 0;
@@ -140,8 +167,12 @@ GpuMemory AllocateUncachedGpuMemory(uint32_t numBytes, const char *reason)
   if (!mem.allocationHandle) FATAL_ERROR("Failed to allocate GPU memory! Try increasing gpu_mem allocation in /boot/config.txt. See https://www.raspberrypi.org/documentation/configuration/config-txt/memory.md");
   mem.busAddress = Mailbox(MEM_LOCK_MESSAGE, mem.allocationHandle);
   if (!mem.busAddress) FATAL_ERROR("Failed to lock GPU memory!");
+#ifdef SIMULATE_PERIPHERALS
+  mem.virtualAddr = SimulatedGpuMemory(mem.busAddress);
+#else
   mem.virtualAddr = mmap(0, mem.sizeBytes, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, BUS_TO_PHYS(mem.busAddress));
   if (mem.virtualAddr == MAP_FAILED) FATAL_ERROR("Failed to mmap GPU memory!");
+#endif
   totalGpuMemoryUsed += mem.sizeBytes;
 //  printf("Allocated %u bytes of GPU memory for %s (bus address=%p). Total GPU memory used: %llu bytes\n", mem.sizeBytes, reason, (void*)mem.busAddress, totalGpuMemoryUsed);
   return mem;
@@ -150,7 +181,9 @@ GpuMemory AllocateUncachedGpuMemory(uint32_t numBytes, const char *reason)
 void FreeUncachedGpuMemory(GpuMemory mem)
 {
   totalGpuMemoryUsed -= mem.sizeBytes;
+#ifndef SIMULATE_PERIPHERALS
   munmap(mem.virtualAddr, mem.sizeBytes);
+#endif
   Mailbox(MEM_UNLOCK_MESSAGE, mem.allocationHandle);
   Mailbox(MEM_FREE_MESSAGE, mem.allocationHandle);
 }
@@ -238,13 +271,22 @@ int InitDMA()
   memset(dmaCb.virtualAddr, 0, dmaCb.sizeBytes); // Some fields of the CBs (debug, reserved) are initialized to zero and assumed to stay so throughout app lifetime.
   firstFreeCB = (volatile DMAControlBlock *)dmaCb.virtualAddr;
 
+#ifdef SPI_TASK_QUEUE_IN_DMA_MEMORY
+  // DMA transfers are sent directly from the task queue, so no separate DMA source buffer is needed
+  spiTaskQueue = AllocateUncachedGpuMemory(SPI_QUEUE_SIZE, "SPI task queue");
+  spiTaskMemory->buffer = (volatile uint8_t *)spiTaskQueue.virtualAddr;
+#else
   dmaSourceBuffer = AllocateUncachedGpuMemory(SHARED_MEMORY_SIZE*2, "DMA source data");
   dmaSourceEnd = (volatile uint8_t *)dmaSourceBuffer.virtualAddr;
+#endif
 
-  dmaConstantData = AllocateUncachedGpuMemory(2*sizeof(uint32_t), "DMA constant data");
+  dmaConstantData = AllocateUncachedGpuMemory(3*sizeof(uint32_t), "DMA constant data");
   uint32_t *constantData = (uint32_t *)dmaConstantData.virtualAddr;
   constantData[0] = BCM2835_SPI0_CS_DMAEN; // constantData[0] is for disableTransferActive task
   constantData[1] = BCM2835_DMA_CS_ACTIVE | BCM2835_DMA_CS_END; // constantData[1] is for startDMATxChannel task
+#ifdef GPIO_TFT_DATA_CONTROL
+  constantData[2] = 1 << GPIO_TFT_DATA_CONTROL; // constantData[2] is for setting and clearing the D/C line in SEND_FRAMES_AS_ONE_DMA_CHAIN chains
+#endif
 #endif
 
   LOG("DMA hardware register file is at ptr: %p, using DMA TX channel: %d and DMA RX channel: %d", dma0, dmaTxChannel, dmaRxChannel);
@@ -276,10 +318,21 @@ int InitDMA()
   if ((dmaRx->cb.debug & BCM2835_DMA_DEBUG_LITE) != 0)
     FATAL_ERROR("DMA RX channel cannot be a lite channel, because to get best performance we want to use BCM2835_DMA_TI_DEST_IGNORE DMA operation mode that lite DMA channels do not have. (Try using DMA RX channel value < 7)");
 
+#ifdef SEND_PIXELS_WITH_DMA_2D_STRIDE
+  if ((dmaTx->cb.debug & BCM2835_DMA_DEBUG_LITE) != 0)
+    FATAL_ERROR("DMA TX channel cannot be a lite channel when SEND_PIXELS_WITH_DMA_2D_STRIDE is enabled, because lite DMA channels do not have the BCM2835_DMA_TI_TDMODE 2D operation mode. (Try using DMA TX channel value < 7)");
+#endif
+
   LOG("Resetting DMA channels for use");
   ResetDMAChannels();
 
-  // TODO: Set up IRQ
+#if defined(DMA_COMPLETION_UIO_DEVICE) && !defined(SIMULATE_PERIPHERALS)
+  dmaCompletionFd = open(DMA_COMPLETION_UIO_DEVICE, O_RDWR);
+  if (dmaCompletionFd < 0) FATAL_ERROR("Failed to open " DMA_COMPLETION_UIO_DEVICE " for receiving DMA completion interrupts! (Is the interrupt line of DMA_RX_CHANNEL bound to the generic-uio driver?)");
+  EnableDMACompletionInterrupt();
+  LOG("Waiting for DMA transfers through interrupts from %s", DMA_COMPLETION_UIO_DEVICE);
+#endif
+
   LOG("DMA all set up");
   return 0;
 }
@@ -336,14 +389,6 @@ void DumpTI(uint32_t reg)
   PRINT_FLAG(BCM2835_DMA_TI_INTEN);
 }
 
-#define DMA_DMA0_CB_PHYS_ADDRESS 0x7E007000
-
-#define DMA_SPI_CS_PHYS_ADDRESS 0x7E204000
-#define DMA_SPI_FIFO_PHYS_ADDRESS 0x7E204004
-#define DMA_SPI_DLEN_PHYS_ADDRESS 0x7E20400C
-#define DMA_GPIO_SET_PHYS_ADDRESS 0x7E20001C
-#define DMA_GPIO_CLEAR_PHYS_ADDRESS 0x7E200028
-
 void DumpDMAState()
 {
   printf("---SPI:---\n");
@@ -365,10 +410,35 @@ void DumpDMAState()
   printf("****** DMARX cbAddr: %p\n", dmaRx->cbAddr);
 }
 
+#ifdef DMA_COMPLETION_UIO_DEVICE
+// Sleeps until the final control block of the previously started DMA transfer raises its interrupt
+static void WaitForDMACompletionInterrupt()
+{
+  pollfd fd = { dmaCompletionFd, POLLIN, 0 };
+  int ret;
+  do ret = poll(&fd, 1, 5000); while(ret < 0 && errno == EINTR);
+  if (ret == 0)
+  {
+    DumpDMAState();
+    FATAL_ERROR("DMA RX channel has stalled!");
+  }
+  uint32_t numInterrupts;
+  if (ret < 0 || read(dmaCompletionFd, &numInterrupts, sizeof(numInterrupts)) != sizeof(numInterrupts)) FATAL_ERROR("Failed to wait for DMA completion interrupt on " DMA_COMPLETION_UIO_DEVICE "!");
+
+  // Acknowledge the interrupt in the DMA channel before unmasking the line, or it would immediately fire again
+  dmaRx->cs = BCM2835_DMA_CS_INT;
+  EnableDMACompletionInterrupt();
+  dmaCompletionInterruptPending = false;
+}
+#endif
+
 extern volatile bool programRunning;
 
 void WaitForDMAFinished()
 {
+#ifdef DMA_COMPLETION_UIO_DEVICE
+  if (dmaCompletionInterruptPending) WaitForDMACompletionInterrupt();
+#endif
   int spins = 0;
   uint64_t t0 = tick();
   while((dmaTx->cs & BCM2835_DMA_CS_ACTIVE) && programRunning)
@@ -411,6 +481,20 @@ static void memcpy_to_dma_and_prev_framebuffer(uint16_t *dstDma, uint16_t **dstP
   uint16_t *Src = *srcFramebuffer;
   uint16_t *Dst1 = *dstPrevFramebuffer;
 
+#ifdef SIMULATE_PERIPHERALS
+  // The host computer that runs the simulator does not have the ARM instructions below, so do the same copy one pixel at a time
+  for(int i = 0; i < numBytes>>1; ++i)
+  {
+    *Dst1++ = *Src;
+    dstDma[i] = __builtin_bswap16(*Src++);
+    if (--xLeft == 0)
+    {
+      xLeft = width;
+      Src = (uint16_t*)((uintptr_t)Src + strideEnd);
+      Dst1 = (uint16_t*)((uintptr_t)Dst1 + strideEnd);
+    }
+  }
+#else
   // TODO: Do the loops in aligned order with unaligned head and tail separate, and ensure that dstDma, dstPrevFramebuffer and srcFramebuffer are in same alignment phase.
   asm volatile(
   "start_%=:\n"
@@ -451,6 +535,7 @@ static void memcpy_to_dma_and_prev_framebuffer(uint16_t *dstDma, uint16_t **dstP
     : [strideEnd]"r"(strideEnd), [width]"r"(width)
     : "r0", "r1", "memory", "cc"
   );
+#endif
   *taskStartX = width - xLeft;
   *srcFramebuffer = Src;
   *dstPrevFramebuffer = Dst1;
@@ -494,81 +579,261 @@ static void memcpy_to_dma_and_prev_framebuffer_in_c(uint16_t *dstDma, uint16_t *
 #error OFFLOAD_PIXEL_COPY_TO_DMA_CPP and SPI_3WIRE_PROTOCOL are not mutually compatible!
 #endif
 
-void SPIDMATransfer(SPITask *task)
-{
 // There is a limit to how many bytes can be sent in one DMA-based SPI task, so if the task
 // is larger than this, we'll split the send into multiple individual DMA SPI transfers
 // and chain them together. This should be a multiple of 32 bytes to keep tasks cache aligned on ARMv6.
 #define MAX_DMA_SPI_TASK_SIZE 65504
 
-  const int numDMASendTasks = (task->PayloadSize() + MAX_DMA_SPI_TASK_SIZE - 1) / MAX_DMA_SPI_TASK_SIZE;
+// Copies the next numBytes bytes of data of the given task to DMA source memory at dst, and advances *data past them
+static void CopyTaskDataToDMASource(SPITask *task, uint16_t *dst, int numBytes, uint8_t **data, uint8_t **prevData, int *taskStartX)
+{
+  // If task->prevFb is present, the DMA backend is responsible for streaming pixel data from current framebuffer to old framebuffer, and the DMA task buffer.
+  // If not present, then that preparation has been already done by the caller.
+#ifdef OFFLOAD_PIXEL_COPY_TO_DMA_CPP
+  if (*prevData)
+  {
+    // For 2D pixel data, do a "everything in one pass"
+    const bool taskAndFramebufferSizesCompatibleWithTightMemcpy = (task->PayloadSize() % 32 == 0) && (task->width % 16 == 0);
+    if (taskAndFramebufferSizesCompatibleWithTightMemcpy)
+      memcpy_to_dma_and_prev_framebuffer(dst, (uint16_t**)prevData, (uint16_t**)data, numBytes, taskStartX, task->width, gpuFramebufferScanlineStrideBytes);
+    else
+      memcpy_to_dma_and_prev_framebuffer_in_c(dst, (uint16_t**)prevData, (uint16_t**)data, numBytes, taskStartX, task->width, gpuFramebufferScanlineStrideBytes);
+  }
+  else
+#endif
+  {
+    memcpy(dst, *data, numBytes);
+    *data += numBytes;
+  }
+}
+
+// When the previous DMA transfer was started, and how many bytes it sends. Used to estimate how long to sleep before it has finished.
+static uint64_t taskStartTime = 0;
+static int pendingTaskBytes = 1;
+
+// Waits until the previously started DMA transfer has finished. Returns false if the program is quitting.
+static bool WaitForPreviousDMATransfer()
+{
+#ifdef SIMULATE_PERIPHERALS
+  WaitForSimulatedDMAChain(); // A simulated transfer always finishes, so there is no need to give up on it when the program is quitting
+  return true;
+#endif
+  double pendingTaskUSecs = pendingTaskBytes * spiUsecsPerByte;
+  pendingTaskUSecs -= tick() - taskStartTime;
+#ifdef DMA_COMPLETION_UIO_DEVICE
+  if (dmaCompletionInterruptPending)
+    WaitForDMACompletionInterrupt();
+  else
+#endif
+  if (pendingTaskUSecs > 70)
+    usleep(pendingTaskUSecs-70);
+
+  uint64_t dmaTaskStart = tick();
+
+  CheckSPIDMAChannelsNotStolen();
+  while((dmaTx->cs & BCM2835_DMA_CS_ACTIVE) && programRunning)
+  {
+    usleep(250);
+    CheckSPIDMAChannelsNotStolen();
+    if (tick() - dmaTaskStart > 5000000)
+    {
+      DumpDMAState();
+      FATAL_ERROR("DMA TX channel has stalled!");
+    }
+  }
+  while((dmaRx->cs & BCM2835_DMA_CS_ACTIVE) && programRunning)
+  {
+    usleep(250);
+    CheckSPIDMAChannelsNotStolen();
+    if (tick() - dmaTaskStart > 5000000)
+    {
+      DumpDMAState();
+      FATAL_ERROR("DMA RX channel has stalled!");
+    }
+  }
+  return programRunning;
+}
+
+#ifdef SEND_PIXELS_WITH_DMA_2D_STRIDE
 
-  volatile uint32_t *dmaData = (volatile uint32_t *)GrabFreeDMASourceBytes(4*(numDMASendTasks-1)+4*numDMASendTasks+task->PayloadSize());
-  volatile uint32_t *setDMATxAddressData = dmaData;
-  volatile uint32_t *txData = dmaData+numDMASendTasks-1;
+static GpuMemory dmaFramebuffer[2] = {};
+static int curDMAFramebuffer = 1;
 
-  volatile DMAControlBlock *cb = GrabFreeCBs(numDMASendTasks*5-3);
+uint32_t NextDMAFramebuffer()
+{
+  if (!dmaFramebuffer[0].virtualAddr)
+  {
+    dmaFramebuffer[0] = AllocateUncachedGpuMemory(gpuFramebufferSizeBytes, "DMA framebuffer 0");
+    dmaFramebuffer[1] = AllocateUncachedGpuMemory(gpuFramebufferSizeBytes, "DMA framebuffer 1");
+  }
+  // Alternate between two framebuffers, so that the DMA transfer of the previous frame can still be reading the other one. Only one
+  // frame is in flight at a time, since a single threaded build waits for the previous transfer to finish before starting the next.
+  curDMAFramebuffer = 1 - curDMAFramebuffer;
+  return dmaFramebuffer[curDMAFramebuffer].busAddress;
+}
 
+void CopyPixelsToDMAFramebuffer(uint32_t offsetBytes, const uint16_t *pixels, int numPixels)
+{
+  // The framebuffer is uncached memory that faults on unaligned accesses, so write a lone pixel at either end with a halfword access, and
+  // byte swap the rest two pixels at a time to big endian, which is the order that the display takes the pixels in
+  uint8_t *dst = (uint8_t *)dmaFramebuffer[curDMAFramebuffer].virtualAddr + offsetBytes;
+  if (((uintptr_t)dst & 2) && numPixels > 0)
+  {
+    *(volatile uint16_t *)dst = __builtin_bswap16(*pixels++);
+    dst += 2;
+    --numPixels;
+  }
+  volatile uint32_t *dst32 = (volatile uint32_t *)dst;
+  for(; numPixels >= 2; numPixels -= 2, pixels += 2)
+  {
+    uint32_t u;
+    memcpy(&u, pixels, 4); // (memcpy, since the pixels are not necessarily 4 byte aligned)
+    *dst32++ = ((u & 0xFF00FF00U) >> 8) | ((u & 0x00FF00FFU) << 8);
+  }
+  if (numPixels > 0)
+    *(volatile uint16_t *)dst32 = __builtin_bswap16(*pixels);
+}
+
+// Returns how many scanlines of the given task, starting from the given scanline, fit in one SPI transfer, and their size in bytes in *numBytes
+static int ScanlinesInNextTransfer(SPITask *task, int scanline, int *numBytes)
+{
+  int numScanlines = 0;
+  *numBytes = 0;
+  for(; scanline + numScanlines < task->height; ++numScanlines)
+  {
+    int scanlineBytes = (scanline + numScanlines + 1 == task->height ? task->lastScanlineWidth : task->width) * SPI_BYTESPERPIXEL;
+    if (numScanlines > 0 && *numBytes + scanlineBytes > MAX_DMA_SPI_TASK_SIZE) break;
+    *numBytes += scanlineBytes;
+  }
+  return numScanlines;
+}
+
+// Returns the number of DMA TX control blocks that Fill2DTxCBs() takes to send the given scanlines of the task
+static int Num2DTxCBs(SPITask *task, int scanline, int numScanlines)
+{
+  const bool hasLastScanline = (scanline + numScanlines == task->height);
+  return 1 + (numScanlines > (hasLastScanline ? 1 : 0) ? 1 : 0) + (hasLastScanline ? 1 : 0);
+}
+
+// Fills in the DMA TX control blocks that first send the SPI header word at headerBusAddress, and then the given scanlines of the task
+// straight from the DMA framebuffer. The full width scanlines are read with one 2D mode control block, and the last scanline of the
+// task, which may be shorter, with a control block of its own. Returns the last control block.
+static volatile DMAControlBlock *Fill2DTxCBs(volatile DMAControlBlock *cb, SPITask *task, int scanline, int numScanlines, uint32_t headerBusAddress)
+{
+  const uint32_t ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_TI_PERMAP_SPI_TX) | BCM2835_DMA_TI_DEST_DREQ | BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_WAIT_RESP;
+  const int numFullScanlines = numScanlines - (scanline + numScanlines == task->height ? 1 : 0);
+  const uint32_t scanlineBytes = task->width * SPI_BYTESPERPIXEL;
+  uint32_t src = task->fbBusAddress + scanline * gpuFramebufferScanlineStrideBytes;
+
+  cb->ti = ti;
+  cb->src = headerBusAddress;
+  cb->dst = DMA_SPI_FIFO_PHYS_ADDRESS;
+  cb->len = 4;
+  cb->stride = 0;
+  if (numFullScanlines > 0)
+  {
+    cb->next = VIRT_TO_BUS(dmaCb, cb+1);
+    ++cb;
+    cb->ti = ti | BCM2835_DMA_TI_TDMODE;
+    cb->src = src;
+    cb->dst = DMA_SPI_FIFO_PHYS_ADDRESS;
+    cb->len = ((numFullScanlines-1) << 16) | scanlineBytes; // In 2D mode, the DMA engine does YLENGTH+1 transfers of XLENGTH bytes each
+    cb->stride = (gpuFramebufferScanlineStrideBytes - scanlineBytes) & 0xFFFF; // Source stride, added after each scanline. Destination stride is zero
+    src += numFullScanlines * gpuFramebufferScanlineStrideBytes;
+  }
+  if (numFullScanlines < numScanlines)
+  {
+    cb->next = VIRT_TO_BUS(dmaCb, cb+1);
+    ++cb;
+    cb->ti = ti;
+    cb->src = src;
+    cb->dst = DMA_SPI_FIFO_PHYS_ADDRESS;
+    cb->len = task->lastScanlineWidth * SPI_BYTESPERPIXEL;
+    cb->stride = 0;
+  }
+  cb->next = 0;
+  return cb;
+}
+
+#endif // ~SEND_PIXELS_WITH_DMA_2D_STRIDE
+
+void SPIDMATransfer(SPITask *task)
+{
   volatile DMAControlBlock *rxTail = 0;
-  volatile DMAControlBlock *tx0 = &cb[0];
-  volatile DMAControlBlock *rx0 = &cb[1];
+  volatile DMAControlBlock *tx0 = 0;
+  volatile DMAControlBlock *rx0 = 0;
 
 #ifdef OFFLOAD_PIXEL_COPY_TO_DMA_CPP
   uint8_t *data = task->fb;
   uint8_t *prevData = task->prevFb;
-  const bool taskAndFramebufferSizesCompatibleWithTightMemcpy = (task->PayloadSize() % 32 == 0) && (task->width % 16 == 0);
 #else
   uint8_t *data = task->PayloadStart();
+  uint8_t *prevData = 0;
 #endif
 
   int bytesLeft = task->PayloadSize();
   int taskStartX = 0;
+#ifdef SEND_PIXELS_WITH_DMA_2D_STRIDE
+  int scanline = 0;
+#endif
 
   while(bytesLeft > 0)
   {
     int sendSize = MIN(bytesLeft, MAX_DMA_SPI_TASK_SIZE);
+    int numTxCBs = 1;
+#ifdef SEND_PIXELS_WITH_DMA_2D_STRIDE
+    int numScanlines = 0;
+    if (task->fbBusAddress)
+    {
+      numScanlines = ScanlinesInNextTransfer(task, scanline, &sendSize);
+      numTxCBs = Num2DTxCBs(task, scanline, numScanlines);
+    }
+    const int dataBytesInSourceBuffer = numScanlines ? 0 : ALIGN_UP(sendSize, 4);
+#else
+    const int dataBytesInSourceBuffer = ALIGN_UP(sendSize, 4);
+#endif
     bytesLeft -= sendSize;
 
-    volatile DMAControlBlock *tx = cb++;
+    // The source data of each transfer is the bus address of its first TX control block, followed by the DLEN+CS header and the data to send
+    volatile uint32_t *setDMATxAddressData = (volatile uint32_t *)GrabFreeDMASourceBytes(8 + dataBytesInSourceBuffer);
+    volatile uint32_t *txData = setDMATxAddressData + 1;
+    volatile DMAControlBlock *cb = GrabFreeCBs(numTxCBs + 1 + (rxTail ? 3 : 0));
+
+    volatile DMAControlBlock *tx = cb;
+    cb += numTxCBs;
     txData[0] = BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS | (sendSize << 16); // The first four bytes written to the SPI data register control the DLEN and CS,CPOL,CPHA settings.
-    // This is really sad: we must do a memcpy to prepare for DMA controller to be able to do a memcpy. The reason for this is that the DMA source memory area must be in cache bypassing
-    // region of memory, which the SPI source ring buffer is not. It could be allocated to be so however, but bypassing the caches on the SPI ring buffer would cause a massive -51.5%
-    // profiled overall performance drop (tested on Pi3B+ and Tontec 3.5" 480x320 display on gpu test pattern, see branch non_intermediate_memcpy_for_dma). Therefore just keep doing
-    // this memcpy() to prepare for DMA to do its memcpy(), as it is faster overall. (If there was a way to map same physical memory to virtual address space twice, once cached, and
-    // another time uncached, and have writes bypass the cache and only write combine, but have reads follow the cache, then it might work without a perf hit, but not at all sure if
-    // that would be technically possible)
-    uint16_t *txPtr = (uint16_t*)(txData+1);
-
-    // If task->prevFb is present, the DMA backend is responsible for streaming pixel data from current framebuffer to old framebuffer, and the DMA task buffer.
-    // If not present, then that preparation has been already done by the caller.
-#ifdef OFFLOAD_PIXEL_COPY_TO_DMA_CPP
-    if (prevData)
+#ifdef SEND_PIXELS_WITH_DMA_2D_STRIDE
+    if (numScanlines)
     {
-      // For 2D pixel data, do a "everything in one pass"
-      if (taskAndFramebufferSizesCompatibleWithTightMemcpy)
-        memcpy_to_dma_and_prev_framebuffer((uint16_t*)txPtr, (uint16_t**)&prevData, (uint16_t**)&data, sendSize, &taskStartX, task->width, gpuFramebufferScanlineStrideBytes);
-      else
-        memcpy_to_dma_and_prev_framebuffer_in_c((uint16_t*)txPtr, (uint16_t**)&prevData, (uint16_t**)&data, sendSize, &taskStartX, task->width, gpuFramebufferScanlineStrideBytes);
+      Fill2DTxCBs(tx, task, scanline, numScanlines, VIRT_TO_BUS(dmaSourceBuffer, txData));
+      scanline += numScanlines;
     }
     else
 #endif
     {
-      memcpy(txPtr, data, sendSize);
-      data += sendSize;
+      // This is really sad: we must do a memcpy to prepare for DMA controller to be able to do a memcpy. The reason for this is that the DMA source memory area must be in cache bypassing
+      // region of memory, which the SPI source ring buffer is not. It could be allocated to be so however, but bypassing the caches on the SPI ring buffer would cause a massive -51.5%
+      // profiled overall performance drop (tested on Pi3B+ and Tontec 3.5" 480x320 display on gpu test pattern, see branch non_intermediate_memcpy_for_dma). Therefore just keep doing
+      // this memcpy() to prepare for DMA to do its memcpy(), as it is faster overall. (If there was a way to map same physical memory to virtual address space twice, once cached, and
+      // another time uncached, and have writes bypass the cache and only write combine, but have reads follow the cache, then it might work without a perf hit, but not at all sure if
+      // that would be technically possible)
+      uint16_t *txPtr = (uint16_t*)(txData+1);
+      CopyTaskDataToDMASource(task, txPtr, sendSize, &data, &prevData, &taskStartX);
+
+      tx->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_TI_PERMAP_SPI_TX) | BCM2835_DMA_TI_DEST_DREQ | BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_WAIT_RESP;
+      tx->src = VIRT_TO_BUS(dmaSourceBuffer, txData);
+      tx->dst = DMA_SPI_FIFO_PHYS_ADDRESS; // Write out to the SPI peripheral
+      tx->len = 4+sendSize;
+      tx->stride = 0;
+      tx->next = 0;
     }
 
-    tx->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_TI_PERMAP_SPI_TX) | BCM2835_DMA_TI_DEST_DREQ | BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_WAIT_RESP;
-    tx->src = VIRT_TO_BUS(dmaSourceBuffer, txData);
-    tx->dst = DMA_SPI_FIFO_PHYS_ADDRESS; // Write out to the SPI peripheral
-    tx->len = 4+sendSize;
-    tx->next = 0;
-    txData += 1+sendSize/4;
-
     volatile DMAControlBlock *rx = cb++;
     rx->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_TI_PERMAP_SPI_RX) | BCM2835_DMA_TI_SRC_DREQ | BCM2835_DMA_TI_DEST_IGNORE;
     rx->src = DMA_SPI_FIFO_PHYS_ADDRESS;
     rx->dst = 0;
     rx->len = sendSize;
+    rx->stride = 0;
     rx->next = 0;
 
     if (rxTail)
@@ -584,56 +849,40 @@ void SPIDMATransfer(SPITask *task)
       setDMATxAddress->src = VIRT_TO_BUS(dmaSourceBuffer, setDMATxAddressData);
       setDMATxAddress->dst = DMA_DMA0_CB_PHYS_ADDRESS + dmaTxChannel*0x100 + 4;
       setDMATxAddress->len = 4;
+      setDMATxAddress->stride = 0;
       setDMATxAddress->next = VIRT_TO_BUS(dmaCb, disableTransferActive);
-      ++setDMATxAddressData;
 
       disableTransferActive->ti = BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_DEST_INC | BCM2835_DMA_TI_WAIT_RESP;
       disableTransferActive->src = dmaConstantData.busAddress;
       disableTransferActive->dst = DMA_SPI_CS_PHYS_ADDRESS;
       disableTransferActive->len = 4;
+      disableTransferActive->stride = 0;
       disableTransferActive->next = VIRT_TO_BUS(dmaCb, startDMATxChannel);
 
       startDMATxChannel->ti = BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_DEST_INC | BCM2835_DMA_TI_WAIT_RESP;
       startDMATxChannel->src = dmaConstantData.busAddress+4;
       startDMATxChannel->dst = DMA_DMA0_CB_PHYS_ADDRESS + dmaTxChannel*0x100;
       startDMATxChannel->len = 4;
+      startDMATxChannel->stride = 0;
       startDMATxChannel->next = VIRT_TO_BUS(dmaCb, rx);
-
+    }
+    else
+    {
+      tx0 = tx;
+      rx0 = rx;
     }
     rxTail = rx;
   }
 
-  static uint64_t taskStartTime = 0;
-  static int pendingTaskBytes = 1;
-  double pendingTaskUSecs = pendingTaskBytes * spiUsecsPerByte;
-  pendingTaskUSecs -= tick() - taskStartTime;
-  if (pendingTaskUSecs > 70)
-    usleep(pendingTaskUSecs-70);
-
-  uint64_t dmaTaskStart = tick();
+#ifdef DMA_COMPLETION_UIO_DEVICE
+  // Waking up from an interrupt takes a while, so only sleep through transfers that are long enough for it to pay off. The RX channel
+  // finishes last, so let its final control block signal that the whole transfer is done
+  const bool waitForInterrupt = task->PayloadSize() * spiUsecsPerByte > DMA_COMPLETION_INTERRUPT_MIN_USECS;
+  if (waitForInterrupt)
+    rxTail->ti |= BCM2835_DMA_TI_INTEN;
+#endif
 
-  CheckSPIDMAChannelsNotStolen();
-  while((dmaTx->cs & BCM2835_DMA_CS_ACTIVE) && programRunning)
-  {
-    usleep(250);
-    CheckSPIDMAChannelsNotStolen();
-    if (tick() - dmaTaskStart > 5000000)
-    {
-      DumpDMAState();
-      FATAL_ERROR("DMA TX channel has stalled!");
-    }
-  }
-  while((dmaRx->cs & BCM2835_DMA_CS_ACTIVE) && programRunning)
-  {
-    usleep(250);
-    CheckSPIDMAChannelsNotStolen();
-    if (tick() - dmaTaskStart > 5000000)
-    {
-      DumpDMAState();
-      FATAL_ERROR("DMA RX channel has stalled!");
-    }
-  }
-  if (!programRunning) return;
+  if (!WaitForPreviousDMATransfer()) return;
 
   pendingTaskBytes = task->PayloadSize();
 
@@ -665,8 +914,209 @@ void SPIDMATransfer(SPITask *task)
   dmaTx->cs = BCM2835_DMA_CS_ACTIVE | BCM2835_DMA_CS_END;
   dmaRx->cs = BCM2835_DMA_CS_ACTIVE | BCM2835_DMA_CS_END;
   taskStartTime = tick();
+#ifdef DMA_COMPLETION_UIO_DEVICE
+  dmaCompletionInterruptPending = waitForInterrupt;
+#endif
+}
+
+#ifdef SEND_FRAMES_AS_ONE_DMA_CHAIN
+
+// The whole chain runs on the DMA RX channel. Each SPI transfer in it, i.e. the command byte of a task or a piece of the data of the task,
+// takes control blocks that 1) set the D/C line, if it changes, 2) point the TX channel to the control block that sends the transfer,
+// 3) end the previous SPI transfer by clearing the TA bit, 4) start the TX channel, which writes the DLEN+CS header and the bytes to the SPI
+// FIFO, and 5) read the bytes back from the SPI RX FIFO, which makes the RX channel wait until the whole transfer has been clocked out.
+#ifdef SEND_PIXELS_WITH_DMA_2D_STRIDE
+#define MAX_DMA_CBS_PER_CHAIN_TRANSFER 8 // Sending pixels straight from the DMA framebuffer takes up to three TX control blocks, see Fill2DTxCBs()
+#else
+#define MAX_DMA_CBS_PER_CHAIN_TRANSFER 6
+#endif
+
+static volatile DMAControlBlock *chainHead = 0;
+static volatile DMAControlBlock *chainTail = 0;
+static int chainCBs = 0, chainSourceBytes = 0, chainPayloadBytes = 0;
+static int chainDataControl = -1; // The level of the D/C line at the end of the chain so far, or -1 if not known
+
+// Appends one SPI transfer of numBytes bytes to the chain, and returns the address that the bytes to send should be written to. If
+// pixelsFromFramebuffer is passed, the transfer instead sends the given scanlines of that task straight from the DMA framebuffer.
+static volatile uint8_t *AppendTransferToDMAChain(int numBytes, int dataControl, SPITask *pixelsFromFramebuffer = 0, int scanline = 0, int numScanlines = 0)
+{
+  const bool setDataControl = (dataControl != chainDataControl);
+  int numTxCBs = 1;
+  int dataBytesInSourceBuffer = ALIGN_UP(numBytes, 4);
+#ifdef SEND_PIXELS_WITH_DMA_2D_STRIDE
+  if (pixelsFromFramebuffer)
+  {
+    numTxCBs = Num2DTxCBs(pixelsFromFramebuffer, scanline, numScanlines);
+    dataBytesInSourceBuffer = 0;
+  }
+#endif
+  const int numCBs = (setDataControl ? 1 : 0) + 4 + numTxCBs;
+  volatile DMAControlBlock *cb = GrabFreeCBs(numCBs);
+  // The source data of the transfer is the bus address of its TX control block, followed by the DLEN+CS header and the bytes to send
+  const int sourceBytes = 8 + dataBytesInSourceBuffer;
+  volatile uint32_t *setDMATxAddressData = (volatile uint32_t *)GrabFreeDMASourceBytes(sourceBytes);
+  volatile uint32_t *txData = setDMATxAddressData + 1;
+  chainCBs += numCBs;
+  chainSourceBytes += sourceBytes;
+
+  volatile DMAControlBlock *first = cb;
+  if (setDataControl)
+  {
+    volatile DMAControlBlock *setDataControlLine = cb++;
+    setDataControlLine->ti = BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_DEST_INC | BCM2835_DMA_TI_WAIT_RESP;
+    setDataControlLine->src = dmaConstantData.busAddress+8;
+    setDataControlLine->dst = dataControl ? DMA_GPIO_SET_PHYS_ADDRESS : DMA_GPIO_CLEAR_PHYS_ADDRESS;
+    setDataControlLine->len = 4;
+    setDataControlLine->stride = 0;
+    setDataControlLine->next = VIRT_TO_BUS(dmaCb, cb);
+    chainDataControl = dataControl;
+  }
+  volatile DMAControlBlock *setDMATxAddress = cb++;
+  volatile DMAControlBlock *disableTransferActive = cb++;
+  volatile DMAControlBlock *startDMATxChannel = cb++;
+  volatile DMAControlBlock *rx = cb++;
+  volatile DMAControlBlock *tx = cb; // The TX control blocks come last, since there can be more than one of them
+
+  setDMATxAddressData[0] = VIRT_TO_BUS(dmaCb, tx);
+  setDMATxAddress->ti = BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_DEST_INC | BCM2835_DMA_TI_WAIT_RESP;
+  setDMATxAddress->src = VIRT_TO_BUS(dmaSourceBuffer, setDMATxAddressData);
+  setDMATxAddress->dst = DMA_DMA0_CB_PHYS_ADDRESS + dmaTxChannel*0x100 + 4;
+  setDMATxAddress->len = 4;
+  setDMATxAddress->stride = 0;
+  setDMATxAddress->next = VIRT_TO_BUS(dmaCb, disableTransferActive);
+
+  disableTransferActive->ti = BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_DEST_INC | BCM2835_DMA_TI_WAIT_RESP;
+  disableTransferActive->src = dmaConstantData.busAddress;
+  disableTransferActive->dst = DMA_SPI_CS_PHYS_ADDRESS;
+  disableTransferActive->len = 4;
+  disableTransferActive->stride = 0;
+  disableTransferActive->next = VIRT_TO_BUS(dmaCb, startDMATxChannel);
+
+  startDMATxChannel->ti = BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_DEST_INC | BCM2835_DMA_TI_WAIT_RESP;
+  startDMATxChannel->src = dmaConstantData.busAddress+4;
+  startDMATxChannel->dst = DMA_DMA0_CB_PHYS_ADDRESS + dmaTxChannel*0x100;
+  startDMATxChannel->len = 4;
+  startDMATxChannel->stride = 0;
+  startDMATxChannel->next = VIRT_TO_BUS(dmaCb, rx);
+
+  txData[0] = BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS | (numBytes << 16); // The first four bytes written to the SPI data register control the DLEN and CS,CPOL,CPHA settings.
+#ifdef SEND_PIXELS_WITH_DMA_2D_STRIDE
+  if (pixelsFromFramebuffer)
+    Fill2DTxCBs(tx, pixelsFromFramebuffer, scanline, numScanlines, VIRT_TO_BUS(dmaSourceBuffer, txData));
+  else
+#endif
+  {
+    tx->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_TI_PERMAP_SPI_TX) | BCM2835_DMA_TI_DEST_DREQ | BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_WAIT_RESP;
+    tx->src = VIRT_TO_BUS(dmaSourceBuffer, txData);
+    tx->dst = DMA_SPI_FIFO_PHYS_ADDRESS; // Write out to the SPI peripheral
+    tx->len = 4+numBytes;
+    tx->stride = 0;
+    tx->next = 0;
+  }
+
+  rx->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_TI_PERMAP_SPI_RX) | BCM2835_DMA_TI_SRC_DREQ | BCM2835_DMA_TI_DEST_IGNORE;
+  rx->src = DMA_SPI_FIFO_PHYS_ADDRESS;
+  rx->dst = 0;
+  rx->len = numBytes;
+  rx->stride = 0;
+  rx->next = 0;
+
+  if (chainTail) chainTail->next = VIRT_TO_BUS(dmaCb, first);
+  else chainHead = first;
+  chainTail = rx;
+  return (volatile uint8_t *)(txData+1);
+}
+
+bool AppendTaskToDMAChain(SPITask *task)
+{
+  // Keep each chain within half of the control block and source data ring buffers, so that the chain being built never wraps around
+  // onto itself, and the previous chain can still be running while the next one is being built.
+  int numTransfers = 1 + (task->PayloadSize() + MAX_DMA_SPI_TASK_SIZE - 1) / MAX_DMA_SPI_TASK_SIZE;
+#ifdef SEND_PIXELS_WITH_DMA_2D_STRIDE
+  if (task->fbBusAddress) ++numTransfers; // Transfers are split at scanline boundaries, which can take one more of them
+#endif
+  if (chainHead && (chainCBs + numTransfers*MAX_DMA_CBS_PER_CHAIN_TRANSFER > NUM_DMA_CBS/2
+    || chainSourceBytes + numTransfers*12 + (int)task->PayloadSize() > (int)dmaSourceBuffer.sizeBytes/2))
+    return false;
+
+  // Send the command with the D/C line low
+#ifdef DISPLAY_SPI_BUS_IS_16BITS_WIDE
+  // On e.g. the ILI9486, all commands are 16-bit, so need to be clocked in in two bytes. The MSB byte is always zero though in all the defined commands.
+  volatile uint8_t *cmd = AppendTransferToDMAChain(2, 0);
+  cmd[0] = 0;
+  cmd[1] = task->cmd;
+#else
+  volatile uint8_t *cmd = AppendTransferToDMAChain(1, 0);
+  cmd[0] = task->cmd;
+#endif
+
+  // And then its data with the D/C line high
+#ifdef OFFLOAD_PIXEL_COPY_TO_DMA_CPP
+  uint8_t *data = task->fb;
+  uint8_t *prevData = task->prevFb;
+#else
+  uint8_t *data = task->PayloadStart();
+  uint8_t *prevData = 0;
+#endif
+  int bytesLeft = task->PayloadSize();
+  int taskStartX = 0;
+#ifdef SEND_PIXELS_WITH_DMA_2D_STRIDE
+  if (task->fbBusAddress)
+  {
+    for(int scanline = 0; scanline < task->height;)
+    {
+      int sendSize;
+      int numScanlines = ScanlinesInNextTransfer(task, scanline, &sendSize);
+      AppendTransferToDMAChain(sendSize, 1, task, scanline, numScanlines);
+      scanline += numScanlines;
+    }
+    bytesLeft = 0;
+  }
+#endif
+  while(bytesLeft > 0)
+  {
+    int sendSize = MIN(bytesLeft, MAX_DMA_SPI_TASK_SIZE);
+    bytesLeft -= sendSize;
+    volatile uint8_t *txPtr = AppendTransferToDMAChain(sendSize, 1);
+    CopyTaskDataToDMASource(task, (uint16_t*)txPtr, sendSize, &data, &prevData, &taskStartX);
+  }
+  chainPayloadBytes += task->PayloadSize() + 1;
+  return true;
 }
 
+void SendDMAChain()
+{
+  if (!chainHead) return;
+
+#if defined(DMA_COMPLETION_UIO_DEVICE) && !defined(SIMULATE_PERIPHERALS)
+  // Waking up from an interrupt takes a while, so only sleep through chains that are long enough for it to pay off
+  const bool waitForInterrupt = chainPayloadBytes * spiUsecsPerByte > DMA_COMPLETION_INTERRUPT_MIN_USECS;
+  if (waitForInterrupt)
+    chainTail->ti |= BCM2835_DMA_TI_INTEN;
+#endif
+
+  if (WaitForPreviousDMATransfer())
+  {
+    spi->cs = BCM2835_SPI0_CS_DMAEN | BCM2835_SPI0_CS_CLEAR | DISPLAY_SPI_DRIVE_SETTINGS;
+    dmaRx->cbAddr = VIRT_TO_BUS(dmaCb, chainHead);
+    __sync_synchronize();
+    dmaRx->cs = BCM2835_DMA_CS_ACTIVE | BCM2835_DMA_CS_END;
+    taskStartTime = tick();
+    pendingTaskBytes = chainPayloadBytes;
+#ifdef SIMULATE_PERIPHERALS
+    SimulateDMAChain();
+#elif defined(DMA_COMPLETION_UIO_DEVICE)
+    dmaCompletionInterruptPending = waitForInterrupt;
+#endif
+  }
+
+  chainHead = chainTail = 0;
+  chainCBs = chainSourceBytes = chainPayloadBytes = 0;
+  chainDataControl = -1;
+}
+
+#endif // ~SEND_FRAMES_AS_ONE_DMA_CHAIN
+
 #else
 
 void SPIDMATransfer(SPITask *task)
@@ -676,16 +1126,24 @@ void SPIDMATransfer(SPITask *task)
   uint32_t *headerAddr = task->DmaSpiHeaderAddress();
   *headerAddr = BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS | (task->PayloadSize() << 16); // The first four bytes written to the SPI data register control the DLEN and CS,CPOL,CPHA settings.
 
+#ifdef SPI_TASK_QUEUE_IN_DMA_MEMORY
+  // The task queue lives in uncached GPU memory, so the DMA controller can read the header and the payload straight from the task.
+  uint32_t txSource = VIRT_TO_BUS(spiTaskQueue, headerAddr);
+#else
   // TODO: Ideally we would be able to directly perform the DMA from the SPI ring buffer from 'task' pointer. However
   // that pointer is shared to userland, and it is proving troublesome to make it both userland-writable as well as cache-bypassing DMA coherent.
   // Therefore these two memory areas are separate for now, and we memcpy() from SPI ring buffer to an intermediate 'dmaSourceMemory' memory area to perform
-  // the DMA transfer. Is there a way to avoid this intermediate buffer? That would improve performance a bit.
+  // the DMA transfer. Is there a way to avoid this intermediate buffer? That would improve performance a bit. (See SPI_TASK_QUEUE_IN_DMA_MEMORY in config.h)
   memcpy(dmaSourceBuffer.virtualAddr, headerAddr, task->PayloadSize() + 4);
+  uint32_t txSource = dmaSourceBuffer.busAddress;
+#endif
+
+  double pendingTaskUSecs = task->PayloadSize() * spiUsecsPerByte;
 
   volatile DMAControlBlock *cb = (volatile DMAControlBlock *)dmaCb.virtualAddr;
   volatile DMAControlBlock *txcb = &cb[0];
   txcb->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_TI_PERMAP_SPI_TX) | BCM2835_DMA_TI_DEST_DREQ | BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_WAIT_RESP;
-  txcb->src = dmaSourceBuffer.busAddress;
+  txcb->src = txSource;
   txcb->dst = DMA_SPI_FIFO_PHYS_ADDRESS; // Write out to the SPI peripheral 
   txcb->len = task->PayloadSize() + 4;
   txcb->stride = 0;
@@ -696,6 +1154,12 @@ void SPIDMATransfer(SPITask *task)
 
   volatile DMAControlBlock *rxcb = &cb[1];
   rxcb->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_TI_PERMAP_SPI_RX) | BCM2835_DMA_TI_SRC_DREQ | BCM2835_DMA_TI_DEST_IGNORE;
+#ifdef DMA_COMPLETION_UIO_DEVICE
+  // Waking up from an interrupt takes a while, so only sleep through transfers that are long enough for it to pay off
+  const bool waitForInterrupt = pendingTaskUSecs > DMA_COMPLETION_INTERRUPT_MIN_USECS;
+  if (waitForInterrupt)
+    rxcb->ti |= BCM2835_DMA_TI_INTEN; // The RX channel finishes last, so have it signal that the transfer is done
+#endif
   rxcb->src = DMA_SPI_FIFO_PHYS_ADDRESS;
   rxcb->dst = 0;
   rxcb->len = task->PayloadSize();
@@ -710,24 +1174,35 @@ void SPIDMATransfer(SPITask *task)
   dmaRx->cs = BCM2835_DMA_CS_ACTIVE;
   __sync_synchronize();
 
-  double pendingTaskUSecs = task->PayloadSize() * spiUsecsPerByte;
-  if (pendingTaskUSecs > 70)
-    usleep(pendingTaskUSecs-70);
-
-  uint64_t dmaTaskStart = tick();
-
-  CheckSPIDMAChannelsNotStolen();
-  while((dmaTx->cs & BCM2835_DMA_CS_ACTIVE))
+#ifdef DMA_COMPLETION_UIO_DEVICE
+  if (waitForInterrupt)
   {
+    // Sleep until the transfer is done, without needing to guess how long it takes
+    dmaCompletionInterruptPending = true;
+    WaitForDMACompletionInterrupt();
     CheckSPIDMAChannelsNotStolen();
-    if (tick() - dmaTaskStart > 5000000)
-      FATAL_ERROR("DMA TX channel has stalled!");
   }
-  while((dmaRx->cs & BCM2835_DMA_CS_ACTIVE))
+  else
+#endif
   {
+    if (pendingTaskUSecs > 70)
+      usleep(pendingTaskUSecs-70);
+
+    uint64_t dmaTaskStart = tick();
+
     CheckSPIDMAChannelsNotStolen();
-    if (tick() - dmaTaskStart > 5000000)
-      FATAL_ERROR("DMA RX channel has stalled!");
+    while((dmaTx->cs & BCM2835_DMA_CS_ACTIVE))
+    {
+      CheckSPIDMAChannelsNotStolen();
+      if (tick() - dmaTaskStart > 5000000)
+        FATAL_ERROR("DMA TX channel has stalled!");
+    }
+    while((dmaRx->cs & BCM2835_DMA_CS_ACTIVE))
+    {
+      CheckSPIDMAChannelsNotStolen();
+      if (tick() - dmaTaskStart > 5000000)
+        FATAL_ERROR("DMA RX channel has stalled!");
+    }
   }
 
   __sync_synchronize();
@@ -741,9 +1216,29 @@ void DeinitDMA(void)
 {
   WaitForDMAFinished();
   ResetDMAChannels();
+#ifdef DMA_COMPLETION_UIO_DEVICE
+  if (dmaCompletionFd >= 0)
+  {
+    close(dmaCompletionFd);
+    dmaCompletionFd = -1;
+  }
+#endif
+#ifdef SPI_TASK_QUEUE_IN_DMA_MEMORY
+  FreeUncachedGpuMemory(spiTaskQueue);
+  spiTaskMemory->buffer = 0;
+#else
   FreeUncachedGpuMemory(dmaSourceBuffer);
+#endif
   FreeUncachedGpuMemory(dmaCb);
   FreeUncachedGpuMemory(dmaConstantData);
+#ifdef SEND_PIXELS_WITH_DMA_2D_STRIDE
+  for(int i = 0; i < 2; ++i)
+    if (dmaFramebuffer[i].virtualAddr)
+    {
+      FreeUncachedGpuMemory(dmaFramebuffer[i]);
+      dmaFramebuffer[i].virtualAddr = 0;
+    }
+#endif
   if (dmaTxChannel != -1)
   {
     FreeDMAChannel(dmaTxChannel);
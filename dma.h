@@ -119,6 +119,15 @@ volatile DMAChannelRegisterFile *GetDMAChannel(int channelNumber);
 #define BCM2835_DMA_TI_TDMODE_SHIFT                         1
 #define BCM2835_DMA_TI_INTEN_SHIFT                          0
 
+// Bus addresses of the peripheral registers that DMA control blocks write to
+#define DMA_DMA0_CB_PHYS_ADDRESS 0x7E007000
+
+#define DMA_SPI_CS_PHYS_ADDRESS 0x7E204000
+#define DMA_SPI_FIFO_PHYS_ADDRESS 0x7E204004
+#define DMA_SPI_DLEN_PHYS_ADDRESS 0x7E20400C
+#define DMA_GPIO_SET_PHYS_ADDRESS 0x7E20001C
+#define DMA_GPIO_CLEAR_PHYS_ADDRESS 0x7E200028
+
 // Spec sheet says there's 16 channels, but last channel is unusable:
 // https://www.raspberrypi.org/forums/viewtopic.php?t=170957
 // So just behave as if there are only 15 channels
@@ -134,6 +143,22 @@ typedef struct SPITask SPITask;
 
 void SPIDMATransfer(SPITask *task);
 
+#ifdef SEND_PIXELS_WITH_DMA_2D_STRIDE
+// Switches to the other one of the two big endian framebuffers in GPU memory that the DMA engine sends pixels from, and returns its bus
+// address. The framebuffers are used in turn, so the previous frame can still be in flight while the pixels of the next one are copied.
+uint32_t NextDMAFramebuffer(void);
+// Byte swaps the given pixels to big endian into the current DMA framebuffer, at the given offset from its start.
+void CopyPixelsToDMAFramebuffer(uint32_t offsetBytes, const uint16_t *pixels, int numPixels);
+#endif
+
+#ifdef SEND_FRAMES_AS_ONE_DMA_CHAIN
+// Appends the given task to the DMA control block chain that is being built. Returns false if the chain is full, in which case
+// it should be sent with SendDMAChain() before trying again. The task data is copied, so the task can be freed right after.
+bool AppendTaskToDMAChain(SPITask *task);
+// Waits for the previously sent chain to finish, and then starts sending the chain that was built with AppendTaskToDMAChain().
+void SendDMAChain(void);
+#endif
+
 extern int dmaTxChannel;
 extern int dmaRxChannel;
 extern uint64_t totalGpuMemoryUsed;
@@ -29,6 +29,14 @@
 #include "mem_alloc.h"
 #include "keyboard.h"
 #include "low_battery.h"
+#include "vertical_scroll.h"
+#include "simulator.h"
+
+// The overlays drawn on the framebuffers matter to the per-pixel diff if it only diffs the scanlines that the GPU polling thread saw change,
+// or skips the scanlines whose hash has not changed, since both only know about the frame contents from before the overlays were drawn
+#if !(defined(ALL_TASKS_SHOULD_DMA) && (defined(UPDATE_FRAMES_WITHOUT_DIFFING) || defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF))) && (!defined(USE_GPU_VSYNC) || defined(SCANLINE_HASH_DIFF))
+#define TRACK_OVERLAY_STATE
+#endif
 
 int CountNumChangedPixels(uint16_t *framebuffer, uint16_t *prevFramebuffer)
 {
@@ -45,6 +53,74 @@ int CountNumChangedPixels(uint16_t *framebuffer, uint16_t *prevFramebuffer)
   return changedPixels;
 }
 
+#ifdef PARALLEL_PIXEL_DIFF
+static uint16_t *countFramebuffer, *countPrevFramebuffer;
+static int numBandChangedPixels[NUM_DIFF_THREADS];
+
+static void CountNumChangedPixelsInBand(int band, int y, int endY)
+{
+  const int stride = gpuFramebufferScanlineStrideBytes >> 1;
+  int changedPixels = 0;
+  for(; y < endY; ++y)
+  {
+    uint16_t *scanline = countFramebuffer + y*stride;
+    uint16_t *prevScanline = countPrevFramebuffer + y*stride;
+    for(int x = 0; x < gpuFrameWidth; ++x)
+      if (scanline[x] != prevScanline[x])
+        ++changedPixels;
+  }
+  numBandChangedPixels[band] = changedPixels;
+}
+
+int CountNumChangedPixelsInParallel(uint16_t *framebuffer, uint16_t *prevFramebuffer)
+{
+  countFramebuffer = framebuffer;
+  countPrevFramebuffer = prevFramebuffer;
+  RunDiffJobInParallel(CountNumChangedPixelsInBand);
+  int changedPixels = 0;
+  for(int i = 0; i < NUM_DIFF_THREADS; ++i)
+    changedPixels += numBandChangedPixels[i];
+  return changedPixels;
+}
+#define CountNumChangedPixels CountNumChangedPixelsInParallel
+#endif
+
+#ifdef DROP_STALE_FRAMES
+// The pixels of the previous framebuffer that the spans of the newest submitted frame overwrote, so that its update can be undone if the frame is dropped
+static Span *undoSpans;
+static int numUndoSpans = 0;
+static uint16_t *undoPixels;
+static int numUndoPixels = 0;
+
+static void SavePrevFramebufferSpan(const Span *span, uint16_t *prevFramebuffer)
+{
+  undoSpans[numUndoSpans++] = *span;
+  uint16_t *prevScanline = prevFramebuffer + span->y * (gpuFramebufferScanlineStrideBytes>>1);
+  for(int y = span->y; y < span->endY; ++y, prevScanline += gpuFramebufferScanlineStrideBytes>>1)
+  {
+    int endX = (y + 1 == span->endY) ? span->lastScanEndX : span->endX;
+    memcpy(undoPixels + numUndoPixels, prevScanline + span->x, (endX - span->x)*FRAMEBUFFER_BYTESPERPIXEL);
+    numUndoPixels += endX - span->x;
+  }
+}
+
+static void RestorePrevFramebufferSpans(uint16_t *prevFramebuffer)
+{
+  // Go backwards, so that if spans overlapped, the pixels from before the frame are what remains
+  while(numUndoSpans > 0)
+  {
+    const Span *span = &undoSpans[--numUndoSpans];
+    uint16_t *prevScanline = prevFramebuffer + (span->endY - 1) * (gpuFramebufferScanlineStrideBytes>>1);
+    for(int y = span->endY - 1; y >= span->y; --y, prevScanline -= gpuFramebufferScanlineStrideBytes>>1)
+    {
+      int endX = (y + 1 == span->endY) ? span->lastScanEndX : span->endX;
+      numUndoPixels -= endX - span->x;
+      memcpy(prevScanline + span->x, undoPixels + numUndoPixels, (endX - span->x)*FRAMEBUFFER_BYTESPERPIXEL);
+    }
+  }
+}
+#endif
+
 uint64_t displayContentsLastChanged = 0;
 bool displayOff = false;
 
@@ -63,6 +139,16 @@ const char *SignalToString(int signal)
 void MarkProgramQuitting()
 {
   programRunning = false;
+  __sync_synchronize();
+  // Wake the main thread and the SPI thread if they were sleeping, so that they notice the program is quitting
+  __atomic_fetch_add(&numNewGpuFrames, 1, __ATOMIC_SEQ_CST);
+  syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAKE, 1, 0, 0, 0);
+  if (spiTaskMemory)
+  {
+    syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0);
+    __atomic_fetch_add(&spiTaskMemory->framesDone, 1, __ATOMIC_SEQ_CST); // The main thread may be waiting for a frame to be done
+    syscall(SYS_futex, &spiTaskMemory->framesDone, FUTEX_WAKE, 1, 0, 0, 0);
+  }
 }
 
 void ProgramInterruptHandler(int signal)
@@ -112,27 +198,78 @@ int main()
 
   InitGPU();
 
-  spans = (Span*)Malloc((gpuFrameWidth * gpuFrameHeight / 2) * sizeof(Span), "main() task spans");
-  int size = gpuFramebufferSizeBytes;
+#ifdef TILED_PIXEL_DIFF
+  const int maxNumSpans = MaxNumTiledDiffSpans();
+#elif defined(PARALLEL_PIXEL_DIFF)
+  // Each diff thread writes to its own section of the spans array, so reserve room for the worst case number of spans on each scanline
+  const int maxNumSpans = gpuFrameHeight * MAX_SPANS_PER_SCANLINE;
+#else
+  const int maxNumSpans = gpuFrameWidth * gpuFrameHeight / 2;
+#endif
+  spans = (Span*)Malloc(maxNumSpans * sizeof(Span), "main() task spans");
+#ifdef DROP_STALE_FRAMES
+  undoSpans = (Span*)Malloc(maxNumSpans * sizeof(Span), "main() undo spans");
+  undoPixels = (uint16_t*)Malloc((gpuFrameWidth * gpuFrameHeight + maxNumSpans/*ALIGN_TASKS_FOR_DMA_TRANSFERS may widen spans by a pixel*/) * FRAMEBUFFER_BYTESPERPIXEL, "main() undo pixels");
+#endif
+#ifdef PARALLEL_PIXEL_DIFF
+  InitDiffThreads();
+#endif
+#ifdef DISPLAY_VERTICAL_SCROLL_DETECTION
+  InitVerticalScroll();
+#endif
 #ifdef USE_GPU_VSYNC
   // BUG in vc_dispmanx_resource_read_data(!!): If one is capturing a small subrectangle of a large screen resource rectangle, the destination pointer 
   // is in vc_dispmanx_resource_read_data() incorrectly still taken to point to the top-left corner of the large screen resource, instead of the top-left
   // corner of the subrectangle to capture. Therefore do dirty pointer arithmetic to adjust for this. To make this safe, videoCoreFramebuffer is allocated
   // double its needed size so that this adjusted pointer does not reference outside allocated memory (if it did, vc_dispmanx_resource_read_data() was seen
   // to randomly fail and then subsequently hang if called a second time)
-  size *= 2;
-#endif
+  int size = gpuFramebufferSizeBytes * 2;
   uint16_t *framebuffer[2] = { (uint16_t *)Malloc(size, "main() framebuffer0"), (uint16_t *)Malloc(gpuFramebufferSizeBytes, "main() framebuffer1") };
   memset(framebuffer[0], 0, size); // Doublebuffer received GPU memory contents, first buffer contains current GPU memory,
   memset(framebuffer[1], 0, gpuFramebufferSizeBytes); // second buffer contains whatever the display is currently showing. This allows diffing pixels between the two.
-#ifdef USE_GPU_VSYNC
   // Due to the above bug. In USE_GPU_VSYNC mode, we directly snapshot to framebuffer[0], so it has to be prepared specially to work around the
   // dispmanx bug.
   framebuffer[0] += (gpuFramebufferSizeBytes>>1);
+#else
+  // The first buffer is the most recent GPU frame, which the main thread takes over from the GPU polling thread without copying it,
+  // the second buffer contains whatever the display is currently showing. This allows diffing pixels between the two.
+  uint16_t *framebuffer[2] = { AcquireNewestGpuFrame(), (uint16_t *)Malloc(gpuFramebufferSizeBytes, "main() framebuffer1") };
+  memset(framebuffer[1], 0, gpuFramebufferSizeBytes);
+#endif
+#ifdef SCANLINE_HASH_DIFF
+#ifdef USE_GPU_VSYNC
+  framebufferScanlineHashes[0] = (uint64_t *)Malloc(gpuFrameHeight*sizeof(uint64_t), "main() scanline hashes0");
+  memset(framebufferScanlineHashes[0], 0, gpuFrameHeight*sizeof(uint64_t));
+#else
+  framebuffer[0] = AcquireNewestGpuFrame(&framebufferScanlineHashes[0]); // The scanline hashes travel along with the frames of the GPU polling thread
+#endif
+  framebufferScanlineHashes[1] = (uint64_t *)Malloc(gpuFrameHeight*sizeof(uint64_t), "main() scanline hashes1");
+  memset(framebufferScanlineHashes[1], 0, gpuFrameHeight*sizeof(uint64_t));
+#endif
+#ifdef TRACK_OVERLAY_STATE
+  uint32_t overlayState = 0; // Overlay state that framebuffer[0] was drawn with: the statistics overlay generation, and whether the low battery icon is shown
+  uint32_t prevOverlayState = 0xFFFFFFFFu; // Overlay state that the previous framebuffer was drawn with. Initially invalid so that the first frame is diffed in full.
+#endif
+  changedScanlinesStart = 0;
+  changedScanlinesEnd = gpuFrameHeight;
+#ifndef USE_GPU_VSYNC
+  bool prevFramebufferHoldsPrevGpuFrame = false; // True if the previous framebuffer holds the GPU frame that was taken before framebuffer[0]
+  int gpuFrameChangedStart = 0, gpuFrameChangedEnd = 0; // Scanlines of framebuffer[0] that changed since the GPU frame that was taken before it
+#endif
+#ifdef SEND_PIXELS_WITH_DMA_2D_STRIDE
+  uint32_t dmaFramebufferBusAddress = 0; // Bus address of the DMA framebuffer that the pixel spans of the current frame are sent from
 #endif
 
+  uint32_t numFramesSubmitted = 0;
+#ifdef KERNEL_MODULE_CLIENT
+  // The kernel module does not report the frames it has sent, so track where in the SPI task queue the submitted frames end instead
   uint32_t curFrameEnd = spiTaskMemory->queueTail;
   uint32_t prevFrameEnd = spiTaskMemory->queueTail;
+#endif
+  uint64_t frameCaptureTime = tick(); // When the pixels in framebuffer[0] were snapshotted
+#ifdef DROP_STALE_FRAMES
+  int frameStartSpiX = spiX, frameStartSpiY = spiY, frameStartSpiEndX = spiEndX; // Write cursor state before the newest submitted frame
+#endif
 
   bool prevFrameWasInterlacedUpdate = false;
   bool interlacedUpdate = false; // True if the previous update we did was an interlaced half field update.
@@ -160,7 +297,7 @@ int main()
     else
     {
       uint64_t waitStart = tick();
-      while(__atomic_load_n(&numNewGpuFrames, __ATOMIC_SEQ_CST) == 0)
+      while(__atomic_load_n(&numNewGpuFrames, __ATOMIC_SEQ_CST) == 0 && !__atomic_load_n(&frameSourceEnded, __ATOMIC_SEQ_CST))
       {
 #if defined(BACKLIGHT_CONTROL) && defined(TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY)
         if (!displayOff && tick() - waitStart > TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY)
@@ -182,45 +319,75 @@ int main()
       }
     }
 
-    bool spiThreadWasWorkingHardBefore = false;
+    // Once the frame source has ended, only quit after the last frame of the stream has been fully submitted: the other field of an
+    // interlaced update is still pending, and the GPU polling thread may have published frames before the end that are not yet taken.
+#ifdef USE_GPU_VSYNC
+    if (__atomic_load_n(&frameSourceEnded, __ATOMIC_SEQ_CST) && !prevFrameWasInterlacedUpdate)
+#else
+    if (__atomic_load_n(&frameSourceEnded, __ATOMIC_SEQ_CST) && !prevFrameWasInterlacedUpdate && __atomic_load_n(&numNewGpuFrames, __ATOMIC_SEQ_CST) == 0)
+#endif
+    {
+#if defined(USE_SPI_THREAD) || defined(KERNEL_MODULE_CLIENT)
+      // Let the SPI thread finish sending the last frame of the stream before quitting, so that it is what stays on the display
+      while(programRunning && __atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_ACQUIRE) != spiTaskMemory->queueTail) usleep(1000);
+#endif
+      MarkProgramQuitting();
+      break;
+    }
+
+    bool droppedStaleFrame = false;
 
     // At all times keep at most two rendered frames in the SPI task queue pending to be displayed. Only proceed to submit a new frame
     // once the older of those has been displayed.
-    bool once = true;
-    while ((spiTaskMemory->queueTail + SPI_QUEUE_SIZE - spiTaskMemory->queueHead) % SPI_QUEUE_SIZE > (spiTaskMemory->queueTail + SPI_QUEUE_SIZE - prevFrameEnd) % SPI_QUEUE_SIZE)
+#ifdef KERNEL_MODULE_CLIENT
+    // The older frame has been sent once the queue head has advanced past its end
+    while(programRunning && (spiTaskMemory->queueTail + SPI_QUEUE_SIZE - __atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_ACQUIRE)) % SPI_QUEUE_SIZE > (spiTaskMemory->queueTail + SPI_QUEUE_SIZE - prevFrameEnd) % SPI_QUEUE_SIZE)
     {
-      if (spiTaskMemory->spiBytesQueued > 10000)
-        spiThreadWasWorkingHardBefore = true; // SPI thread had too much work in queue atm (2 full frames)
-
-      // Peek at the SPI thread's workload and throttle a bit if it has got a lot of work still to do.
-      double usecsUntilSpiQueueEmpty = spiTaskMemory->spiBytesQueued*spiUsecsPerByte;
+      // Peek at the kernel module's workload and throttle a bit if it has got a lot of work still to do.
+      double usecsUntilSpiQueueEmpty = __atomic_load_n(&spiTaskMemory->spiBytesQueued, __ATOMIC_RELAXED)*spiUsecsPerByte;
       if (usecsUntilSpiQueueEmpty > 0)
       {
-        uint32_t bytesInQueueBefore = spiTaskMemory->spiBytesQueued;
         uint32_t sleepUsecs = (uint32_t)(usecsUntilSpiQueueEmpty*0.4);
-#ifdef STATISTICS
-        uint64_t t0 = tick();
-#endif
         if (sleepUsecs > 1000) usleep(500);
-
-#ifdef STATISTICS
-        uint64_t t1 = tick();
-        uint32_t bytesInQueueAfter = spiTaskMemory->spiBytesQueued;
-        bool starved = (spiTaskMemory->queueHead == spiTaskMemory->queueTail);
-        if (starved) spiThreadWasWorkingHardBefore = false;
-
-/*
-        if (once && starved)
-        {
-          printf("Had %u bytes in queue, asked to sleep for %u usecs, got %u usecs sleep, afterwards %u bytes in queue. (got %.2f%% work done)%s\n",
-            bytesInQueueBefore, sleepUsecs, (uint32_t)(t1 - t0), bytesInQueueAfter, (bytesInQueueBefore-bytesInQueueAfter)*100.0/bytesInQueueBefore,
-            starved ? "  SLEPT TOO LONG, SPI THREAD STARVED" : "");
-          once = false;
-        }
-*/
-#endif
       }
     }
+#else
+    for(uint32_t framesDone = __atomic_load_n(&spiTaskMemory->framesDone, __ATOMIC_ACQUIRE); programRunning && !droppedStaleFrame && (int32_t)(numFramesSubmitted - framesDone) > 1;
+      framesDone = __atomic_load_n(&spiTaskMemory->framesDone, __ATOMIC_ACQUIRE))
+    {
+#ifdef DROP_STALE_FRAMES
+      // If a new frame has arrived while the SPI thread is still sending an older frame, try to drop the newest queued frame instead of waiting
+      // for it to be sent. Its update of the previous framebuffer is undone, so the new frame will be diffed against what the display will
+      // actually show, and repaints the pixels of the dropped frame as well.
+      if (__atomic_load_n(&numNewGpuFrames, __ATOMIC_SEQ_CST) > 0 && DropQueuedFrame(numFramesSubmitted))
+      {
+        RestorePrevFramebufferSpans(framebuffer[1]);
+        // The display write window is left where it was before the dropped frame
+        spiX = frameStartSpiX;
+        spiY = frameStartSpiY;
+        spiEndX = frameStartSpiEndX;
+#ifdef TRACK_OVERLAY_STATE
+        prevOverlayState = 0xFFFFFFFFu; // The hashes no longer describe the previous framebuffer, so have them invalidated after the next capture
+#endif
+#ifndef USE_GPU_VSYNC
+        prevFramebufferHoldsPrevGpuFrame = false;
+#endif
+#ifdef DISPLAY_VERTICAL_SCROLL_DETECTION
+        VerticalScrollPrevFramebufferUpdated(false);
+#endif
+        droppedStaleFrame = true;
+        break;
+      }
+      // New frames wake this wait as well (see SignalNewGpuFrame() in gpu.cpp). A frame that arrives right before the wait starts does not,
+      // so only sleep for a short while at a time to not miss it until the SPI thread has sent the whole older frame.
+      timespec timeout = {};
+      timeout.tv_nsec = 2000000;
+      syscall(SYS_futex, &spiTaskMemory->framesDone, FUTEX_WAIT, framesDone, &timeout, 0, 0); // Sleep until the SPI thread has sent another frame, or a new frame arrives
+#else
+      syscall(SYS_futex, &spiTaskMemory->framesDone, FUTEX_WAIT, framesDone, 0, 0, 0); // Sleep until the SPI thread has sent another frame
+#endif
+    }
+#endif
 
     int expiredFrames = 0;
     uint64_t now = tick();
@@ -243,12 +410,17 @@ int main()
 
     int numNewFrames = __atomic_load_n(&numNewGpuFrames, __ATOMIC_SEQ_CST);
     bool gotNewFramebuffer = (numNewFrames > 0);
+#ifdef USE_GPU_VSYNC
+    // Vsync signals keep arriving after the end of the stream, but there are no more frames to snapshot
+    gotNewFramebuffer = gotNewFramebuffer && !__atomic_load_n(&frameSourceEnded, __ATOMIC_SEQ_CST);
+#endif
     bool framebufferHasNewChangedPixels = true;
-    uint64_t frameObtainedTime;
+#ifdef USE_GPU_VSYNC
+    uint64_t frameObtainedTime = 0; // When framebuffer[0] was snapshotted, if gotNewFramebuffer
+#endif
     if (gotNewFramebuffer)
     {
 #ifdef USE_GPU_VSYNC
-      // TODO: Hardcoded vsync interval to 60 for now. Would be better to compute yet another histogram of the vsync arrival times, if vsync is not set to 60hz.
       // N.B. copying directly to videoCoreFramebuffer[1] that may be directly accessed by the main thread, so this could
       // produce a visible tear between two adjacent frames, but since we don't have vsync anyways, currently not caring too much.
 
@@ -262,9 +434,25 @@ int main()
       usleep(timeToSleep);
 #endif
 
+#ifdef SELF_SYNCHRONIZE_TO_GPU_VSYNC_PRODUCED_NEW_FRAMES
+      // Applications produce their frames at some phase after the vsync signal, so take the first snapshot at the learned phase instead of
+      // right away, so that it is likely to already see the new frame
+      const uint64_t vsyncTime = MostRecentVsyncTime();
+      int64_t timeToNewFrame = PredictNewFrameTimeAfterVsync(vsyncTime) - tick();
+      if (timeToNewFrame > 0)
+        usleep(timeToNewFrame);
+      uint64_t snapshotTime = framePollingStartTime = tick();
+#endif
+
+#ifdef SCANLINE_HASH_DIFF
+      framebufferHasNewChangedPixels = SnapshotFramebuffer(framebuffer[0], framebufferScanlineHashes[0]);
+#else
       framebufferHasNewChangedPixels = SnapshotFramebuffer(framebuffer[0]);
+#endif
+#elif defined(SCANLINE_HASH_DIFF)
+      framebuffer[0] = AcquireNewestGpuFrame(&framebufferScanlineHashes[0], &gpuFrameChangedStart, &gpuFrameChangedEnd);
 #else
-      memcpy(framebuffer[0], videoCoreFramebuffer[1], gpuFramebufferSizeBytes);
+      framebuffer[0] = AcquireNewestGpuFrame(0, &gpuFrameChangedStart, &gpuFrameChangedEnd);
 #endif
 
       PollLowBattery();
@@ -278,6 +466,9 @@ int main()
 
       DrawStatisticsOverlay(framebuffer[0]);
       DrawLowBatteryIcon(framebuffer[0]);
+#ifdef TRACK_OVERLAY_STATE
+      overlayState = (statsOverlayGeneration << 1) | (LowBatteryIconVisible() ? 1 : 0);
+#endif
 
 #ifdef USE_GPU_VSYNC
 
@@ -290,16 +481,25 @@ int main()
       // we must keep polling for frames until we find one that it has produced.
 #ifdef SELF_SYNCHRONIZE_TO_GPU_VSYNC_PRODUCED_NEW_FRAMES
       framebufferHasNewChangedPixels = framebufferHasNewChangedPixels && IsNewFramebuffer(framebuffer[0], framebuffer[1]);
-      uint64_t timeToGiveUpThereIsNotGoingToBeANewFrame = framePollingStartTime + 1000000/TARGET_FRAME_RATE/2;
+      uint64_t timeToGiveUpThereIsNotGoingToBeANewFrame = framePollingStartTime + EstimateVsyncInterval()/2;
+      uint64_t lastSnapshotWithoutNewFrame = 0;
       while(!framebufferHasNewChangedPixels && tick() < timeToGiveUpThereIsNotGoingToBeANewFrame)
       {
+        // The application has not produced its frame at the learned phase this time, so fall back to polling for it
+        lastSnapshotWithoutNewFrame = snapshotTime;
         usleep(2000);
-        frameObtainedTime = tick();
+        frameObtainedTime = snapshotTime = tick();
+#ifdef SCANLINE_HASH_DIFF
+        framebufferHasNewChangedPixels = SnapshotFramebuffer(framebuffer[0], framebufferScanlineHashes[0]);
+#else
         framebufferHasNewChangedPixels = SnapshotFramebuffer(framebuffer[0]);
+#endif
         DrawStatisticsOverlay(framebuffer[0]);
         DrawLowBatteryIcon(framebuffer[0]);
         framebufferHasNewChangedPixels = framebufferHasNewChangedPixels && IsNewFramebuffer(framebuffer[0], framebuffer[1]);
       }
+      if (framebufferHasNewChangedPixels)
+        AddVsyncNewFrameSample(vsyncTime, lastSnapshotWithoutNewFrame, snapshotTime);
 #else
       framebufferHasNewChangedPixels = true;
 #endif
@@ -320,6 +520,18 @@ int main()
       if (!displayOff)
         RefreshStatisticsOverlayText();
 #endif
+
+#ifdef USE_GPU_VSYNC
+      frameCaptureTime = frameObtainedTime;
+#else
+      frameCaptureTime = tick();
+#endif
+
+#ifdef DROP_STALE_FRAMES
+      // Even if the new frame is the same as the dropped one, it differs from what the display will show
+      if (droppedStaleFrame)
+        framebufferHasNewChangedPixels = true;
+#endif
     }
 
     // If too many pixels have changed on screen, drop adaptively to interlaced updating to keep up the frame rate.
@@ -334,9 +546,71 @@ int main()
 #endif
     const double tooMuchToUpdateUsecs = timesliceToUseForScreenUpdates / desiredTargetFps; // If updating the current and new frame takes too many frames worth of allotted time, drop to interlacing.
 
+    int bytesTransferred = 0;
+    Span *head = 0;
+
+#if defined(ALL_TASKS_SHOULD_DMA) && (defined(UPDATE_FRAMES_WITHOUT_DIFFING) || defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF))
 #if !defined(NO_INTERLACING) || (defined(BACKLIGHT_CONTROL) && defined(TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY))
     int numChangedPixels = framebufferHasNewChangedPixels ? CountNumChangedPixels(framebuffer[0], framebuffer[1]) : 0;
 #endif
+#else
+#ifndef USE_GPU_VSYNC
+    // If the previous framebuffer holds the previously taken GPU frame with the same overlays drawn on it, it only differs from the current
+    // frame on the scanlines that the GPU polling thread saw change, so only those need to be diffed.
+    const bool diffOnlyGpuChangedScanlines = gotNewFramebuffer && prevFramebufferHoldsPrevGpuFrame && overlayState == prevOverlayState;
+    changedScanlinesStart = diffOnlyGpuChangedScanlines ? gpuFrameChangedStart : 0;
+    changedScanlinesEnd = diffOnlyGpuChangedScanlines ? gpuFrameChangedEnd : gpuFrameHeight;
+#endif
+#ifdef SCANLINE_HASH_DIFF
+    // Scanline hashes are computed before the overlays are drawn, so they only describe the framebuffer contents as long as the overlays
+    // stay the same. If the overlays have changed since the previous framebuffer was drawn, all of its scanlines need to be diffed.
+    if (overlayState != prevOverlayState)
+      InvalidatePrevFramebufferScanlineHashes();
+#endif
+#ifdef TRACK_OVERLAY_STATE
+    prevOverlayState = overlayState;
+#endif
+
+#ifdef DISPLAY_VERTICAL_SCROLL_DETECTION
+    // If the frame contents have scrolled vertically, scroll the display in hardware to avoid having to repaint the whole frame
+    bool detectedVerticalScroll = gotNewFramebuffer && framebufferHasNewChangedPixels && !displayOff;
+    if (detectedVerticalScroll)
+    {
+      int dy = DetectVerticalScroll(framebuffer[0], framebuffer[1]);
+      if (dy != 0)
+      {
+        ScrollDisplayVertically(dy, framebuffer[0], framebuffer[1]);
+        spiY = -1; // The display memory scanline that the write cursor points to no longer corresponds to the same framebuffer scanline
+#ifdef SCANLINE_HASH_DIFF
+        // The scrolled previous framebuffer also carries the overlays along to other scanlines, so its hashes no longer apply
+        InvalidatePrevFramebufferScanlineHashes();
+#endif
+        changedScanlinesStart = 0;
+        changedScanlinesEnd = gpuFrameHeight;
+      }
+    }
+#endif
+
+    // Collect all spans in this image. The whole frame is diffed progressively first, and the number of changed pixels
+    // to decide whether to interlace is estimated from the produced spans, so that the framebuffers are only streamed through once.
+    if (framebufferHasNewChangedPixels || prevFrameWasInterlacedUpdate)
+    {
+#if defined(TILED_PIXEL_DIFF)
+      DiffFramebuffersToTiledSpans(framebuffer[0], framebuffer[1], false, 0, head);
+#else
+      // If possible, utilize a faster 4-wide pixel diffing method
+#ifdef FAST_BUT_COARSE_PIXEL_DIFF
+      if (gpuFrameWidth % 4 == 0 && gpuFramebufferScanlineStrideBytes % 8 == 0)
+        DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(framebuffer[0], framebuffer[1], false, 0, head);
+      else
+#endif
+        DiffFramebuffersToScanlineSpansExact(framebuffer[0], framebuffer[1], false, 0, head); // If disabled, or framebuffer width is not compatible, use the exact method
+#endif
+    }
+#if !defined(NO_INTERLACING) || (defined(BACKLIGHT_CONTROL) && defined(TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY))
+    int numChangedPixels = framebufferHasNewChangedPixels ? NumPixelsInSpans(head) : 0;
+#endif
+#endif
 
 #ifdef NO_INTERLACING
     interlacedUpdate = false;
@@ -344,42 +618,41 @@ int main()
     interlacedUpdate = (numChangedPixels > 0);
 #else
     uint32_t bytesToSend = numChangedPixels * SPI_BYTESPERPIXEL + (DISPLAY_DRAWABLE_HEIGHT<<1);
-    interlacedUpdate = ((bytesToSend + spiTaskMemory->spiBytesQueued) * spiUsecsPerByte > tooMuchToUpdateUsecs); // Decide whether to do interlacedUpdate - only updates half of the screen
+    interlacedUpdate = ((bytesToSend + __atomic_load_n(&spiTaskMemory->spiBytesQueued, __ATOMIC_RELAXED)) * spiUsecsPerByte > tooMuchToUpdateUsecs); // Decide whether to do interlacedUpdate - only updates half of the screen
 #endif
 
     if (interlacedUpdate) frameParity = 1-frameParity; // Swap even-odd fields every second time we do an interlaced update (progressive updates ignore field order)
-    int bytesTransferred = 0;
-    Span *head = 0;
 
 #if defined(ALL_TASKS_SHOULD_DMA) && defined(UPDATE_FRAMES_WITHOUT_DIFFING)
     NoDiffChangedRectangle(head);
 #elif defined(ALL_TASKS_SHOULD_DMA) && defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF)
     DiffFramebuffersToSingleChangedRectangle(framebuffer[0], framebuffer[1], head);
 #else
-    // Collect all spans in this image
-    if (framebufferHasNewChangedPixels || prevFrameWasInterlacedUpdate)
+    if (interlacedUpdate)
     {
-      // If possible, utilize a faster 4-wide pixel diffing method
-#ifdef FAST_BUT_COARSE_PIXEL_DIFF
-      if (gpuFrameWidth % 4 == 0 && gpuFramebufferScanlineStrideBytes % 8 == 0)
-        DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(framebuffer[0], framebuffer[1], interlacedUpdate, frameParity, head);
-      else
+#if defined(TILED_PIXEL_DIFF)
+      // Tiles span several scanlines, so they cannot be split to fields after the fact: rediff only the current field
+      head = 0;
+      if (framebufferHasNewChangedPixels || prevFrameWasInterlacedUpdate)
+        DiffFramebuffersToTiledSpans(framebuffer[0], framebuffer[1], true, frameParity, head);
+#else
+      // Scanline spans of a progressive diff are the same as the spans an interlaced diff would produce, so just pick the current field from them
+      SelectInterlacedFieldSpans(head, frameParity);
 #endif
-        DiffFramebuffersToScanlineSpansExact(framebuffer[0], framebuffer[1], interlacedUpdate, frameParity, head); // If disabled, or framebuffer width is not compatible, use the exact method
     }
-
-    // Merge spans together on adjacent scanlines - works only if doing a progressive update
-    if (!interlacedUpdate)
+    else // Merge spans together on adjacent scanlines - works only if doing a progressive update
       MergeScanlineSpanList(head);
 #endif
 
 #ifdef USE_GPU_VSYNC
     if (head) // do we have a new frame?
     {
-      // If using vsync, this main thread is responsible for maintaining the frame histogram. If not using vsync,
-      // but instead are using a dedicated GPU thread, then that dedicated thread maintains the frame histogram,
-      // in which case this is not needed.
-      AddHistogramSample(frameObtainedTime);
+      // If using vsync, this main thread is responsible for tracking the frame arrival times. If not using vsync,
+      // but instead are using a dedicated GPU thread, then that dedicated thread tracks the frame arrival times,
+      // in which case this is not needed. The spans may also be the other field of an interlaced frame that has
+      // already been sampled, without a new snapshot.
+      if (gotNewFramebuffer)
+        AddFrameArrivalSample(frameObtainedTime);
 
       // We got a new frame, so update contents of the statistics overlay as well
       if (!displayOff)
@@ -387,7 +660,29 @@ int main()
     }
 #endif
 
-    // Submit spans
+    // Submit spans, delimited by frame markers. The tasks of the whole frame are handed over to the SPI thread at once at the end.
+    const bool submitFrame = head && !displayOff;
+    SPIFrameMarker frameMarker = {};
+    frameMarker.captureTime = frameCaptureTime;
+    frameMarker.frameNumber = numFramesSubmitted + 1;
+    frameMarker.interlaced = interlacedUpdate;
+    frameMarker.parity = frameParity;
+    BeginTaskBatch();
+    if (submitFrame) QueueFrameMarker(&frameMarker);
+#ifdef DROP_STALE_FRAMES
+    if (submitFrame)
+    {
+      frameStartSpiX = spiX;
+      frameStartSpiY = spiY;
+      frameStartSpiEndX = spiEndX;
+      numUndoSpans = numUndoPixels = 0;
+    }
+#endif
+#ifdef SEND_PIXELS_WITH_DMA_2D_STRIDE
+    // The pixels of the spans are copied to the other DMA framebuffer below, since the previous frame may still be sent from this one
+    if (submitFrame)
+      dmaFramebufferBusAddress = NextDMAFramebuffer();
+#endif
     if (!displayOff)
     for(Span *i = head; i; i = i->next)
     {
@@ -400,6 +695,9 @@ int main()
         else --i->x;
         ++i->size;
       }
+#endif
+#ifdef DROP_STALE_FRAMES
+      SavePrevFramebufferSpan(i, framebuffer[1]);
 #endif
       // Update the write cursor if needed
 #ifndef DISPLAY_WRITE_PIXELS_CMD_DOES_NOT_RESET_WRITE_CURSOR
@@ -407,9 +705,9 @@ int main()
 #endif
       {
 #if defined(MUST_SEND_FULL_CURSOR_WINDOW) || defined(ALIGN_TASKS_FOR_DMA_TRANSFERS)
-        QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_Y, displayYOffset + i->y, displayYOffset + gpuFrameHeight - 1);
+        QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_Y, displayYOffset + ScrolledScanline(i->y), displayYOffset + gpuFrameHeight - 1);
 #else
-        QUEUE_MOVE_CURSOR_TASK(DISPLAY_SET_CURSOR_Y, displayYOffset + i->y);
+        QUEUE_MOVE_CURSOR_TASK(DISPLAY_SET_CURSOR_Y, displayYOffset + ScrolledScanline(i->y));
 #endif
         IN_SINGLE_THREADED_MODE_RUN_TASK();
         spiY = i->y;
@@ -466,7 +764,11 @@ int main()
       }
 
       // Submit the span pixels
+#ifdef SPI_32BIT_COMMANDS
+      SPITask *task = AllocExpandedTask(i->size*SPI_BYTESPERPIXEL);
+#else
       SPITask *task = AllocTask(i->size*SPI_BYTESPERPIXEL);
+#endif
       task->cmd = DISPLAY_WRITE_PIXELS;
 
       bytesTransferred += task->PayloadSize()+1;
@@ -482,58 +784,109 @@ int main()
       task->fb = (uint8_t*)(scanline + i->x);
       task->prevFb = (uint8_t*)(prevScanline + i->x);
       task->width = i->endX - i->x;
+#elif defined(SEND_PIXELS_WITH_DMA_2D_STRIDE)
+      // The DMA engine reads the pixels of the span rectangle straight from the big endian DMA framebuffer, so instead of converting the pixels to
+      // the task, only the span rectangle is copied there. The rest of the DMA framebuffer is left stale, since no task of this frame reads it.
+      task->fbBusAddress = dmaFramebufferBusAddress + i->y * gpuFramebufferScanlineStrideBytes + i->x * FRAMEBUFFER_BYTESPERPIXEL;
+      task->width = i->endX - i->x;
+      task->height = i->endY - i->y;
+      task->lastScanlineWidth = i->lastScanEndX - i->x;
+      for(int y = i->y; y < i->endY; ++y, scanline += gpuFramebufferScanlineStrideBytes>>1, prevScanline += gpuFramebufferScanlineStrideBytes>>1)
+      {
+        int endX = (y + 1 == i->endY) ? i->lastScanEndX : i->endX;
+        CopyPixelsToDMAFramebuffer(y * gpuFramebufferScanlineStrideBytes + i->x * FRAMEBUFFER_BYTESPERPIXEL, scanline+i->x, endX - i->x);
+#if !(defined(ALL_TASKS_SHOULD_DMA) && defined(UPDATE_FRAMES_WITHOUT_DIFFING)) // If not diffing, no need to maintain prev frame.
+        memcpy(prevScanline+i->x, scanline+i->x, (endX - i->x)*FRAMEBUFFER_BYTESPERPIXEL);
+#endif
+      }
+#elif defined(SPI_32BIT_COMMANDS)
+      // Convert the pixels straight to the 32-bit words that go out on the bus, after the command word of the task, updating the previous framebuffer on the way
+      uint32_t *data = (uint32_t*)task->PayloadStart() + 1;
+      for(int y = i->y; y < i->endY; ++y, scanline += gpuFramebufferScanlineStrideBytes>>1, prevScanline += gpuFramebufferScanlineStrideBytes>>1)
+      {
+        int endX = (y + 1 == i->endY) ? i->lastScanEndX : i->endX;
+        ExpandPixelsTo32BitSPITask(scanline + i->x, prevScanline + i->x, data, endX - i->x);
+        data += endX - i->x;
+      }
+#else
+#ifdef SPI_TASK_QUEUE_IN_DMA_MEMORY
+      // The task queue is uncached memory that faults on unaligned accesses, so the pixels are written to the task with aligned words only
+      SPITaskWordWriter writer = { (uint32_t*)task->data, 0, 0 };
 #else
-      uint16_t *data = (uint16_t*)task->data;
+      uint8_t *data = task->data;
+#endif
       for(int y = i->y; y < i->endY; ++y, scanline += gpuFramebufferScanlineStrideBytes>>1, prevScanline += gpuFramebufferScanlineStrideBytes>>1)
       {
         int endX = (y + 1 == i->endY) ? i->lastScanEndX : i->endX;
-        int x = i->x;
-#ifdef DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2
-        // Convert from R5G6B5 to R6X2G6X2B6X2 on the fly
-        while(x < endX)
-        {
-          uint16_t pixel = scanline[x++];
-          uint16_t r = (pixel >> 8) & 0xF8;
-          uint16_t g = (pixel >> 3) & 0xFC;
-          uint16_t b = (pixel << 3) & 0xF8;
-          ((uint8_t*)data)[0] = r | (r >> 5); // On red and blue color channels, need to expand 5 bits to 6 bits. Do that by duplicating the highest bit as lowest bit.
-          ((uint8_t*)data)[1] = g;
-          ((uint8_t*)data)[2] = b | (b >> 5);
-          data = (uint16_t*)((uintptr_t)data + 3);
-        }
+#if defined(ALL_TASKS_SHOULD_DMA) && defined(UPDATE_FRAMES_WITHOUT_DIFFING)
+        uint16_t *prevPixels = 0; // If not diffing, no need to maintain prev frame.
 #else
-        while(x < endX && (x&1)) *data++ = __builtin_bswap16(scanline[x++]);
-        while(x < (endX&~1U))
-        {
-          uint32_t u = *(uint32_t*)(scanline+x);
-          *(uint32_t*)data = ((u & 0xFF00FF00U) >> 8) | ((u & 0x00FF00FFU) << 8);
-          data += 2;
-          x += 2;
-        }
-        while(x < endX) *data++ = __builtin_bswap16(scanline[x++]);
+        uint16_t *prevPixels = prevScanline + i->x;
 #endif
-#if !(defined(ALL_TASKS_SHOULD_DMA) && defined(UPDATE_FRAMES_WITHOUT_DIFFING)) // If not diffing, no need to maintain prev frame.
-        memcpy(prevScanline+i->x, scanline+i->x, (endX - i->x)*FRAMEBUFFER_BYTESPERPIXEL);
+        // Convert the pixels to the display format and update the previous framebuffer in one pass
+#ifdef SPI_TASK_QUEUE_IN_DMA_MEMORY
+        CopyPixelsToSPITaskWords(scanline + i->x, prevPixels, &writer, endX - i->x);
+#else
+        CopyPixelsToSPITask(scanline + i->x, prevPixels, data, endX - i->x);
+        data += (endX - i->x) * SPI_BYTESPERPIXEL;
 #endif
       }
+#ifdef SPI_TASK_QUEUE_IN_DMA_MEMORY
+      FlushSPITaskWords(&writer);
+#endif
 #endif
       CommitTask(task);
       IN_SINGLE_THREADED_MODE_RUN_TASK();
     }
+    if (submitFrame)
+    {
+      frameMarker.end = 1;
+      frameMarker.bytes = bytesTransferred;
+      QueueFrameMarker(&frameMarker);
+      ++numFramesSubmitted;
+    }
+#ifndef USE_GPU_VSYNC
+    // A progressive update copies all changed pixels of the current frame to the previous framebuffer
+    prevFramebufferHoldsPrevGpuFrame = !displayOff && !interlacedUpdate;
+#endif
+    EndTaskBatch();
+
+#if defined(SEND_FRAMES_AS_ONE_DMA_CHAIN) && !defined(USE_SPI_THREAD)
+    // Compile the whole frame into one DMA chain and kick it off
+    ExecuteSPITasks();
+#endif
 
 #ifdef KERNEL_MODULE_CLIENT
     // Wake the kernel module up to run tasks. TODO: This might not be best placed here, we could pre-empt
     // to start running tasks already half-way during task submission above.
-    if (spiTaskMemory->queueHead != spiTaskMemory->queueTail && !(spi->cs & BCM2835_SPI0_CS_TA))
+    if (__atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_ACQUIRE) != spiTaskMemory->queueTail && !(spi->cs & BCM2835_SPI0_CS_TA))
       spi->cs |= BCM2835_SPI0_CS_TA;
-#endif
 
-    // Remember where in the command queue this frame ends, to keep track of the SPI thread's progress over it
     if (bytesTransferred > 0)
     {
       prevFrameEnd = curFrameEnd;
       curFrameEnd = spiTaskMemory->queueTail;
     }
+#endif
+
+#ifdef SCANLINE_HASH_DIFF
+    // All changed pixels on the scanlines that were diffed have now been copied to the previous framebuffer
+    if (!displayOff && (framebufferHasNewChangedPixels || prevFrameWasInterlacedUpdate))
+      UpdatePrevFramebufferScanlineHashes(interlacedUpdate, frameParity);
+#endif
+
+#ifdef DISPLAY_VERTICAL_SCROLL_DETECTION
+    // A progressive update copies all changed pixels to the previous framebuffer, so it now matches the frame that was scanned for scrolling.
+    if (detectedVerticalScroll)
+      VerticalScrollPrevFramebufferUpdated(!interlacedUpdate);
+    else if (head)
+      VerticalScrollPrevFramebufferUpdated(false);
+#endif
+
+#ifdef SIMULATE_PERIPHERALS
+    if (bytesTransferred > 0)
+      SimulatedFrameSubmitted(interlacedUpdate);
+#endif
 
 #if defined(BACKLIGHT_CONTROL) && defined(TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY)
     double percentageOfScreenChanged = (double)numChangedPixels/(DISPLAY_DRAWABLE_WIDTH*DISPLAY_DRAWABLE_HEIGHT);
@@ -571,6 +924,9 @@ int main()
 #endif
   }
 
+#ifdef PARALLEL_PIXEL_DIFF
+  DeinitDiffThreads();
+#endif
   DeinitGPU();
   DeinitSPI();
   CloseMailbox();
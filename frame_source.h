@@ -0,0 +1,30 @@
+#pragma once
+
+#include <inttypes.h>
+
+// A frame source produces the frames that are shown on the display. Exactly one backend is built in: by default frames are
+// captured from the VideoCore GPU with DispmanX (frame_source_dispmanx.cpp). If FRAME_SOURCE_REPLAY is defined, frames are
+// instead streamed from a prerecorded file or pipe (frame_source_replay.cpp), so that the rest of the pipeline can be run and
+// profiled without a GPU to capture from.
+
+// Replay streams consist of a header of the four characters "FBCP" followed by the frame width and height as little endian
+// uint32s. After that each frame consists of its arrival time as a little endian uint64 in microseconds since the start of the
+// recording, followed by width*height tightly packed little endian RGB565 pixels. Arrival times must be nondecreasing.
+#define FRAME_SOURCE_REPLAY_MAGIC "FBCP"
+
+// Opens the frame source, and returns the size of its frames in pixels.
+void InitFrameSource(int *frameWidth, int *frameHeight);
+
+// Sets up the frame source to scale its frames to scaledWidth x scaledHeight pixels, and to capture the rectangle [x, x+width[ x [y, y+height[
+// of the scaled frames.
+void ConfigureFrameSourceCapture(int scaledWidth, int scaledHeight, int x, int y, int width, int height);
+
+// Copies the most recent frame to destination, which points to the top-left corner of the captured rectangle. Due to a DispmanX bug,
+// destination must have room for x + y*strideBytes/2 pixels before it. Returns the time when the frame arrived in arrivalTime.
+// Returns false if no more frames can be produced.
+bool CaptureFrame(uint16_t *destination, int strideBytes, uint64_t *arrivalTime);
+
+// Registers a function that is called on each vertical sync of the frame source, or unregisters it if callback is null.
+void SetFrameSourceVsyncCallback(void (*callback)(void));
+
+void DeinitFrameSource(void);
@@ -0,0 +1,100 @@
+#include "config.h"
+#include "frame_source.h"
+
+#ifndef FRAME_SOURCE_REPLAY
+
+#include <bcm_host.h> // bcm_host_init, bcm_host_deinit
+#include <stdio.h> // printf
+#include <stdlib.h> // exit
+#include <syslog.h> // syslog, LOG_ERR
+
+#include "tick.h"
+#include "util.h"
+
+static DISPMANX_DISPLAY_HANDLE_T display;
+static DISPMANX_RESOURCE_HANDLE_T screen_resource;
+static VC_RECT_T rect;
+static void (*vsyncCallback)(void) = 0;
+
+void InitFrameSource(int *frameWidth, int *frameHeight)
+{
+  // Initialize GPU frame grabbing subsystem
+  bcm_host_init();
+  display = vc_dispmanx_display_open(0);
+  if (!display) FATAL_ERROR("vc_dispmanx_display_open failed! Make sure to have hdmi_force_hotplug=1 setting in /boot/config.txt");
+  DISPMANX_MODEINFO_T display_info;
+  int ret = vc_dispmanx_display_get_info(display, &display_info);
+  if (ret) FATAL_ERROR("vc_dispmanx_display_get_info failed!");
+  *frameWidth = display_info.width;
+  *frameHeight = display_info.height;
+}
+
+void ConfigureFrameSourceCapture(int scaledWidth, int scaledHeight, int x, int y, int width, int height)
+{
+  uint32_t image_prt;
+  printf("Creating dispmanX resource of size %dx%d (aspect ratio=%f).\n", scaledWidth, scaledHeight, (double)scaledWidth / scaledHeight);
+  screen_resource = vc_dispmanx_resource_create(VC_IMAGE_RGB565, scaledWidth, scaledHeight, &image_prt);
+  if (!screen_resource) FATAL_ERROR("vc_dispmanx_resource_create failed!");
+  vc_dispmanx_rect_set(&rect, x, y, width, height);
+}
+
+bool CaptureFrame(uint16_t *destination, int strideBytes, uint64_t *arrivalTime)
+{
+  // Grab a new frame from the GPU. TODO: Figure out a way to get a frame callback for each GPU-rendered frame,
+  // that would be vastly superior for lower latency, reduced stuttering and lighter processing overhead.
+  // Currently this implemented method just takes a snapshot of the most current GPU framebuffer contents,
+  // without any concept of "finished frames". If this is the case, it's possible that this could grab the same
+  // frame twice, and then potentially missing, or displaying the later appearing new frame at a very last moment.
+  // Profiling, the following two lines take around ~1msec of time.
+  *arrivalTime = tick();
+  int failed = vc_dispmanx_snapshot(display, screen_resource, (DISPMANX_TRANSFORM_T)0);
+  if (failed)
+  {
+    // We cannot do much better here (or do not know what to do), it looks like if vc_dispmanx_snapshot() fails once, it will crash if attempted to be called again, and it will not recover. We can only terminate here. Sad :/
+    printf("vc_dispmanx_snapshot() failed with return code %d! If this appears related to a change in HDMI/display resolution, see https://github.com/juj/fbcp-ili9341/issues/28 and https://github.com/raspberrypi/userland/issues/461 (try setting fbcp-ili9341 up as an infinitely restarting system service to recover)\n", failed);
+    return false;
+  }
+  // BUG in vc_dispmanx_resource_read_data(!!): If one is capturing a small subrectangle of a large screen resource rectangle, the destination pointer
+  // is in vc_dispmanx_resource_read_data() incorrectly still taken to point to the top-left corner of the large screen resource, instead of the top-left
+  // corner of the subrectangle to capture. Therefore do dirty pointer arithmetic to adjust for this. To make this safe, the destination framebuffers are allocated
+  // double their needed size so that this adjusted pointer does not reference outside allocated memory (if it did, vc_dispmanx_resource_read_data() was seen
+  // to randomly fail and then subsequently hang if called a second time)
+  uint16_t *destPtr = destination - rect.y*(strideBytes>>1) - rect.x;
+  failed = vc_dispmanx_resource_read_data(screen_resource, &rect, destPtr, strideBytes);
+  if (failed)
+  {
+    printf("vc_dispmanx_resource_read_data failed with return code %d!\n", failed);
+    return false;
+  }
+  return true;
+}
+
+static void DispmanxVsyncCallback(DISPMANX_UPDATE_HANDLE_T u, void *arg)
+{
+  vsyncCallback();
+}
+
+void SetFrameSourceVsyncCallback(void (*callback)(void))
+{
+  vsyncCallback = callback;
+  if (display) vc_dispmanx_vsync_callback(display, callback ? DispmanxVsyncCallback : NULL, 0);
+}
+
+void DeinitFrameSource()
+{
+  if (screen_resource)
+  {
+    vc_dispmanx_resource_delete(screen_resource);
+    screen_resource = 0;
+  }
+
+  if (display)
+  {
+    vc_dispmanx_display_close(display);
+    display = 0;
+  }
+
+  bcm_host_deinit();
+}
+
+#endif // ~!FRAME_SOURCE_REPLAY
@@ -0,0 +1,147 @@
+#include "config.h"
+#include "frame_source.h"
+
+#ifdef FRAME_SOURCE_REPLAY
+
+#include <memory.h> // memcpy
+#include <pthread.h> // pthread_create
+#include <stdio.h> // fopen, fread
+#include <stdlib.h> // exit
+#include <string.h> // strcmp
+#include <syslog.h> // syslog, LOG_ERR
+
+#include "tick.h"
+#include "util.h"
+#include "mem_alloc.h"
+
+// DispmanX delivers vsync callbacks at the refresh rate of the HDMI output, independent of the rate that content is produced at
+#define REPLAY_VSYNC_RATE 60
+
+static FILE *replayFile = 0;
+static int replayWidth = 0, replayHeight = 0;
+static int captureX = 0, captureY = 0, captureWidth = 0, captureHeight = 0;
+
+// The most recent frame of the stream that has arrived by now, and the time that it arrived at
+static uint16_t *replayFrame = 0;
+static uint64_t replayFrameArrivalTime = 0;
+
+// Frames are replayed relative to this time. The header of the next frame in the stream is read ahead to know when it arrives
+static uint64_t replayStartTime = 0;
+static uint64_t nextFrameTime = 0;
+static bool nextFrameTimeRead = false;
+static bool endOfStream = false;
+
+static pthread_t vsyncThread;
+static void (*vsyncCallback)(void) = 0; // Read by the vsync thread, so only accessed atomically
+
+static bool ReadReplay(void *destination, size_t bytes)
+{
+  return fread(destination, 1, bytes, replayFile) == bytes;
+}
+
+void InitFrameSource(int *frameWidth, int *frameHeight)
+{
+  replayFile = strcmp(FRAME_SOURCE_REPLAY, "-") ? fopen(FRAME_SOURCE_REPLAY, "rb") : stdin;
+  if (!replayFile) FATAL_ERROR("Failed to open frame replay file " FRAME_SOURCE_REPLAY "!");
+
+  char magic[4];
+  uint32_t size[2];
+  if (!ReadReplay(magic, sizeof(magic)) || memcmp(magic, FRAME_SOURCE_REPLAY_MAGIC, sizeof(magic)) || !ReadReplay(size, sizeof(size)) || size[0] == 0 || size[1] == 0)
+    FATAL_ERROR("Frame replay file " FRAME_SOURCE_REPLAY " does not start with a valid header! (see frame_source.h for the format)");
+  replayWidth = (int)size[0];
+  replayHeight = (int)size[1];
+  replayFrame = (uint16_t *)Malloc(replayWidth * replayHeight * sizeof(uint16_t), "frame_source_replay.cpp frame");
+  memset(replayFrame, 0, replayWidth * replayHeight * sizeof(uint16_t));
+  printf("Replaying frames of size %dx%d from " FRAME_SOURCE_REPLAY "\n", replayWidth, replayHeight);
+
+  *frameWidth = replayWidth;
+  *frameHeight = replayHeight;
+}
+
+void ConfigureFrameSourceCapture(int scaledWidth, int scaledHeight, int x, int y, int width, int height)
+{
+  // Replayed frames are not rescaled, so they need to have been recorded at the size that they are displayed at
+  if (scaledWidth != replayWidth || scaledHeight != replayHeight)
+  {
+    printf("Replayed frames of size %dx%d would need to be scaled to %dx%d to fit the display! Record the frames at the display resolution, or build with DISPLAY_CROPPED_INSTEAD_OF_SCALING.\n", replayWidth, replayHeight, scaledWidth, scaledHeight);
+    FATAL_ERROR("Scaling replayed frames is not supported!");
+  }
+  captureX = x;
+  captureY = y;
+  captureWidth = width;
+  captureHeight = height;
+  replayStartTime = tick();
+  replayFrameArrivalTime = replayStartTime;
+}
+
+bool CaptureFrame(uint16_t *destination, int strideBytes, uint64_t *arrivalTime)
+{
+  // Like a snapshot of the GPU framebuffer, capture the most recent frame that has arrived by now, skipping over any frames that arrived between two captures
+  // After the last frame of the stream has been captured, the replay ends.
+  if (endOfStream)
+  {
+    printf("Reached the end of frame replay stream " FRAME_SOURCE_REPLAY "\n");
+    return false;
+  }
+  const uint64_t now = tick();
+  for(;;)
+  {
+    if (!nextFrameTimeRead)
+    {
+      if (!ReadReplay(&nextFrameTime, sizeof(nextFrameTime)))
+      {
+        endOfStream = true;
+        break;
+      }
+      nextFrameTimeRead = true;
+    }
+    if (replayStartTime + nextFrameTime > now)
+      break;
+    if (!ReadReplay(replayFrame, replayWidth * replayHeight * sizeof(uint16_t)))
+    {
+      printf("Frame replay stream " FRAME_SOURCE_REPLAY " ended in the middle of a frame!\n");
+      return false;
+    }
+    replayFrameArrivalTime = replayStartTime + nextFrameTime;
+    nextFrameTimeRead = false;
+  }
+
+  for(int y = 0; y < captureHeight; ++y)
+    memcpy(destination + y*(strideBytes>>1), replayFrame + (captureY + y)*replayWidth + captureX, captureWidth * sizeof(uint16_t));
+  *arrivalTime = replayFrameArrivalTime;
+  return true;
+}
+
+static void *vsync_thread(void*)
+{
+  uint64_t nextVsync = tick();
+  while(__atomic_load_n(&vsyncCallback, __ATOMIC_ACQUIRE))
+  {
+    nextVsync += 1000000 / REPLAY_VSYNC_RATE;
+    int64_t timeToSleep = (int64_t)(nextVsync - tick());
+    if (timeToSleep > 0) usleep(timeToSleep);
+    void (*callback)(void) = __atomic_load_n(&vsyncCallback, __ATOMIC_ACQUIRE);
+    if (callback) callback();
+  }
+  pthread_exit(0);
+}
+
+void SetFrameSourceVsyncCallback(void (*callback)(void))
+{
+  bool wasRunning = (__atomic_exchange_n(&vsyncCallback, callback, __ATOMIC_ACQ_REL) != 0);
+  if (callback && !wasRunning)
+  {
+    int rc = pthread_create(&vsyncThread, NULL, vsync_thread, NULL);
+    if (rc != 0) FATAL_ERROR("Failed to create frame replay vsync thread!");
+  }
+  else if (!callback && wasRunning)
+    pthread_join(vsyncThread, NULL);
+}
+
+void DeinitFrameSource()
+{
+  if (replayFile && replayFile != stdin) fclose(replayFile);
+  replayFile = 0;
+}
+
+#endif // ~FRAME_SOURCE_REPLAY
@@ -1,20 +1,26 @@
-#include <bcm_host.h> // bcm_host_init, bcm_host_deinit
-
 #include <linux/futex.h> // FUTEX_WAKE
 #include <sys/syscall.h> // SYS_futex
 #include <syslog.h> // syslog, LOG_ERR
 #include <stdio.h> // fprintf
+#include <memory.h> // memcpy
+#include <pthread.h> // pthread_create
 #include <math.h> // floor
 
 #include "config.h"
 #include "gpu.h"
+#include "frame_source.h"
 #include "display.h"
 #include "tick.h"
 #include "util.h"
 #include "statistics.h"
 #include "mem_alloc.h"
+#include "spi.h"
 
-bool MarkProgramQuitting(void);
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+// If building with NEON available, the software orientation flip transposes 8x8 pixel blocks with SIMD
+#define GPU_USE_NEON
+#endif
 
 // Uncomment these build options to make the display output a random performance test pattern instead of the actual
 // display content. Used to debug/measure performance.
@@ -24,16 +30,35 @@ bool MarkProgramQuitting(void);
 
 #define RANDOM_TEST_PATTERN_FRAME_RATE 120
 
-DISPMANX_DISPLAY_HANDLE_T display;
-DISPMANX_RESOURCE_HANDLE_T screen_resource;
-VC_RECT_T rect;
-
 int frameTimeHistorySize = 0;
 
 FrameHistory frameTimeHistory[FRAME_HISTORY_MAX_SIZE] = {};
 
-uint16_t *videoCoreFramebuffer[2] = {};
+#ifndef USE_GPU_VSYNC
+// The GPU polling thread hands captured frames over to the main thread through a triple buffer, so that neither thread needs to copy them.
+// The polling thread snapshots to the back buffer, and the main thread owns the front buffer until it takes a newer frame. The middle buffer
+// holds the most recent complete frame, and the two threads exchange their buffer with it with an atomic swap of its index. Each buffer
+// carries along the hashes of its scanlines.
+#define NUM_GPU_FRAME_BUFFERS 3
+static uint16_t *gpuFrameBuffers[NUM_GPU_FRAME_BUFFERS] = {};
+static uint64_t *gpuFrameScanlineHashes[NUM_GPU_FRAME_BUFFERS] = {};
+static int gpuFrameBackIndex = 0; // Owned by the GPU polling thread
+static int gpuFrameFrontIndex = 2; // Owned by the main thread
+// Index of the middle buffer. GPU_FRAME_FRESH is set if the frame in it has not yet been taken by the main thread. Fresh frames also
+// carry the range of scanlines [start, end[ that changed since the frame that the main thread took before, packed into the same word
+// so that it is exchanged together with the frame.
+#define GPU_FRAME_INDEX_MASK 0x3
+#define GPU_FRAME_FRESH 0x4
+#define GPU_FRAME_CHANGED_SCANLINES(start, end) (((uint32_t)(start) << 3) | ((uint32_t)(end) << 17))
+#define GPU_FRAME_CHANGED_SCANLINES_START(middle) (((middle) >> 3) & 0x3FFF)
+#define GPU_FRAME_CHANGED_SCANLINES_END(middle) (((middle) >> 17) & 0x3FFF)
+static uint32_t gpuFrameMiddle = 1;
+// Scanline hashes of the most recently published frame. New frames are detected by comparing these instead of pixels, since the main
+// thread draws the overlays on the frames that it takes, so the pixels of the published frame do not stay intact to compare against.
+static uint64_t *publishedScanlineHashes = 0;
+#endif
 volatile int numNewGpuFrames = 0;
+volatile bool frameSourceEnded = false;
 
 int displayXOffset = 0;
 int displayYOffset = 0;
@@ -47,8 +72,8 @@ int excessPixelsRight = 0;
 int excessPixelsTop = 0;
 int excessPixelsBottom = 0;
 
-// If one first runs content that updates at e.g. 24fps, a video perhaps, the frame rate histogram will lock to that update
-// rate and frame snapshots are done at 24fps. Later when user quits watching the video, and returns to e.g. 60fps updated
+// If one first runs content that updates at e.g. 24fps, a video perhaps, the frame arrival phase-locked loop will lock to that
+// update rate and frame snapshots are done at 24fps. Later when user quits watching the video, and returns to e.g. 60fps updated
 // launcher menu, there needs to be some mechanism that detects that update rate has now increased, and synchronizes to the
 // new update rate. If snapshots keep occurring at fixed 24fps, the increase in content update rate would go unnoticed.
 // Therefore maintain a "linear increases/geometric slowdowns" style of factor that pulls the frame snapshotting mechanism
@@ -57,9 +82,22 @@ int excessPixelsBottom = 0;
 int eagerFastTrackToSnapshottingFramesEarlierFactor = 0;
 
 uint64_t lastFramePollTime = 0;
+// Time when the frame that was most recently captured by SnapshotFramebuffer() arrived from the frame source
+uint64_t lastFrameArrivalTime = 0;
 
 pthread_t gpuPollingThread;
 
+// Tells the main thread that a new frame has arrived, and wakes it if it was sleeping to get one
+static void SignalNewGpuFrame()
+{
+  __atomic_fetch_add(&numNewGpuFrames, 1, __ATOMIC_SEQ_CST);
+  syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAKE, 1, 0, 0, 0);
+#ifdef DROP_STALE_FRAMES
+  // The main thread may instead be waiting for the SPI thread to send an older frame, and can now drop the newest queued frame
+  syscall(SYS_futex, &spiTaskMemory->framesDone, FUTEX_WAKE, 1, 0, 0, 0);
+#endif
+}
+
 int RoundUpToMultipleOf(int val, int multiple)
 {
   return ((val + multiple - 1) / multiple) * multiple;
@@ -74,7 +112,70 @@ bool IsNewFramebuffer(uint16_t *possiblyNewFramebuffer, uint16_t *oldFramebuffer
   return false;
 }
 
-bool SnapshotFramebuffer(uint16_t *destination)
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+// Transposes a block of 8x8 pixels, strides are in pixels
+static inline void TransposeBlock8x8(const uint16_t *src, int srcStride, uint16_t *dst, int dstStride)
+{
+#ifdef GPU_USE_NEON
+  uint16x8x2_t r01 = vtrnq_u16(vld1q_u16(src), vld1q_u16(src + srcStride));
+  uint16x8x2_t r23 = vtrnq_u16(vld1q_u16(src + 2*srcStride), vld1q_u16(src + 3*srcStride));
+  uint16x8x2_t r45 = vtrnq_u16(vld1q_u16(src + 4*srcStride), vld1q_u16(src + 5*srcStride));
+  uint16x8x2_t r67 = vtrnq_u16(vld1q_u16(src + 6*srcStride), vld1q_u16(src + 7*srcStride));
+  // Each 32-bit lane now holds a pair of pixels of two adjacent rows, so transposing those pairs gathers four rows of each column
+  uint32x4x2_t c0246Top = vtrnq_u32(vreinterpretq_u32_u16(r01.val[0]), vreinterpretq_u32_u16(r23.val[0]));
+  uint32x4x2_t c1357Top = vtrnq_u32(vreinterpretq_u32_u16(r01.val[1]), vreinterpretq_u32_u16(r23.val[1]));
+  uint32x4x2_t c0246Bottom = vtrnq_u32(vreinterpretq_u32_u16(r45.val[0]), vreinterpretq_u32_u16(r67.val[0]));
+  uint32x4x2_t c1357Bottom = vtrnq_u32(vreinterpretq_u32_u16(r45.val[1]), vreinterpretq_u32_u16(r67.val[1]));
+#define COLUMN(top, bottom, half) vcombine_u16(vreinterpret_u16_u32(vget_##half##_u32(top)), vreinterpret_u16_u32(vget_##half##_u32(bottom)))
+  vst1q_u16(dst, COLUMN(c0246Top.val[0], c0246Bottom.val[0], low));
+  vst1q_u16(dst + dstStride, COLUMN(c1357Top.val[0], c1357Bottom.val[0], low));
+  vst1q_u16(dst + 2*dstStride, COLUMN(c0246Top.val[1], c0246Bottom.val[1], low));
+  vst1q_u16(dst + 3*dstStride, COLUMN(c1357Top.val[1], c1357Bottom.val[1], low));
+  vst1q_u16(dst + 4*dstStride, COLUMN(c0246Top.val[0], c0246Bottom.val[0], high));
+  vst1q_u16(dst + 5*dstStride, COLUMN(c1357Top.val[0], c1357Bottom.val[0], high));
+  vst1q_u16(dst + 6*dstStride, COLUMN(c0246Top.val[1], c0246Bottom.val[1], high));
+  vst1q_u16(dst + 7*dstStride, COLUMN(c1357Top.val[1], c1357Bottom.val[1], high));
+#undef COLUMN
+#else
+  // Gather the block to a local array first, so that the compiler does not need to assume that the stores may alias the loads
+  uint16_t block[8][8];
+  for(int y = 0; y < 8; ++y)
+    for(int x = 0; x < 8; ++x)
+      block[x][y] = src[y*srcStride+x];
+  for(int y = 0; y < 8; ++y)
+    memcpy(dst + y*dstStride, block[y], sizeof(block[y]));
+#endif
+}
+
+// Transposes the captured landscape frame to the portrait frame destination of size width x height, strides are in pixels. The frame is
+// processed in bands of 8 destination scanlines one 8x8 block at a time, so that both the reads and the writes stay within a few cache lines
+// instead of one side striding through the whole frame for each pixel. The scanline hashes of each band are computed right after it has
+// been written, while it is still in the cache.
+void TransposeFramebuffer(const uint16_t *src, int srcStride, uint16_t *destination, int dstStride, int width, int height, uint64_t *scanlineHashes)
+{
+  int y = 0;
+  for(; y + 8 <= height; y += 8)
+  {
+    int x = 0;
+    for(; x + 8 <= width; x += 8)
+      TransposeBlock8x8(src + x*srcStride + y, srcStride, destination + y*dstStride + x, dstStride);
+    for(; x < width; ++x)
+      for(int i = 0; i < 8; ++i)
+        destination[(y+i)*dstStride+x] = src[x*srcStride+y+i];
+    if (scanlineHashes)
+      for(int i = 0; i < 8; ++i)
+        scanlineHashes[y+i] = HashScanline(destination + (y+i)*dstStride, width);
+  }
+  for(; y < height; ++y)
+  {
+    for(int x = 0; x < width; ++x)
+      destination[y*dstStride+x] = src[x*srcStride+y];
+    if (scanlineHashes) scanlineHashes[y] = HashScanline(destination + y*dstStride, width);
+  }
+}
+#endif
+
+bool SnapshotFramebuffer(uint16_t *destination, uint64_t *scanlineHashes)
 {
   lastFramePollTime = tick();
 
@@ -92,6 +193,7 @@ bool SnapshotFramebuffer(uint16_t *destination)
     lastTestImage = now;
   }
   randomColor = randomColor | (randomColor << 16);
+  lastFrameArrivalTime = now;
   uint32_t *newfb = (uint32_t*)destination;
   for(int y = 0; y < gpuFrameHeight; ++y)
   {
@@ -110,29 +212,13 @@ bool SnapshotFramebuffer(uint16_t *destination)
       }
       x += XX + 6;
     }
+    if (scanlineHashes) scanlineHashes[y] = HashScanline((uint16_t*)newfb, gpuFrameWidth);
     newfb += gpuFramebufferScanlineStrideBytes>>2;
   }
   barY = (barY + 1) % gpuFrameHeight;
 #else
-  // Grab a new frame from the GPU. TODO: Figure out a way to get a frame callback for each GPU-rendered frame,
-  // that would be vastly superior for lower latency, reduced stuttering and lighter processing overhead.
-  // Currently this implemented method just takes a snapshot of the most current GPU framebuffer contents,
-  // without any concept of "finished frames". If this is the case, it's possible that this could grab the same
-  // frame twice, and then potentially missing, or displaying the later appearing new frame at a very last moment.
-  // Profiling, the following two lines take around ~1msec of time.
-  int failed = vc_dispmanx_snapshot(display, screen_resource, (DISPMANX_TRANSFORM_T)0);
-  if (failed)
-  {
-    // We cannot do much better here (or do not know what to do), it looks like if vc_dispmanx_snapshot() fails once, it will crash if attempted to be called again, and it will not recover. We can only terminate here. Sad :/
-    printf("vc_dispmanx_snapshot() failed with return code %d! If this appears related to a change in HDMI/display resolution, see https://github.com/juj/fbcp-ili9341/issues/28 and https://github.com/raspberrypi/userland/issues/461 (try setting fbcp-ili9341 up as an infinitely restarting system service to recover)\n", failed);
-    MarkProgramQuitting();
-    return false;
-  }
-  // BUG in vc_dispmanx_resource_read_data(!!): If one is capturing a small subrectangle of a large screen resource rectangle, the destination pointer 
-  // is in vc_dispmanx_resource_read_data() incorrectly still taken to point to the top-left corner of the large screen resource, instead of the top-left
-  // corner of the subrectangle to capture. Therefore do dirty pointer arithmetic to adjust for this. To make this safe, videoCoreFramebuffer is allocated
-  // double its needed size so that this adjusted pointer does not reference outside allocated memory (if it did, vc_dispmanx_resource_read_data() was seen
-  // to randomly fail and then subsequently hang if called a second time)
+  // Due to a bug in DispmanX, the frame source needs room for its capture rectangle offset before the destination pointer. To make this safe,
+  // videoCoreFramebuffer is allocated double its needed size so that the adjusted pointer does not reference outside allocated memory.
 #ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
   static uint16_t *tempTransposeBuffer = 0; // Allocate as static here to keep the number of #ifdefs down a bit
   const int pixelWidth = gpuFrameHeight+excessPixelsTop+excessPixelsBottom;
@@ -143,25 +229,27 @@ bool SnapshotFramebuffer(uint16_t *destination)
     tempTransposeBuffer = (uint16_t *)Malloc(pixelHeight * stride * 2, "gpu.cpp tempTransposeBuffer");
     tempTransposeBuffer += pixelHeight * (stride>>1);
   }
-  uint16_t *destPtr = tempTransposeBuffer - excessPixelsLeft * (stride >> 1) - excessPixelsTop;
+  uint16_t *destPtr = tempTransposeBuffer;
 #else
-  uint16_t *destPtr = destination - excessPixelsTop*(gpuFramebufferScanlineStrideBytes>>1) - excessPixelsLeft;
+  uint16_t *destPtr = destination;
   const int stride = gpuFramebufferScanlineStrideBytes;
 #endif
-  failed = vc_dispmanx_resource_read_data(screen_resource, &rect, destPtr, stride);
-  if (failed)
+  if (!CaptureFrame(destPtr, stride, &lastFrameArrivalTime))
   {
-    printf("vc_dispmanx_resource_read_data failed with return code %d!\n", failed);
-    MarkProgramQuitting();
+    // The frame source has run out of frames. Leave it to the main thread to quit the program in between two frames, since it may
+    // currently be waiting for room in the SPI task queue, which the SPI thread would stop making if the program quit from here.
+    __atomic_store_n(&frameSourceEnded, true, __ATOMIC_SEQ_CST);
+    SignalNewGpuFrame();
     return false;
   }
 #ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
-  // Transpose the snapshotted frame from landscape to portrait. The following takes around 0.5-1.0 msec
-  // of extra CPU time, so while this improves tearing to be perhaps a bit nicer visually, it probably
-  // is not good on the Pi Zero.
-  for(int y = 0; y < gpuFrameHeight; ++y)
-    for(int x = 0; x < gpuFrameWidth; ++x)
-      destination[y*(gpuFramebufferScanlineStrideBytes>>1)+x] = tempTransposeBuffer[x*(stride>>1)+y];
+  // Transpose the snapshotted frame from landscape to portrait. This costs some extra CPU time, so while
+  // this improves tearing to be perhaps a bit nicer visually, it probably is not good on the Pi Zero.
+  TransposeFramebuffer(tempTransposeBuffer, stride>>1, destination, gpuFramebufferScanlineStrideBytes>>1, gpuFrameWidth, gpuFrameHeight, scanlineHashes);
+#else
+  if (scanlineHashes)
+    for(int y = 0; y < gpuFrameHeight; ++y)
+      scanlineHashes[y] = HashScanline(destination + y*(gpuFramebufferScanlineStrideBytes>>1), gpuFrameWidth);
 #endif
 
 #endif
@@ -170,16 +258,78 @@ bool SnapshotFramebuffer(uint16_t *destination)
 
 #ifdef USE_GPU_VSYNC
 
-void VsyncCallback(DISPMANX_UPDATE_HANDLE_T u, void *arg)
+// The vsync signal arrives at the refresh rate of the HDMI output, which may be e.g. 50, 60 or 75 Hz depending on the display mode,
+// so track the interval between vsync callbacks instead of assuming 60 Hz.
+static uint64_t mostRecentVsyncTime = 0;
+static uint32_t vsyncIntervalUsecs = 1000000/60;
+// Time from a vsync signal until the application has produced its new frame. Applications do not present their frames right at
+// vsync, so this is learned from when snapshots after the vsync signal see the new frame.
+static double vsyncToNewFramePhase = 0;
+
+// Number of vsync intervals in a row that need to disagree with the tracked interval before switching over to them, e.g. after the
+// display mode has changed. Single outliers are delayed or missed callbacks.
+#define VSYNC_INTERVAL_RELOCK_FRAMES 8
+// If a new frame is already there on the first snapshot after vsync, it may have been produced earlier than expected, so aim the next
+// snapshot this much earlier to find out.
+#define VSYNC_PHASE_PROBE_STEP 500
+
+void VsyncCallback()
 {
-  // If TARGET_FRAME_RATE is e.g. 30 or 20, decimate only every second or third vsync callback to be processed.
+  static double vsyncInterval = 1000000.0/60;
+  static int numVsyncIntervalOutliers = 0;
+  uint64_t now = tick();
+  if (mostRecentVsyncTime)
+  {
+    double interval = (double)(now - mostRecentVsyncTime);
+    if (ABS(interval - vsyncInterval) < vsyncInterval / 8)
+    {
+      vsyncInterval += (interval - vsyncInterval) / 16;
+      numVsyncIntervalOutliers = 0;
+    }
+    else if (++numVsyncIntervalOutliers >= VSYNC_INTERVAL_RELOCK_FRAMES)
+    {
+      vsyncInterval = interval;
+      numVsyncIntervalOutliers = 0;
+    }
+    __atomic_store_n(&vsyncIntervalUsecs, (uint32_t)vsyncInterval, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&mostRecentVsyncTime, now, __ATOMIC_RELAXED);
+
+  // If TARGET_FRAME_RATE is lower than the display refresh rate, e.g. 30 or 20 on a 60 Hz display, decimate only every second or third
+  // vsync callback to be processed.
+  const int refreshRate = (int)(1000000.0 / vsyncInterval + 0.5);
   static int frameSkipCounter = 0;
   frameSkipCounter += TARGET_FRAME_RATE;
-  if (frameSkipCounter < 60) return;
-  frameSkipCounter -= 60;
+  if (frameSkipCounter < refreshRate) return;
+  frameSkipCounter -= refreshRate;
 
-  __atomic_fetch_add(&numNewGpuFrames, 1, __ATOMIC_SEQ_CST);
-  syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAKE, 1, 0, 0, 0); // Wake the main thread if it was sleeping to get a new frame
+  SignalNewGpuFrame();
+}
+
+uint64_t MostRecentVsyncTime()
+{
+  return __atomic_load_n(&mostRecentVsyncTime, __ATOMIC_RELAXED);
+}
+
+uint64_t EstimateVsyncInterval()
+{
+  return __atomic_load_n(&vsyncIntervalUsecs, __ATOMIC_RELAXED);
+}
+
+uint64_t PredictNewFrameTimeAfterVsync(uint64_t vsyncTime)
+{
+  return vsyncTime + (uint64_t)vsyncToNewFramePhase;
+}
+
+void AddVsyncNewFrameSample(uint64_t vsyncTime, uint64_t lastSnapshotWithoutNewFrame, uint64_t snapshotWithNewFrame)
+{
+  double target;
+  if (lastSnapshotWithoutNewFrame > vsyncTime) // The new frame was produced in between these two snapshots
+    target = ((double)(lastSnapshotWithoutNewFrame - vsyncTime) + (double)(snapshotWithNewFrame - vsyncTime)) / 2;
+  else // The new frame was already there on the first snapshot, which tells only that it was produced by then
+    target = MIN((double)(int64_t)(snapshotWithNewFrame - vsyncTime), vsyncToNewFramePhase) - VSYNC_PHASE_PROBE_STEP;
+  vsyncToNewFramePhase += (target - vsyncToNewFramePhase) / 4;
+  vsyncToNewFramePhase = MIN(MAX(vsyncToNewFramePhase, 0.0), (double)EstimateVsyncInterval() / 2);
 }
 
 #else // !USE_GPU_VSYNC
@@ -189,7 +339,7 @@ extern volatile bool programRunning;
 void *gpu_polling_thread(void*)
 {
   uint64_t lastNewFrameReceivedTime = tick();
-  while(programRunning)
+  while(programRunning && !__atomic_load_n(&frameSourceEnded, __ATOMIC_SEQ_CST))
   {
 #ifdef SAVE_BATTERY_BY_SLEEPING_UNTIL_TARGET_FRAME
     const int64_t earlyFramePrediction = 500;
@@ -209,13 +359,18 @@ void *gpu_polling_thread(void*)
 
     uint64_t t0 = tick();
 
-    bool gotNewFramebuffer = SnapshotFramebuffer(videoCoreFramebuffer[0]);
-    // Check the pixel contents of the snapshot to see if we actually received a new frame to render
-    gotNewFramebuffer = gotNewFramebuffer && IsNewFramebuffer(videoCoreFramebuffer[0], videoCoreFramebuffer[1]);
+    bool gotNewFramebuffer = SnapshotFramebuffer(gpuFrameBuffers[gpuFrameBackIndex], gpuFrameScanlineHashes[gpuFrameBackIndex]);
+    // Compare the scanline hashes of the snapshot to see if we actually received a new frame to render, and find the first and
+    // the last scanline that changed on the way, so that the main thread only needs to diff the scanlines in between
+    const uint64_t *scanlineHashes = gpuFrameScanlineHashes[gpuFrameBackIndex];
+    int changedStart = 0, changedEnd = gpuFrameHeight;
+    while(changedStart < changedEnd && scanlineHashes[changedStart] == publishedScanlineHashes[changedStart]) ++changedStart;
+    while(changedEnd > changedStart && scanlineHashes[changedEnd-1] == publishedScanlineHashes[changedEnd-1]) --changedEnd;
+    gotNewFramebuffer = gotNewFramebuffer && changedStart < changedEnd;
     if (gotNewFramebuffer)
     {
-      lastNewFrameReceivedTime = t0;
-      AddHistogramSample(lastNewFrameReceivedTime);
+      lastNewFrameReceivedTime = lastFrameArrivalTime;
+      AddFrameArrivalSample(lastNewFrameReceivedTime);
     }
 
     uint64_t t1 = tick();
@@ -234,116 +389,176 @@ void *gpu_polling_thread(void*)
       // We got a new framebuffer, so linearly increase the driving rate to snapshot next framebuffer a bit earlier, in case
       // our update rate is too slow for the content.
       ++eagerFastTrackToSnapshottingFramesEarlierFactor;
-      memcpy(videoCoreFramebuffer[1], videoCoreFramebuffer[0], gpuFramebufferSizeBytes);
-      __atomic_fetch_add(&numNewGpuFrames, 1, __ATOMIC_SEQ_CST);
-      syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAKE, 1, 0, 0, 0); // Wake the main thread if it was sleeping to get a new frame
+      memcpy(publishedScanlineHashes + changedStart, scanlineHashes + changedStart, (changedEnd - changedStart)*sizeof(uint64_t));
+      // Publish the snapshot as the middle buffer, and continue capturing to the buffer that was in the middle. If the main thread did not
+      // take that frame, it is dropped, and its changed scanlines are carried over to this frame. Release the pixels of the snapshot to the
+      // main thread, and acquire the buffer that it may have released.
+      uint32_t middle = __atomic_load_n(&gpuFrameMiddle, __ATOMIC_RELAXED);
+      uint32_t newMiddle;
+      do
+      {
+        newMiddle = (middle & GPU_FRAME_FRESH)
+          ? GPU_FRAME_CHANGED_SCANLINES(MIN(changedStart, (int)GPU_FRAME_CHANGED_SCANLINES_START(middle)), MAX(changedEnd, (int)GPU_FRAME_CHANGED_SCANLINES_END(middle)))
+          : GPU_FRAME_CHANGED_SCANLINES(changedStart, changedEnd);
+        newMiddle |= gpuFrameBackIndex | GPU_FRAME_FRESH;
+      } while(!__atomic_compare_exchange_n(&gpuFrameMiddle, &middle, newMiddle, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+      gpuFrameBackIndex = middle & GPU_FRAME_INDEX_MASK;
+      SignalNewGpuFrame();
     }
   }
   pthread_exit(0);
 }
 
+uint16_t *AcquireNewestGpuFrame(uint64_t **scanlineHashes, int *changedScanlinesStart, int *changedScanlinesEnd)
+{
+  int changedStart = 0, changedEnd = 0;
+  // Only the GPU polling thread sets GPU_FRAME_FRESH, so if it is set here, the exchange below takes a fresh frame, possibly an even newer one
+  if ((__atomic_load_n(&gpuFrameMiddle, __ATOMIC_ACQUIRE) & GPU_FRAME_FRESH))
+  {
+    uint32_t middle = __atomic_exchange_n(&gpuFrameMiddle, (uint32_t)gpuFrameFrontIndex, __ATOMIC_ACQ_REL);
+    gpuFrameFrontIndex = middle & GPU_FRAME_INDEX_MASK;
+    changedStart = GPU_FRAME_CHANGED_SCANLINES_START(middle);
+    changedEnd = GPU_FRAME_CHANGED_SCANLINES_END(middle);
+  }
+  if (scanlineHashes) *scanlineHashes = gpuFrameScanlineHashes[gpuFrameFrontIndex];
+  if (changedScanlinesStart) *changedScanlinesStart = changedStart;
+  if (changedScanlinesEnd) *changedScanlinesEnd = changedEnd;
+  return gpuFrameBuffers[gpuFrameFrontIndex];
+}
+
 #endif // ~USE_GPU_VSYNC
 
-// Since we are polling for received GPU frames, run a histogram to predict when the next frame will arrive.
-// The histogram needs to be sufficiently small as to not cause a lag when frame rate suddenly changes on e.g.
-// main menu <-> ingame transitions
-uint64_t frameArrivalTimes[HISTOGRAM_SIZE];
-uint64_t frameArrivalTimesTail = 0;
-int histogramSize = 0;
+// Since we are polling for received GPU frames, track the interval and the phase of the arriving frames to predict when the next frame
+// will arrive. This is a software phase-locked loop: each arrived frame is matched to the nearest predicted arrival slot, and the
+// estimated phase and interval are both corrected by a fraction of how far off from that slot the frame arrived. This needs to adapt
+// quickly when frame rate suddenly changes on e.g. main menu <-> ingame transitions, so if several frames in a row arrive far off from
+// the predicted slots, or keep skipping slots, the loop relocks directly to the average interval of those frames.
+static uint64_t frameArrivalPhase = 0; // Filtered arrival time of the most recently arrived frame. Next frames are predicted at multiples of the interval from this.
+static double frameArrivalInterval = 1000000.0/TARGET_FRAME_RATE;
+static uint64_t mostRecentFrameArrivalTime = 0;
+static int numFrameArrivalSamples = 0; // 0: nothing known, 1: only the phase is known, 2: locked onto both the phase and the interval
+static int numFramesOffLock = 0; // Number of most recent frames in a row that arrived far off from the predicted slots
+static double offLockIntervalSum = 0; // Sum of the intervals between the frames that arrived off lock
+
+// Gains of the loop: the fraction of the arrival time error that is corrected to the phase, and to the interval
+#define FRAME_ARRIVAL_PHASE_GAIN 0.25
+#define FRAME_ARRIVAL_INTERVAL_GAIN 0.05
+// Number of frames in a row that need to arrive off lock before relocking to a new frame rate
+#define FRAME_ARRIVAL_RELOCK_FRAMES 3
+// Frame rates lower than 10fps are tracked as 10fps, so that waking up after a long idle period will not need to wait a long time
+#define MAX_FRAME_ARRIVAL_INTERVAL 100000
+
+void AddFrameArrivalSample(uint64_t t)
+{
+  if (numFrameArrivalSamples == 0) // The first frame only gives the phase
+  {
+    frameArrivalPhase = mostRecentFrameArrivalTime = t;
+    numFrameArrivalSamples = 1;
+    return;
+  }
+  if (numFrameArrivalSamples == 1) // The second frame gives the interval
+  {
+    frameArrivalInterval = MIN(t - mostRecentFrameArrivalTime, MAX_FRAME_ARRIVAL_INTERVAL);
+    frameArrivalPhase = mostRecentFrameArrivalTime = t;
+    numFrameArrivalSamples = 2;
+    numFramesOffLock = 0;
+    return;
+  }
 
-// If framerate has been high for a long time, but then drops to e.g. 1fps, it would take a very very long time to fill up
-// the histogram of these 1fps intervals, so fbcp-ili9341 would take a long time to go back to sleep. Introduce a max age
-// for histogram entries of 10 seconds, so that if refresh rate drops from 60hz to 1hz, then after 10 seconds the histogram
-// buffer will have only these 1fps intervals in it, and it will go to sleep to yield CPU time.
-#define HISTOGRAM_MAX_SAMPLE_AGE 10000000
+  // Match the frame to the nearest predicted arrival slot after the previous frame
+  double sinceFrameArrivalPhase = (double)(int64_t)(t - frameArrivalPhase);
+  int slots = MAX(1, (int)(sinceFrameArrivalPhase / frameArrivalInterval + 0.5));
+  double error = sinceFrameArrivalPhase - slots * frameArrivalInterval;
 
-void AddHistogramSample(uint64_t t)
-{
-  frameArrivalTimes[frameArrivalTimesTail] = t;
-  frameArrivalTimesTail = (frameArrivalTimesTail + 1) % HISTOGRAM_SIZE;
-  if (histogramSize < HISTOGRAM_SIZE) ++histogramSize;
+  // A single frame that arrives a bit off or skips a slot is likely just jitter or a dropped frame, but if this keeps happening, the
+  // frame rate of the content has changed.
+  if (slots > 1 || ABS(error) > frameArrivalInterval / 4)
+  {
+    if (numFramesOffLock++ == 0) offLockIntervalSum = 0;
+    offLockIntervalSum += MIN(t - mostRecentFrameArrivalTime, MAX_FRAME_ARRIVAL_INTERVAL);
+  }
+  else
+    numFramesOffLock = 0;
 
-  // Expire too old entries.
-  while(t - GET_HISTOGRAM(histogramSize-1) > HISTOGRAM_MAX_SAMPLE_AGE) --histogramSize;
+  if (numFramesOffLock >= FRAME_ARRIVAL_RELOCK_FRAMES)
+  {
+    frameArrivalInterval = offLockIntervalSum / numFramesOffLock;
+    frameArrivalPhase = t;
+    numFramesOffLock = 0;
+  }
+  else
+  {
+    frameArrivalPhase += (int64_t)(slots * frameArrivalInterval + FRAME_ARRIVAL_PHASE_GAIN * error);
+    frameArrivalInterval = MIN(MAX(frameArrivalInterval + FRAME_ARRIVAL_INTERVAL_GAIN * error / slots, 1000.0), MAX_FRAME_ARRIVAL_INTERVAL);
+  }
+  mostRecentFrameArrivalTime = t;
 }
 
-int cmp(const void *e1, const void *e2) { return *(uint64_t*)e1 > *(uint64_t*)e2; }
-
 uint64_t EstimateFrameRateInterval()
 {
 #ifdef RANDOM_TEST_PATTERN
   return 1000000/RANDOM_TEST_PATTERN_FRAME_RATE;
 #endif
-  if (histogramSize == 0) return 1000000/TARGET_FRAME_RATE;
-  uint64_t mostRecentFrame = GET_HISTOGRAM(0);
+  if (numFrameArrivalSamples == 0) return 1000000/TARGET_FRAME_RATE;
+  uint64_t mostRecentFrame = mostRecentFrameArrivalTime;
 
   // High sleep mode hacks to save battery when ~idle: (These could be removed with an event based VideoCore display refresh API)
   uint64_t timeNow = tick();
 #ifdef SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE
   // "Deep sleep" options: is user leaves the device with static content on screen for a long time.
-  if (timeNow - mostRecentFrame > 60000000) { histogramSize = 1; return 500000; } // if it's been more than one minute since last seen update, assume interval of 500ms.
+  if (timeNow - mostRecentFrame > 60000000) { numFrameArrivalSamples = 1; return 500000; } // if it's been more than one minute since last seen update, assume interval of 500ms.
   if (timeNow - mostRecentFrame > 5000000) return lastFramePollTime + 100000; // if it's been more than 5 seconds since last seen update, assume interval of 100ms.
 #endif
 
 #ifndef SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES
   return 1000000/TARGET_FRAME_RATE;
 #else
-  if (histogramSize < 2) return 100000; // Frame histogram needs to have at least a few entries to bootstrap, if there's very few, either refresh rate is low, or fbcp-ili9341 just started
-
-  // Look at the intervals of all previous arrived frames, and take some percentile value as our expected current frame rate
-  uint64_t intervals[HISTOGRAM_SIZE-1];
-  for(int i = 0; i < histogramSize-1; ++i)
-    intervals[i] = MIN(100000, GET_HISTOGRAM(i) - GET_HISTOGRAM(i+1));
-  qsort(intervals, histogramSize-1, sizeof(uint64_t), cmp);
-
-  // Apply frame rate increase discovery factor to both the percentile position and the interpreted frame interval to catch
-  // up with display update rate if it has increased
-  int percentile = (histogramSize-1)*2/5;
-  percentile = MAX(percentile-eagerFastTrackToSnapshottingFramesEarlierFactor, 0);
-  uint64_t interval = intervals[percentile];
-  // Fast tracking #1: Always look at two most recent frames in addition to the ~40% percentile and follow whichever is a shorter period of time
-  interval = MIN(interval, GET_HISTOGRAM(0) - GET_HISTOGRAM(1));
-  // Fast tracking #2: if we seem to always get a new frame whenever snapshotting, we should try speeding up
-  interval = MAX((int64_t)interval - eagerFastTrackToSnapshottingFramesEarlierFactor*1000, (int64_t)1000000/TARGET_FRAME_RATE);
-  if (interval > 100000) interval = 100000;
-  return MAX(interval, 1000000/TARGET_FRAME_RATE);
+  if (numFrameArrivalSamples < 2) return MAX_FRAME_ARRIVAL_INTERVAL; // Need to see at least two frames to bootstrap, if there's very few, either refresh rate is low, or fbcp-ili9341 just started
+
+  // Fast tracking: if we seem to always get a new frame whenever snapshotting, the content may be updating faster than the frames we
+  // see arrive, so we should try speeding up. Shrink the interval quadratically, so that a few frames in a row barely make a difference,
+  // but recovering from a long idle period at 10fps up to 60fps takes only about ten frames.
+  const int eager = eagerFastTrackToSnapshottingFramesEarlierFactor;
+  int64_t interval = (int64_t)(frameArrivalInterval * (1.0 - eager*eager/64.0));
+  return MAX(interval, (int64_t)1000000/TARGET_FRAME_RATE);
 #endif
 }
 
 uint64_t PredictNextFrameArrivalTime()
 {
-  uint64_t mostRecentFrame = histogramSize > 0 ? GET_HISTOGRAM(0) : tick();
+  uint64_t mostRecentFrame = numFrameArrivalSamples > 0 ? frameArrivalPhase : tick();
+  uint64_t mostRecentFrameArrival = numFrameArrivalSamples > 0 ? mostRecentFrameArrivalTime : tick();
 
   // High sleep mode hacks to save battery when ~idle: (These could be removed with an event based VideoCore display refresh API)
   uint64_t timeNow = tick();
 #ifdef SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE
   // "Deep sleep" options: is user leaves the device with static content on screen for a long time.
-  if (timeNow - mostRecentFrame > 60000000) { histogramSize = 1; return lastFramePollTime + 100000; } // if it's been more than one minute since last seen update, assume interval of 100ms.
-  if (timeNow - mostRecentFrame > 5000000) return lastFramePollTime + 100000; // if it's been more than 5 seconds since last seen update, assume interval of 100ms.
+  if (timeNow - mostRecentFrameArrival > 60000000) { numFrameArrivalSamples = 1; return lastFramePollTime + 100000; } // if it's been more than one minute since last seen update, assume interval of 100ms.
+  if (timeNow - mostRecentFrameArrival > 5000000) return lastFramePollTime + 100000; // if it's been more than 5 seconds since last seen update, assume interval of 100ms.
 #endif
   uint64_t interval = EstimateFrameRateInterval();
 
   // Assume that frames are arriving at times mostRecentFrame + k * interval.
-  // Find integer k such that mostRecentFrame + k * interval >= timeNow
-  // i.e. k = ceil((timeNow - mostRecentFrame) / interval)
-  uint64_t k = (timeNow - mostRecentFrame + interval - 1) / interval;
+  // Find integer k >= 1 such that mostRecentFrame + k * interval >= timeNow
+  // i.e. k = ceil((timeNow - mostRecentFrame) / interval). The filtered phase may be a bit ahead of the current time.
+  uint64_t k = timeNow > mostRecentFrame ? MAX(1, (timeNow - mostRecentFrame + interval - 1) / interval) : 1;
   uint64_t nextFrameArrivalTime = mostRecentFrame + k * interval;
   uint64_t timeOfPreviousMissedFrame = nextFrameArrivalTime - interval;
 
   // If there should have been a frame just 1/3rd of our interval window ago, assume it was just missed and report back "the next frame is right now"
   if (timeNow - timeOfPreviousMissedFrame < interval/3 && timeOfPreviousMissedFrame > mostRecentFrame) return timeNow;
-  else return nextFrameArrivalTime;
+
+  // Snapshotting only tells that a frame arrived at some point before it, so if we keep getting new frames whenever snapshotting, we may
+  // be snapshotting late with respect to the actual arrival times. Snapshot a bit earlier each time, so that eventually a snapshot lands
+  // just before a frame arrives, and the next one catches the actual arrival time for the phase-locked loop to lock onto.
+  return nextFrameArrivalTime - MIN((uint64_t)eagerFastTrackToSnapshottingFramesEarlierFactor*250, interval/4);
 }
 
 void InitGPU()
 {
   // Initialize GPU frame grabbing subsystem
-  bcm_host_init();
-  display = vc_dispmanx_display_open(0);
-  if (!display) FATAL_ERROR("vc_dispmanx_display_open failed! Make sure to have hdmi_force_hotplug=1 setting in /boot/config.txt");
-  DISPMANX_MODEINFO_T display_info;
-  int ret = vc_dispmanx_display_get_info(display, &display_info);
-  if (ret) FATAL_ERROR("vc_dispmanx_display_get_info failed!");
+  struct { int width, height; } display_info;
+  InitFrameSource(&display_info.width, &display_info.height);
 
 #ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
   // Pretend that the display framebuffer would be in portrait mode for the purposes of size computation etc.
@@ -448,37 +663,40 @@ void InitGPU()
   // corner of the subrectangle to capture. Therefore do dirty pointer arithmetic to adjust for this. To make this safe, videoCoreFramebuffer is allocated
   // double its needed size so that this adjusted pointer does not reference outside allocated memory (if it did, vc_dispmanx_resource_read_data() was seen
   // to randomly fail and then subsequently hang if called a second time)
-  videoCoreFramebuffer[0] = (uint16_t *)Malloc(gpuFramebufferSizeBytes*2, "gpu.cpp framebuffer0");
-  videoCoreFramebuffer[1] = (uint16_t *)Malloc(gpuFramebufferSizeBytes*2, "gpu.cpp framebuffer1");
-  memset(videoCoreFramebuffer[0], 0, gpuFramebufferSizeBytes*2);
-  memset(videoCoreFramebuffer[1], 0, gpuFramebufferSizeBytes*2);
-  videoCoreFramebuffer[0] += (gpuFramebufferSizeBytes>>1);
-  videoCoreFramebuffer[1] += (gpuFramebufferSizeBytes>>1);
+#ifndef USE_GPU_VSYNC
+  for(int i = 0; i < NUM_GPU_FRAME_BUFFERS; ++i)
+  {
+    gpuFrameBuffers[i] = (uint16_t *)Malloc(gpuFramebufferSizeBytes*2, "gpu.cpp framebuffer");
+    memset(gpuFrameBuffers[i], 0, gpuFramebufferSizeBytes*2);
+    gpuFrameBuffers[i] += (gpuFramebufferSizeBytes>>1);
+    gpuFrameScanlineHashes[i] = (uint64_t *)Malloc(gpuFrameHeight*sizeof(uint64_t), "gpu.cpp scanline hashes");
+    for(int y = 0; y < gpuFrameHeight; ++y)
+      gpuFrameScanlineHashes[i][y] = HashScanline(gpuFrameBuffers[i] + y*(gpuFramebufferScanlineStrideBytes>>1), gpuFrameWidth);
+  }
+  if (gpuFrameHeight > 0x3FFF) FATAL_ERROR("Frame height does not fit in the changed scanline range of the GPU frame triple buffer!");
+  publishedScanlineHashes = (uint64_t *)Malloc(gpuFrameHeight*sizeof(uint64_t), "gpu.cpp published scanline hashes");
+  memcpy(publishedScanlineHashes, gpuFrameScanlineHashes[0], gpuFrameHeight*sizeof(uint64_t));
+#endif
 
   syslog(LOG_INFO, "GPU display is %dx%d. SPI display is %dx%d with drawable area of %dx%d. Applying scaling factor horiz=%.2fx & vert=%.2fx, xOffset: %d, yOffset: %d, scaledWidth: %d, scaledHeight: %d", display_info.width, display_info.height, DISPLAY_WIDTH, DISPLAY_HEIGHT, DISPLAY_DRAWABLE_WIDTH, DISPLAY_DRAWABLE_HEIGHT, scalingFactorWidth, scalingFactorHeight, displayXOffset, displayYOffset, scaledWidth, scaledHeight);
   printf("Source GPU display is %dx%d. Output SPI display is %dx%d with a drawable area of %dx%d. Applying scaling factor horiz=%.2fx & vert=%.2fx, xOffset: %d, yOffset: %d, scaledWidth: %d, scaledHeight: %d\n", display_info.width, display_info.height, DISPLAY_WIDTH, DISPLAY_HEIGHT, DISPLAY_DRAWABLE_WIDTH, DISPLAY_DRAWABLE_HEIGHT, scalingFactorWidth, scalingFactorHeight, displayXOffset, displayYOffset, scaledWidth, scaledHeight);
 
-  uint32_t image_prt;
-  printf("Creating dispmanX resource of size %dx%d (aspect ratio=%f).\n", scaledWidth + excessPixelsLeft + excessPixelsRight, scaledHeight + excessPixelsTop + excessPixelsBottom, (double)(scaledWidth + excessPixelsLeft + excessPixelsRight) / (scaledHeight + excessPixelsTop + excessPixelsBottom));
 #ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
-  screen_resource = vc_dispmanx_resource_create(VC_IMAGE_RGB565, scaledHeight + excessPixelsTop + excessPixelsBottom, scaledWidth + excessPixelsLeft + excessPixelsRight, &image_prt);
-  vc_dispmanx_rect_set(&rect, excessPixelsTop, excessPixelsLeft, scaledHeight, scaledWidth);
+  ConfigureFrameSourceCapture(scaledHeight + excessPixelsTop + excessPixelsBottom, scaledWidth + excessPixelsLeft + excessPixelsRight, excessPixelsTop, excessPixelsLeft, scaledHeight, scaledWidth);
 #else
-  screen_resource = vc_dispmanx_resource_create(VC_IMAGE_RGB565, scaledWidth + excessPixelsLeft + excessPixelsRight, scaledHeight + excessPixelsTop + excessPixelsBottom, &image_prt);
-  vc_dispmanx_rect_set(&rect, excessPixelsLeft, excessPixelsTop, scaledWidth, scaledHeight);
+  ConfigureFrameSourceCapture(scaledWidth + excessPixelsLeft + excessPixelsRight, scaledHeight + excessPixelsTop + excessPixelsBottom, excessPixelsLeft, excessPixelsTop, scaledWidth, scaledHeight);
 #endif
-  if (!screen_resource) FATAL_ERROR("vc_dispmanx_resource_create failed!");
   printf("GPU grab rectangle is offset x=%d,y=%d, size w=%dxh=%d, aspect ratio=%f\n", excessPixelsLeft, excessPixelsTop, scaledWidth, scaledHeight, (double)scaledWidth / scaledHeight);
 
 #ifdef USE_GPU_VSYNC
   // Register to receive vsync notifications. This is a heuristic, since the application might not be locked at vsync, and even
   // if it was, this signal is not a guaranteed edge trigger for availability of new frames.
-  vc_dispmanx_vsync_callback(display, VsyncCallback, 0);
+  SetFrameSourceVsyncCallback(VsyncCallback);
 #else
-  // Record some fake samples to frame rate histogram to fast track it to warm state.
+  // Record some fake frame arrivals at the target frame rate to fast track the frame arrival predictor to warm state.
   uint64_t now = tick();
-  for(int i = 0; i < HISTOGRAM_SIZE; ++i)
-    AddHistogramSample(now - 1000000ULL*(HISTOGRAM_SIZE-i) / TARGET_FRAME_RATE);
+  AddFrameArrivalSample(now - 1000000/TARGET_FRAME_RATE);
+  AddFrameArrivalSample(now);
 
   int rc = pthread_create(&gpuPollingThread, NULL, gpu_polling_thread, NULL); // After creating the thread, it is assumed to have ownership of the SPI bus, so no SPI chat on the main thread after this.
   if (rc != 0) FATAL_ERROR("Failed to create GPU polling thread!");
@@ -488,23 +706,11 @@ void InitGPU()
 void DeinitGPU()
 {
 #ifdef USE_GPU_VSYNC
-  if (display) vc_dispmanx_vsync_callback(display, NULL, 0);
+  SetFrameSourceVsyncCallback(0);
 #else
   pthread_join(gpuPollingThread, NULL);
   gpuPollingThread = (pthread_t)0;
 #endif
 
-  if (screen_resource)
-  {
-    vc_dispmanx_resource_delete(screen_resource);
-    screen_resource = 0;
-  }
-
-  if (display)
-  {
-    vc_dispmanx_display_close(display);
-    display = 0;
-  }
-
-  bcm_host_deinit();
+  DeinitFrameSource();
 }
@@ -1,17 +1,43 @@
 #pragma once
 
 #include <inttypes.h>
+#include <string.h>
+
+#include "config.h"
 
 void InitGPU(void);
 void DeinitGPU(void);
-void AddHistogramSample(uint64_t t);
-bool SnapshotFramebuffer(uint16_t *destination);
+// Records that a new frame arrived from the frame source at time t, for the phase-locked loop that predicts when the next frames arrive.
+void AddFrameArrivalSample(uint64_t t);
+// Captures the current GPU frame to destination. If scanlineHashes is not null, the hash of each captured scanline is written to it.
+bool SnapshotFramebuffer(uint16_t *destination, uint64_t *scanlineHashes = 0);
 bool IsNewFramebuffer(uint16_t *possiblyNewFramebuffer, uint16_t *oldFramebuffer);
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+// Transposes the captured landscape frame src to the portrait frame destination of size width x height, i.e. scanline y of destination is
+// column y of src. Strides are in pixels. If scanlineHashes is not null, the hash of each scanline of destination is written to it.
+void TransposeFramebuffer(const uint16_t *src, int srcStride, uint16_t *destination, int dstStride, int width, int height, uint64_t *scanlineHashes);
+#endif
 uint64_t EstimateFrameRateInterval(void);
 uint64_t PredictNextFrameArrivalTime(void);
+#ifdef USE_GPU_VSYNC
+uint64_t MostRecentVsyncTime(void);
+// Returns the tracked interval between vsync signals, i.e. the refresh period of the HDMI output
+uint64_t EstimateVsyncInterval(void);
+// Returns the time after the given vsync signal when the application is expected to have produced its new frame
+uint64_t PredictNewFrameTimeAfterVsync(uint64_t vsyncTime);
+// Records when snapshots after the given vsync signal saw the new frame: the last snapshot that did not yet see it (0 if none), and the
+// first snapshot that did.
+void AddVsyncNewFrameSample(uint64_t vsyncTime, uint64_t lastSnapshotWithoutNewFrame, uint64_t snapshotWithNewFrame);
+#else
+// Takes the most recent frame captured by the GPU polling thread for the main thread to own, and hands the previously taken frame back to
+// the polling thread. If no new frame has been captured since, returns the previously taken frame. The frame stays valid and unchanged
+// until the next call, and may be modified. If scanlineHashes is not null, it receives the hashes of the scanlines of the frame, as captured.
+// The scanlines outside of [changedScanlinesStart, changedScanlinesEnd[ are the same as in the previously taken frame, as captured.
+uint16_t *AcquireNewestGpuFrame(uint64_t **scanlineHashes = 0, int *changedScanlinesStart = 0, int *changedScanlinesEnd = 0);
+#endif
 
-extern uint16_t *videoCoreFramebuffer[2];
 extern volatile int numNewGpuFrames;
+extern volatile bool frameSourceEnded; // Set when the frame source has no more frames to give
 extern int displayXOffset;
 extern int displayYOffset;
 extern int gpuFrameWidth;
@@ -35,13 +61,55 @@ struct FrameHistory
 
 extern FrameHistory frameTimeHistory[FRAME_HISTORY_MAX_SIZE];
 
-#define HISTOGRAM_SIZE 240
-extern uint64_t frameArrivalTimes[HISTOGRAM_SIZE];
-extern uint64_t frameArrivalTimesTail;
-extern int histogramSize;
-
-// Returns Nth most recent entry in the frame times histogram, 0 = most recent, (histogramSize-1) = oldest
-#define GET_HISTOGRAM(idx) frameArrivalTimes[(frameArrivalTimesTail - 1 - (idx) + HISTOGRAM_SIZE) % HISTOGRAM_SIZE]
-
 // Source framebuffer captured from DispmanX is (currently) always 16-bits R5G6B5
 #define FRAMEBUFFER_BYTESPERPIXEL 2
+
+#define HASH_PRIME64_1 0x9E3779B185EBCA87ull
+#define HASH_PRIME64_2 0xC2B2AE3D27D4EB4Full
+#define HASH_PRIME64_3 0x165667B19E3779F9ull
+
+static inline uint64_t HashRotateLeft64(uint64_t x, int bits)
+{
+  return (x << bits) | (x >> (64 - bits));
+}
+
+// Mixes one 64-bit word into a hash lane. Invertible with respect to both the lane and the word.
+static inline uint64_t HashRound(uint64_t lane, uint64_t word)
+{
+  return HashRotateLeft64(lane + word * HASH_PRIME64_2, 31) * HASH_PRIME64_1;
+}
+
+// Computes a 64-bit hash of the given scanline, in the manner of xxHash64. Two independent lanes take turns to mix in the scanline 4 pixels
+// at a time with multiply-rotate rounds, and the combined lanes go through a final avalanche, so that every bit of the scanline affects all
+// bits of the hash. Every step is invertible, so a change to the pixels of a single 4-pixel group always changes the hash, and any other
+// change goes undetected with a probability of about 2^-64.
+static inline uint64_t HashScanline(const uint16_t *scanline, int width)
+{
+  uint64_t a = HASH_PRIME64_1 + HASH_PRIME64_2, b = HASH_PRIME64_2;
+  uint64_t word, word2;
+  int x = 0;
+  for(; x + 8 <= width; x += 8)
+  {
+    memcpy(&word, scanline + x, 8); // (memcpy, since the scanline is not necessarily 8 byte aligned)
+    memcpy(&word2, scanline + x + 4, 8);
+    a = HashRound(a, word);
+    b = HashRound(b, word2);
+  }
+  if (x + 4 <= width)
+  {
+    memcpy(&word, scanline + x, 8);
+    a = HashRound(a, word);
+    x += 4;
+  }
+  word = 0;
+  memcpy(&word, scanline + x, (width - x) * 2);
+  b = HashRound(b, word);
+
+  uint64_t h = HashRotateLeft64(a, 1) + HashRotateLeft64(b, 7) + (uint64_t)width;
+  h ^= h >> 33;
+  h *= HASH_PRIME64_2;
+  h ^= h >> 29;
+  h *= HASH_PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
@@ -67,6 +67,10 @@
 #define DISPLAY_NATIVE_WIDTH 240
 #define DISPLAY_NATIVE_HEIGHT 320
 
+// ILI9341 supports hardware vertical scrolling over its 320 scanlines of graphics memory
+#define DISPLAY_SUPPORTS_VERTICAL_SCROLLING
+#define DISPLAY_SCROLL_MEMORY_HEIGHT 320
+
 #ifdef ADAFRUIT_ILI9341_PITFT
 #include "pitft_28r_ili9341.h"
 #elif defined(ADAFRUIT_HX8357D_PITFT)
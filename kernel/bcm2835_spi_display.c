@@ -296,12 +296,12 @@ void PumpSPI(void)
 #ifdef KERNEL_DRIVE_WITH_IRQ
   spi->cs = BCM2835_SPI0_CS_CLEAR | BCM2835_SPI0_CS_TA | BCM2835_SPI0_CS_INTR | BCM2835_SPI0_CS_INTD; // Initialize the Control and Status register to defaults: CS=0 (Chip Select), CPHA=0 (Clock Phase), CPOL=0 (Clock Polarity), CSPOL=0 (Chip Select Polarity), TA=0 (Transfer not active), and reset TX and RX queues.
 #else
-  if (spiTaskMemory->queueTail != spiTaskMemory->queueHead)
+  if (__atomic_load_n(&spiTaskMemory->queueTail, __ATOMIC_ACQUIRE) != __atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_RELAXED))
   {
     BEGIN_SPI_COMMUNICATION();
     {
       int i = 0;
-      while(spiTaskMemory->queueTail != spiTaskMemory->queueHead)
+      while(__atomic_load_n(&spiTaskMemory->queueTail, __ATOMIC_ACQUIRE) != __atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_RELAXED))
       {
         ++i;
         if (i > 500) break;
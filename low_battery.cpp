@@ -71,10 +71,16 @@ void DrawLowBatteryIcon(uint16_t *framebuffer)
   }
 }
 
+bool LowBatteryIconVisible()
+{
+  return lowBattery;
+}
+
 #else 
   
 void InitLowBatterySystem() {}
 void PollLowBattery() {}  
 void DrawLowBatteryIcon(uint16_t *framebuffer) {}
+bool LowBatteryIconVisible() { return false; }
 
 #endif
\ No newline at end of file
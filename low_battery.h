@@ -17,3 +17,6 @@ void PollLowBattery();
 // pollLowBattery found a low battery state.
 void DrawLowBatteryIcon(uint16_t *framebuffer);
 
+// Returns true if DrawLowBatteryIcon() currently draws the icon.
+bool LowBatteryIconVisible();
+
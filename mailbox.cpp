@@ -1,6 +1,7 @@
 #include "config.h"
 #include "mailbox.h"
 #include "util.h"
+#include "simulator.h"
 #include <stdio.h>
 
 #include <stdio.h>
@@ -18,21 +19,27 @@
 int vcio = -1;
 void OpenMailbox()
 {
+#ifndef SIMULATE_PERIPHERALS
   vcio = open("/dev/vcio", 0);
   if (vcio < 0) FATAL_ERROR("Failed to open VideoCore kernel mailbox!");
+#endif
 }
 
 void CloseMailbox()
 {
-  close(vcio);
+  if (vcio >= 0) close(vcio);
   vcio = -1;
 }
 
 // Sends a pointer to the given buffer over to the VideoCore mailbox. See https://github.com/raspberrypi/firmware/wiki/Mailbox-property-interface
 void SendMailbox(void *buffer)
 {
+#ifdef SIMULATE_PERIPHERALS
+  SimulateMailboxMessage((uint32_t*)buffer);
+#else
   int ret = ioctl(vcio, _IOWR(/*MAJOR_NUM=*/100, 0, char *), buffer);
   if (ret < 0) FATAL_ERROR("SendMailbox failed in ioctl!");
+#endif
 }
 
 // Defines the structure of a Mailbox message
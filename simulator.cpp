@@ -0,0 +1,547 @@
+#include "config.h"
+#include "simulator.h"
+
+#ifdef SIMULATE_PERIPHERALS
+
+#include <memory.h> // memset
+#include <stdio.h> // printf, fopen, fwrite
+#include <stdlib.h> // exit, free
+#include <syslog.h> // syslog, LOG_ERR
+#include <unistd.h> // usleep
+#include <pthread.h> // pthread_create, pthread_join
+#include <linux/futex.h> // FUTEX_WAIT, FUTEX_WAKE
+#include <sys/syscall.h> // SYS_futex
+
+#include "spi.h"
+#include "display.h"
+#include "diff.h"
+#include "frame_source.h"
+#include "tick.h"
+#include "util.h"
+#include "mem_alloc.h"
+#include "dma.h"
+
+// Simulated VideoCore mailbox answers for the ARM clock in MHz, and the SoC temperature in degrees Celsius
+#define SIMULATED_ARM_FREQ 1200
+#define SIMULATED_TEMPERATURE 50
+
+// Width and height of the simulated display controller memory, large enough to cover the address range of all supported controllers.
+// The memory is addressed in the same coordinates as the cursor commands that the driver sends.
+#define SIMULATED_GRAM_SIZE 512
+
+// Let the simulated bus run at most this many usecs ahead of real time. Only the time in excess of this is slept off, so that usleep()
+// oversleeping does not show up as idle bus time.
+#define MAX_SIMULATED_BUS_LEAD_USECS 1000
+
+// Time from the end of a DMA transfer until the interrupt has made its way through the kernel to wake up the waiting thread
+#define SIMULATED_INTERRUPT_LATENCY_USECS 20
+
+// Amount of GPU memory that the mailbox hands out to the DMA backend, and the bus address that it starts at
+#define SIMULATED_GPU_MEMORY_SIZE (32*1024*1024)
+#define SIMULATED_GPU_MEMORY_BUS_ADDRESS 0xC0000000u
+
+#ifdef SPI_3WIRE_PROTOCOL
+// The command is sent as part of the expanded task payload
+#define SIMULATED_COMMAND_BYTES 0
+// Without a Data/Control line to toggle, the FIFO only needs to be flushed once between tasks
+#define SIMULATED_TASK_STALL_BYTES (SPAN_COST_TASK_SETUP + SPAN_COST_FIFO_FLUSH)
+#else
+#ifdef DISPLAY_SPI_BUS_IS_16BITS_WIDE
+#define SIMULATED_COMMAND_BYTES 2
+#else
+#define SIMULATED_COMMAND_BYTES 1
+#endif
+// The FIFO is flushed before and after the command byte to toggle the Data/Control line
+#define SIMULATED_TASK_STALL_BYTES (SPAN_COST_TASK_SETUP + 2*SPAN_COST_FIFO_FLUSH)
+#endif
+
+#ifdef DISPLAY_SPI_BUS_IS_16BITS_WIDE
+#define SIMULATED_COORDINATE_BYTES 4
+#elif defined(DISPLAY_SET_CURSOR_IS_8_BIT)
+#define SIMULATED_COORDINATE_BYTES 1
+#else
+#define SIMULATED_COORDINATE_BYTES 2
+#endif
+
+// Size of the memory area that stands in for the peripheral register files, up to and including the SPI0 register file, which is the highest one used
+#define SIMULATED_PERIPHERALS_SIZE (BCM2835_SPI0_BASE + sizeof(SPIRegisterFile))
+
+// Display controller memory, in RGB565 format
+static uint16_t *gram = 0;
+// Write window and write cursor of the display controller, inclusive
+static int windowX = 0, windowEndX = DISPLAY_WIDTH-1, windowY = 0, windowEndY = DISPLAY_HEIGHT-1;
+static int cursorX = 0, cursorY = 0;
+// Vertical scroll area and the GRAM scanline that is shown at the top of it. The scroll area is unused while scrollArea == 0
+static int scrollTop = 0, scrollArea = 0, scrollStart = 0;
+static uint64_t numScrolls = 0; // Number of times the scroll start address was moved
+
+// Time in usecs at which the simulated bus finishes sending the tasks given to it so far
+static double busFreeTime = 0;
+static uint64_t simulationStartTime = 0;
+
+static double busBusyUsecs = 0;
+static uint64_t numTasks = 0, numPixelTasks = 0, numCursorTasks = 0;
+static uint64_t pixelBytes = 0, commandBytes = 0, stallBytes = 0;
+static volatile uint64_t numFrames = 0, numInterlacedFrames = 0;
+static uint64_t numFramesDone = 0, frameLatencyUsecs = 0, maxFrameLatencyUsecs = 0; // Only accessed by the SPI thread, and by the report after it has quit
+static uint64_t numFramesDropped = 0, droppedFrameBytes = 0; // Likewise
+
+static uint64_t numDMATransfers = 0, numDMAInterrupts = 0;
+static uint64_t numDMAChains = 0, numDMAChainCBs = 0;
+
+// GPU memory is handed out linearly, and only returned all at once when the simulator quits
+static uint8_t *gpuMemory = 0;
+static uint32_t gpuMemoryUsed = 0;
+// Total time from the end of DMA transfers until the SPI thread continued, and the part of the wait that the SPI thread spent polling
+static double dmaWakeupDelayUsecs = 0, dmaPollingUsecs = 0;
+
+#ifdef DMA_COMPLETION_UIO_DEVICE
+#define DMA_IDLE 0
+#define DMA_TRANSFER_RUNNING 1
+#define DMA_INTERRUPT_RAISED 2
+#define DMA_QUIT 3
+static volatile int dmaState = DMA_IDLE;
+static double dmaTransferEndTime = 0;
+static pthread_t interruptThread;
+
+// Stands in for the DMA controller and the kernel: raises the completion interrupt of each DMA transfer once it has finished
+static void *interrupt_thread(void*)
+{
+  for(;;)
+  {
+    int state = __atomic_load_n(&dmaState, __ATOMIC_SEQ_CST);
+    if (state == DMA_QUIT) break;
+    if (state != DMA_TRANSFER_RUNNING)
+    {
+      syscall(SYS_futex, &dmaState, FUTEX_WAIT, state, 0, 0, 0);
+      continue;
+    }
+    int64_t usecsUntilInterrupt = (int64_t)(dmaTransferEndTime + SIMULATED_INTERRUPT_LATENCY_USECS) - (int64_t)tick();
+    if (usecsUntilInterrupt > 0) usleep(usecsUntilInterrupt);
+    __atomic_store_n(&dmaState, DMA_INTERRUPT_RAISED, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &dmaState, FUTEX_WAKE, 1, 0, 0, 0);
+  }
+  pthread_exit(0);
+}
+#endif
+
+// Blocks until the DMA transfer that finishes at busFreeTime is done, like SPIDMATransfer() does
+static void WaitForSimulatedDMATransfer(double transferUsecs)
+{
+#ifdef DMA_COMPLETION_UIO_DEVICE
+  if (transferUsecs > DMA_COMPLETION_INTERRUPT_MIN_USECS)
+  {
+    dmaTransferEndTime = busFreeTime;
+    __atomic_store_n(&dmaState, DMA_TRANSFER_RUNNING, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &dmaState, FUTEX_WAKE, 1, 0, 0, 0);
+    while(__atomic_load_n(&dmaState, __ATOMIC_SEQ_CST) == DMA_TRANSFER_RUNNING)
+      syscall(SYS_futex, &dmaState, FUTEX_WAIT, DMA_TRANSFER_RUNNING, 0, 0, 0);
+    __atomic_store_n(&dmaState, DMA_IDLE, __ATOMIC_SEQ_CST);
+    ++numDMAInterrupts;
+  }
+  else
+#endif
+  {
+    // Sleep for the estimated duration of the transfer, and then spin on the status of the DMA channel until it has finished
+    if (transferUsecs > 70) usleep((useconds_t)(transferUsecs - 70));
+    uint64_t pollStart = tick();
+    while(tick() < busFreeTime) /*spin*/;
+    dmaPollingUsecs += tick() - pollStart;
+  }
+  dmaWakeupDelayUsecs += tick() - busFreeTime;
+  ++numDMATransfers;
+}
+
+volatile void *InitSimulatedPeripherals()
+{
+  void *peripherals = Malloc(SIMULATED_PERIPHERALS_SIZE, "simulator.cpp peripheral registers");
+  memset(peripherals, 0, SIMULATED_PERIPHERALS_SIZE);
+  gram = (uint16_t*)Malloc(SIMULATED_GRAM_SIZE*SIMULATED_GRAM_SIZE*sizeof(uint16_t), "simulator.cpp display controller memory");
+  memset(gram, 0, SIMULATED_GRAM_SIZE*SIMULATED_GRAM_SIZE*sizeof(uint16_t));
+
+  simulationStartTime = tick();
+  busFreeTime = simulationStartTime;
+#ifdef DMA_COMPLETION_UIO_DEVICE
+  int rc = pthread_create(&interruptThread, NULL, interrupt_thread, NULL);
+  if (rc != 0) FATAL_ERROR("Failed to create simulated interrupt thread!");
+#endif
+  printf("Simulating peripherals: core_freq=%d MHz, SPI CDIV: %d, SPI bus speed: %.2f MHz\n", SIMULATED_CORE_FREQ, SPI_BUS_CLOCK_DIVISOR, (double)SIMULATED_CORE_FREQ / SPI_BUS_CLOCK_DIVISOR);
+  return peripherals;
+}
+
+void DeinitSimulatedPeripherals(volatile void *peripherals)
+{
+#ifdef DMA_COMPLETION_UIO_DEVICE
+  __atomic_store_n(&dmaState, DMA_QUIT, __ATOMIC_SEQ_CST);
+  syscall(SYS_futex, &dmaState, FUTEX_WAKE, 1, 0, 0, 0);
+  pthread_join(interruptThread, NULL);
+#endif
+  free((void*)peripherals);
+  free(gram);
+  gram = 0;
+  free(gpuMemory);
+  gpuMemory = 0;
+  gpuMemoryUsed = 0;
+}
+
+void *SimulatedGpuMemory(uint32_t busAddress)
+{
+  if (busAddress < SIMULATED_GPU_MEMORY_BUS_ADDRESS || busAddress - SIMULATED_GPU_MEMORY_BUS_ADDRESS >= gpuMemoryUsed)
+  {
+    fprintf(stderr, "Bus address 0x%08X is not in allocated GPU memory\n", busAddress);
+    FATAL_ERROR("SimulatedGpuMemory: access outside of allocated GPU memory!");
+  }
+  return gpuMemory + (busAddress - SIMULATED_GPU_MEMORY_BUS_ADDRESS);
+}
+
+void SimulateMailboxMessage(uint32_t *message)
+{
+  // Messages start with their size, request code, tag id, and value buffer and value sizes, followed by the payload
+  uint32_t *payload = message + 5;
+  switch(message[2])
+  {
+  case 0x00030002/*Get Clock Rate*/:
+  case 0x00030004/*Get Max Clock Rate*/:
+    payload[1] = (payload[0] == 0x3/*ARM*/ ? SIMULATED_ARM_FREQ : SIMULATED_CORE_FREQ) * 1000000u;
+    break;
+  case 0x00030006/*Get Temperature*/:
+    payload[1] = SIMULATED_TEMPERATURE * 1000;
+    break;
+  case 0x0003000c/*Allocate Memory*/:
+  {
+    if (!gpuMemory) gpuMemory = (uint8_t*)Malloc(SIMULATED_GPU_MEMORY_SIZE, "simulator.cpp GPU memory");
+    uint32_t start = ALIGN_UP(gpuMemoryUsed, MAX(payload[1], 1u));
+    if (start + payload[0] > SIMULATED_GPU_MEMORY_SIZE) FATAL_ERROR("SimulateMailboxMessage: out of simulated GPU memory!");
+    gpuMemoryUsed = start + payload[0];
+    payload[0] = SIMULATED_GPU_MEMORY_BUS_ADDRESS + start; // The handle of the allocation is the same as its bus address
+    break;
+  }
+  case 0x0003000d/*Lock Memory*/:
+    break; // Returns the handle, which is the bus address
+  case 0x0003000e/*Unlock Memory*/:
+  case 0x0003000f/*Release Memory*/:
+    payload[0] = 0;
+    break;
+  default:
+    fprintf(stderr, "Mailbox message 0x%08X is not simulated\n", message[2]);
+    FATAL_ERROR("SimulateMailboxMessage: unsupported mailbox message!");
+  }
+  message[1] = 0x80000000u; // Response: request successful
+}
+
+// Returns the i'th cursor coordinate in the data of a cursor command
+static int Coordinate(const uint8_t *data, int i)
+{
+#ifdef DISPLAY_SPI_BUS_IS_16BITS_WIDE
+  return (data[4*i+1] << 8) | data[4*i+3];
+#elif defined(DISPLAY_SET_CURSOR_IS_8_BIT)
+  return data[i];
+#else
+  return (data[2*i] << 8) | data[2*i+1];
+#endif
+}
+
+static void WriteGramPixels(const uint8_t *data, uint32_t bytes)
+{
+  for(; bytes >= SPI_BYTESPERPIXEL; bytes -= SPI_BYTESPERPIXEL, data += SPI_BYTESPERPIXEL)
+  {
+#ifdef DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2
+    uint16_t pixel = ((data[0] & 0xF8) << 8) | ((data[1] & 0xFC) << 3) | (data[2] >> 3);
+#else
+    uint16_t pixel = (data[0] << 8) | data[1];
+#endif
+    if (cursorX < SIMULATED_GRAM_SIZE && cursorY < SIMULATED_GRAM_SIZE)
+      gram[cursorY*SIMULATED_GRAM_SIZE + cursorX] = pixel;
+
+    // Advance the cursor, wrapping around inside the write window
+    if (++cursorX > windowEndX)
+    {
+      cursorX = windowX;
+      if (++cursorY > windowEndY) cursorY = windowY;
+    }
+  }
+}
+
+#ifdef SIMULATOR_DISPLAY_DUMP
+// Returns the GRAM scanline that is shown on scanline y of the panel
+static int GramScanline(int y)
+{
+  if (scrollArea <= 0 || y < scrollTop || y >= scrollTop + scrollArea) return y;
+  int offset = (y - scrollTop + scrollStart - scrollTop) % scrollArea;
+  return scrollTop + (offset < 0 ? offset + scrollArea : offset);
+}
+#endif
+
+// Applies the given command to the simulated display controller, and bills the time that it takes on the bus, wireBytes being the number
+// of bytes that the command and its data take to send. Returns the duration of the transfer in usecs.
+static double SimulateSPICommand(uint32_t cmd, const uint8_t *data, uint32_t dataSize, uint32_t wireBytes)
+{
+  if (cmd == DISPLAY_WRITE_PIXELS)
+  {
+#ifndef DISPLAY_WRITE_PIXELS_CMD_DOES_NOT_RESET_WRITE_CURSOR
+    cursorX = windowX;
+    cursorY = windowY;
+#endif
+    WriteGramPixels(data, dataSize);
+    pixelBytes += dataSize;
+    ++numPixelTasks;
+  }
+  else if (cmd == DISPLAY_SET_CURSOR_X || cmd == DISPLAY_SET_CURSOR_Y)
+  {
+    // The start coordinate can be sent alone to move the cursor, leaving the end of the window as it was
+    bool x = (cmd == DISPLAY_SET_CURSOR_X);
+    int numCoordinates = dataSize / SIMULATED_COORDINATE_BYTES;
+    if (numCoordinates >= 1) *(x ? &windowX : &windowY) = Coordinate(data, 0);
+    if (numCoordinates >= 2) *(x ? &windowEndX : &windowEndY) = Coordinate(data, 1);
+#ifdef DISPLAY_WRITE_PIXELS_CMD_DOES_NOT_RESET_WRITE_CURSOR
+    if (x) cursorX = windowX;
+    else cursorY = windowY;
+#endif
+    ++numCursorTasks;
+  }
+#ifdef DISPLAY_SUPPORTS_VERTICAL_SCROLLING
+  else if (cmd == 0x33/*VSCRDEF: Vertical Scrolling Definition*/ && dataSize >= 4)
+  {
+    scrollTop = (data[0] << 8) | data[1];
+    scrollArea = (data[2] << 8) | data[3];
+    scrollStart = scrollTop;
+  }
+  else if (cmd == 0x37/*VSCRSADD: Vertical Scrolling Start Address*/ && dataSize >= 2)
+  {
+    int newScrollStart = (data[0] << 8) | data[1];
+    if (newScrollStart != scrollStart) ++numScrolls;
+    scrollStart = newScrollStart;
+  }
+#endif
+
+  // Bill the bus time of the task. Pixel data counts as payload, everything else as overhead of the command stream
+  const uint32_t taskPixelBytes = (cmd == DISPLAY_WRITE_PIXELS) ? dataSize : 0;
+  commandBytes += wireBytes - MIN(wireBytes, taskPixelBytes);
+  stallBytes += SIMULATED_TASK_STALL_BYTES;
+  ++numTasks;
+
+  const double usecs = (wireBytes + SIMULATED_TASK_STALL_BYTES) * 8.0/*bits/byte*/ * SPI_BUS_CLOCK_DIVISOR / SIMULATED_CORE_FREQ;
+  busFreeTime = MAX(busFreeTime, (double)tick()) + usecs;
+  busBusyUsecs += usecs;
+  return usecs;
+}
+
+void SimulateSPITask(SPITask *task)
+{
+  // The data of the task as the driver created it, before any expansion for 3-wire transfer
+#ifdef SPI_32BIT_COMMANDS
+  // Pixel tasks are expanded to 32-bit words already at capture time, so decode the data bytes back from the expanded task: each word
+  // after the command word carries two data bytes in its high half.
+  static uint8_t decodedData[SPI_QUEUE_SIZE/2];
+  const uint8_t *expanded = task->PayloadStart() + 4;
+  const uint32_t dataSize = (task->PayloadSize() - 4) >> 1;
+  for(uint32_t i = 0; i < dataSize; ++i) decodedData[i] = expanded[((i >> 1) << 2) + 2 + (i & 1)];
+  const uint8_t *data = decodedData;
+#elif defined(SPI_3WIRE_PROTOCOL)
+  const uint8_t *data = task->data;
+  const uint32_t dataSize = task->size - task->sizeExpandedTaskWithPadding;
+#else
+  const uint8_t *data = task->PayloadStart();
+  const uint32_t dataSize = task->PayloadSize();
+#endif
+
+  const double usecs = SimulateSPICommand(task->cmd, data, dataSize, SIMULATED_COMMAND_BYTES + task->PayloadSize());
+  const uint64_t now = tick();
+  if (task->PayloadSize() > DMA_IS_FASTER_THAN_POLLED_SPI)
+    WaitForSimulatedDMATransfer(usecs);
+  else if (busFreeTime > now + MAX_SIMULATED_BUS_LEAD_USECS)
+    usleep((useconds_t)(busFreeTime - now - MAX_SIMULATED_BUS_LEAD_USECS/2));
+}
+
+#ifdef SEND_FRAMES_AS_ONE_DMA_CHAIN
+
+// Duration of the DMA chain that was started last and has not yet been waited for, or zero
+static double pendingDMAChainUsecs = 0;
+
+// The command and data bytes of the task that the DMA chain is currently sending
+static uint8_t chainCommand = 0;
+static bool chainHasCommand = false;
+static uint8_t *chainTaskData = 0;
+static uint32_t chainTaskDataSize = 0;
+
+static double FinishChainCommand()
+{
+  if (!chainHasCommand) return 0;
+  chainHasCommand = false;
+  return SimulateSPICommand(chainCommand, chainTaskData, chainTaskDataSize, SIMULATED_COMMAND_BYTES + chainTaskDataSize);
+}
+
+// Runs the control blocks that the DMA TX channel was started with, and returns the number of bytes that they clocked out on the bus
+static uint32_t SimulateDMAChainTx(uint32_t cbAddr, bool *transferActive, bool dataControl, double *usecs)
+{
+  uint32_t bytesSent = 0, transferLength = 0;
+  for(; cbAddr; cbAddr = ((volatile DMAControlBlock*)SimulatedGpuMemory(cbAddr))->next)
+  {
+    volatile DMAControlBlock *cb = (volatile DMAControlBlock*)SimulatedGpuMemory(cbAddr);
+    ++numDMAChainCBs;
+    if (!(cb->ti & BCM2835_DMA_TI_DEST_DREQ) || cb->dst != DMA_SPI_FIFO_PHYS_ADDRESS) FATAL_ERROR("SimulateDMAChain: DMA TX control block does not write to the SPI FIFO!");
+    const uint8_t *src = (const uint8_t*)SimulatedGpuMemory(cb->src);
+    uint32_t len = cb->len, rows = 1;
+    int32_t srcStride = 0;
+    if ((cb->ti & BCM2835_DMA_TI_TDMODE))
+    {
+      // In 2D mode, the DMA engine does YLENGTH+1 transfers of XLENGTH bytes, and adds the signed 16-bit source stride after each one
+      rows = (len >> 16) + 1;
+      len &= 0xFFFF;
+      srcStride = (int16_t)(cb->stride & 0xFFFF);
+      if (!*transferActive) FATAL_ERROR("SimulateDMAChain: 2D mode DMA TX control block does not start with an SPI transfer header!");
+    }
+    if (!*transferActive)
+    {
+      // While the transfer is not active, the first four bytes written to the FIFO set up DLEN and CS
+      if (len < 4) FATAL_ERROR("SimulateDMAChain: SPI transfer header is cut short!");
+      uint32_t header = *(const uint32_t*)src;
+      if (!(header & BCM2835_SPI0_CS_TA)) FATAL_ERROR("SimulateDMAChain: SPI transfer header does not start the transfer!");
+      transferLength = header >> 16;
+      *transferActive = true;
+      src += 4;
+      len -= 4;
+    }
+    for(uint32_t row = 0; row < rows; ++row, src += len + srcStride)
+    {
+      for(uint32_t i = 0; i < len; ++i)
+      {
+        if (dataControl)
+        {
+          if (chainTaskDataSize >= SHARED_MEMORY_SIZE) FATAL_ERROR("SimulateDMAChain: task data does not fit in the task buffer!");
+          chainTaskData[chainTaskDataSize++] = src[i];
+        }
+        else
+        {
+          // With a 16-bit command register, the command is the last byte of the two
+          if (row == 0 && i == 0) *usecs += FinishChainCommand();
+          chainCommand = src[i];
+          chainHasCommand = true;
+          chainTaskDataSize = 0;
+        }
+      }
+      bytesSent += len;
+    }
+  }
+  if (bytesSent != transferLength) FATAL_ERROR("SimulateDMAChain: SPI transfer DLEN does not match the number of bytes sent!");
+  return bytesSent;
+}
+
+void SimulateDMAChain()
+{
+  if (!chainTaskData) chainTaskData = (uint8_t*)Malloc(SHARED_MEMORY_SIZE, "simulator.cpp DMA chain task data");
+  const uint32_t dmaTxRegisters = DMA_DMA0_CB_PHYS_ADDRESS + dmaTxChannel*0x100;
+  bool transferActive = false, dataControl = true;
+  uint32_t txCbAddr = 0, bytesNotReceived = 0;
+  double usecs = 0;
+
+  // Walk the control blocks of the RX channel, interpreting the register writes that they do
+  for(uint32_t cbAddr = dmaRx->cbAddr; cbAddr; cbAddr = ((volatile DMAControlBlock*)SimulatedGpuMemory(cbAddr))->next)
+  {
+    volatile DMAControlBlock *cb = (volatile DMAControlBlock*)SimulatedGpuMemory(cbAddr);
+    ++numDMAChainCBs;
+    if ((cb->ti & BCM2835_DMA_TI_SRC_DREQ))
+    {
+      // Reading the bytes back from the SPI RX FIFO waits until the transfer has been sent
+      if (cb->src != DMA_SPI_FIFO_PHYS_ADDRESS || cb->len != bytesNotReceived) FATAL_ERROR("SimulateDMAChain: DMA RX control block does not receive the bytes that were sent!");
+      bytesNotReceived = 0;
+      continue;
+    }
+    if (cb->len != 4) FATAL_ERROR("SimulateDMAChain: DMA RX channel control block is not a register write!");
+    if (bytesNotReceived) FATAL_ERROR("SimulateDMAChain: register write before the SPI transfer has finished!");
+    const uint32_t value = *(const uint32_t*)SimulatedGpuMemory(cb->src);
+    if (cb->dst == DMA_GPIO_SET_PHYS_ADDRESS || cb->dst == DMA_GPIO_CLEAR_PHYS_ADDRESS)
+    {
+#ifdef GPIO_TFT_DATA_CONTROL
+      if ((value & (1 << GPIO_TFT_DATA_CONTROL))) dataControl = (cb->dst == DMA_GPIO_SET_PHYS_ADDRESS);
+#endif
+    }
+    else if (cb->dst == DMA_SPI_CS_PHYS_ADDRESS)
+      transferActive = (value & BCM2835_SPI0_CS_TA) != 0;
+    else if (cb->dst == dmaTxRegisters + 4)
+      txCbAddr = value;
+    else if (cb->dst == dmaTxRegisters && (value & BCM2835_DMA_CS_ACTIVE))
+      bytesNotReceived = SimulateDMAChainTx(txCbAddr, &transferActive, dataControl, &usecs);
+    else
+    {
+      fprintf(stderr, "DMA control block writes 0x%08X to bus address 0x%08X\n", value, cb->dst);
+      FATAL_ERROR("SimulateDMAChain: unsupported register write in a DMA chain!");
+    }
+  }
+  if (bytesNotReceived) FATAL_ERROR("SimulateDMAChain: DMA chain ended before the SPI transfer had finished!");
+  usecs += FinishChainCommand();
+
+  // The whole chain has now been applied to the display, but the driver still needs to wait for the bus time that it takes
+  dmaRx->cs = 0;
+  dmaTx->cs = 0;
+  pendingDMAChainUsecs = usecs;
+  ++numDMAChains;
+}
+
+void WaitForSimulatedDMAChain()
+{
+  if (pendingDMAChainUsecs <= 0) return;
+  WaitForSimulatedDMATransfer(pendingDMAChainUsecs);
+  pendingDMAChainUsecs = 0;
+}
+
+#endif
+
+void SimulatedFrameSubmitted(bool interlaced)
+{
+  __atomic_fetch_add(&numFrames, 1, __ATOMIC_RELAXED);
+  if (interlaced) __atomic_fetch_add(&numInterlacedFrames, 1, __ATOMIC_RELAXED);
+}
+
+void SimulatedFrameDone(uint64_t latencyUsecs)
+{
+  ++numFramesDone;
+  frameLatencyUsecs += latencyUsecs;
+  maxFrameLatencyUsecs = MAX(maxFrameLatencyUsecs, latencyUsecs);
+}
+
+void SimulatedFrameDropped(uint32_t bytesSkipped)
+{
+  ++numFramesDropped;
+  droppedFrameBytes += bytesSkipped;
+}
+
+void PrintSimulatorReport()
+{
+  const double seconds = (MAX(busFreeTime, (double)tick()) - simulationStartTime) / 1000000.0;
+  const uint64_t totalBytes = pixelBytes + commandBytes + stallBytes;
+  printf("Simulated %.3f seconds at SPI bus speed %.2f MHz\n", seconds, (double)SIMULATED_CORE_FREQ / SPI_BUS_CLOCK_DIVISOR);
+  printf("Frames submitted: %llu (%llu interlaced), %.2f fps\n", (unsigned long long)numFrames, (unsigned long long)numInterlacedFrames, numFrames / seconds);
+  if (numFramesDone > 0)
+    printf("Frame latency from capture until sent: %.2f msecs on average, %.2f msecs at most, over %llu frames\n",
+      frameLatencyUsecs / 1000.0 / numFramesDone, maxFrameLatencyUsecs / 1000.0, (unsigned long long)numFramesDone);
+  if (numFramesDropped > 0)
+    printf("Stale frames dropped: %llu, skipping %llu bytes of queued SPI tasks\n", (unsigned long long)numFramesDropped, (unsigned long long)droppedFrameBytes);
+  printf("SPI tasks: %llu, of which pixel writes: %llu, cursor moves: %llu\n", (unsigned long long)numTasks, (unsigned long long)numPixelTasks, (unsigned long long)numCursorTasks);
+  if (numScrolls > 0)
+    printf("Hardware scrolls: %llu\n", (unsigned long long)numScrolls);
+  printf("Bus bytes: %llu pixel data, %llu commands and coordinates, %llu FIFO stalls. Command overhead: %.2f%%\n",
+    (unsigned long long)pixelBytes, (unsigned long long)commandBytes, (unsigned long long)stallBytes, totalBytes > 0 ? 100.0 * (commandBytes + stallBytes) / totalBytes : 0.0);
+  printf("Bus utilization: %.2f%%\n", seconds > 0 ? 100.0 * busBusyUsecs / (seconds * 1000000.0) : 0.0);
+  printf("DMA transfers: %llu, of which waited for with completion interrupts: %llu. SPI thread resumed on average %.1f usecs after a transfer finished, and spent %.1f msecs polling\n",
+    (unsigned long long)numDMATransfers, (unsigned long long)numDMAInterrupts, numDMATransfers > 0 ? dmaWakeupDelayUsecs / numDMATransfers : 0.0, dmaPollingUsecs / 1000.0);
+  if (numDMAChains > 0)
+    printf("DMA chains: %llu, %.1f control blocks per chain\n", (unsigned long long)numDMAChains, (double)numDMAChainCBs / numDMAChains);
+
+#ifdef SIMULATOR_DISPLAY_DUMP
+  // Write what the panel shows, in the frame replay stream format so that the same tools can read both
+  FILE *dump = fopen(SIMULATOR_DISPLAY_DUMP, "wb");
+  if (!dump) FATAL_ERROR("Failed to open simulator display dump file " SIMULATOR_DISPLAY_DUMP "!");
+  uint32_t size[2] = { DISPLAY_WIDTH, DISPLAY_HEIGHT };
+  uint64_t time = (uint64_t)(seconds * 1000000.0);
+  fwrite(FRAME_SOURCE_REPLAY_MAGIC, 1, 4, dump);
+  fwrite(size, sizeof(size), 1, dump);
+  fwrite(&time, sizeof(time), 1, dump);
+  for(int y = 0; y < DISPLAY_HEIGHT; ++y)
+    fwrite(gram + MIN(GramScanline(y), SIMULATED_GRAM_SIZE-1)*SIMULATED_GRAM_SIZE, sizeof(uint16_t), DISPLAY_WIDTH, dump);
+  fclose(dump);
+  printf("Wrote contents of the simulated display to " SIMULATOR_DISPLAY_DUMP "\n");
+#endif
+}
+
+#endif
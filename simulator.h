@@ -0,0 +1,61 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+
+#ifdef SIMULATE_PERIPHERALS
+
+// The simulator stands in for the BCM2835 SPI, GPIO, system timer and mailbox peripherals, so that fbcp-ili9341 can be run on a host
+// computer. The SPI bus is modelled one SPI task at a time: each task takes the time that it would take to send over a bus running at
+// SIMULATED_CORE_FREQ/SPI_BUS_CLOCK_DIVISOR, and its command is applied to a model of the memory (GRAM) of the display controller.
+// Tasks that the Pi would send with DMA (more than DMA_IS_FASTER_THAN_POLLED_SPI bytes) block until the transfer has finished, either
+// the way SPIDMATransfer() sleeps and polls the DMA channel, or if DMA_COMPLETION_UIO_DEVICE is defined and the transfer
+// is longer than DMA_COMPLETION_INTERRUPT_MIN_USECS, by sleeping until a simulated completion interrupt wakes the thread up.
+// With SEND_FRAMES_AS_ONE_DMA_CHAIN, the real DMA backend runs against simulated GPU memory, and the simulator walks the control
+// block chains that it builds.
+
+// Simulated VideoCore core clock in MHz, i.e. the core_freq=xxx setting in /boot/config.txt. Usually set with -DSIMULATED_CORE_FREQ=<MHz> to CMake.
+#ifndef SIMULATED_CORE_FREQ
+#define SIMULATED_CORE_FREQ 400
+#endif
+
+typedef struct SPITask SPITask;
+
+// Returns a block of plain memory for the BCM2835 peripheral register files to point to, so that register writes have no effect.
+volatile void *InitSimulatedPeripherals(void);
+void DeinitSimulatedPeripherals(volatile void *peripherals);
+
+// Answers the given VideoCore mailbox property message in place. GPU memory allocations are served from a block of host memory.
+void SimulateMailboxMessage(uint32_t *message);
+
+// Returns the host pointer to the given bus address of simulated GPU memory.
+void *SimulatedGpuMemory(uint32_t busAddress);
+
+// Sends the given task over the simulated SPI bus. Blocks for roughly the time that the transfer would take on real hardware, and for
+// tasks sent with DMA, until the transfer has finished.
+void SimulateSPITask(SPITask *task);
+
+#ifdef SEND_FRAMES_AS_ONE_DMA_CHAIN
+// Walks the chain of DMA control blocks that the DMA RX channel was started with, checking that it is a valid SPI transfer sequence, and
+// applies the commands that it sends to the simulated display. Returns right away, like the DMA controller would leave the CPU free.
+void SimulateDMAChain(void);
+
+// Blocks until the bus has finished sending the DMA chain that was started last, if it has not been waited for yet.
+void WaitForSimulatedDMAChain(void);
+#endif
+
+// Counts a frame submitted by the main loop towards the frame rate in the simulator report.
+void SimulatedFrameSubmitted(bool interlaced);
+
+// Records the time from the capture of a frame until the SPI thread had sent all of its tasks, for the simulator report.
+void SimulatedFrameDone(uint64_t latencyUsecs);
+
+// Counts a frame that the SPI thread skipped because it was dropped (DROP_STALE_FRAMES), and the bytes of SPI tasks that were skipped with it.
+void SimulatedFrameDropped(uint32_t bytesSkipped);
+
+// Prints statistics of the simulated bus traffic so far, and writes the current contents of the simulated display to the file
+// SIMULATOR_DISPLAY_DUMP, if defined.
+void PrintSimulatorReport(void);
+
+#endif
@@ -1,11 +1,15 @@
 #ifndef KERNEL_MODULE
 #include <stdio.h> // printf, stderr
+#include <stdlib.h> // free, exit
+#include <memory.h> // memset, memcpy
 #include <syslog.h> // syslog
 #include <fcntl.h> // open, O_RDWR, O_SYNC
 #include <sys/mman.h> // mmap, munmap
 #include <pthread.h> // pthread_create
+#ifndef SIMULATE_PERIPHERALS
 #include <bcm_host.h> // bcm_host_get_peripheral_address, bcm_host_get_peripheral_size, bcm_host_get_sdram_address
 #endif
+#endif
 
 #include "config.h"
 #include "spi.h"
@@ -13,6 +17,7 @@
 #include "dma.h"
 #include "mailbox.h"
 #include "mem_alloc.h"
+#include "simulator.h"
 
 // Uncomment this to print out all bytes sent to the SPI bus
 // #define DEBUG_SPI_BUS_WRITES
@@ -107,6 +112,12 @@ bool previousTaskWasSPI = true;
 
 #ifdef SPI_3WIRE_PROTOCOL
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+// If building with NEON available, 8-bit to 9-bit and 16-bit to 32-bit task expansion process 16 bytes at a time with SIMD
+#define SPI_USE_NEON
+#endif
+
 uint32_t NumBytesNeededFor32BitSPITask(uint32_t byteSizeFor8BitTask)
 {
   return byteSizeFor8BitTask * 2 + 4; // 16bit -> 32bit expansion, plus 4 bytes for command word
@@ -125,6 +136,54 @@ uint32_t NumBytesNeededFor9BitSPITask(uint32_t byteSizeFor8BitTask)
 
 // N.B. BCM2835 hardware always clocks bytes out most significant bit (MSB) first, so when interleaving, the command bit needs to start out in the
 // highest byte of the outgoing buffer.
+// Every 8 bytes of input expand to a group of 8*9 bits = 9 bytes of output, where byte k of the group holds the data bit of symbol k, the low
+// 8-k bits of input byte k-1 and the high k bits of input byte k. The command byte together with the first 7 data bytes forms the first group.
+static inline void Interleave8BytesTo9Bit(const uint8_t *s, uint8_t *d)
+{
+  d[0] = 0x80 |               (s[0] >> 1);
+  d[1] = 0x40 | (s[0] << 7) | (s[1] >> 2);
+  d[2] = 0x20 | (s[1] << 6) | (s[2] >> 3);
+  d[3] = 0x10 | (s[2] << 5) | (s[3] >> 4);
+  d[4] = 0x08 | (s[3] << 4) | (s[4] >> 5);
+  d[5] = 0x04 | (s[4] << 3) | (s[5] >> 6);
+  d[6] = 0x02 | (s[5] << 2) | (s[6] >> 7);
+  d[7] = 0x01 | (s[6] << 1);
+  d[8] = (s[7]     );
+}
+
+// Expands the last group of a task, which has 0 < n <= 8 symbols, and writes the n+1 bytes that it affects. Indexed by n, masks away the data
+// bit of the first absent symbol from the last written byte. The rest of the group is left to the zeroes that the caller pre-cleared.
+static const uint8_t partialGroupLastByteMask[9] = { 0x00, 0x80, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC, 0xFE, 0xFF };
+
+static inline void InterleavePartialGroupTo9Bit(const uint8_t *s, int n, uint8_t *d)
+{
+  uint8_t src[8] = {};
+  uint8_t group[9];
+  memcpy(src, s, n);
+  Interleave8BytesTo9Bit(src, group);
+  group[n] &= partialGroupLastByteMask[n];
+  memcpy(d, group, n+1);
+}
+
+#ifdef SPI_USE_NEON
+// Expands two groups of 8 bytes at once. The shifts of each output byte only depend on its position in the group, so they can be done
+// with per-lane variable shifts, with the previous input byte brought to each lane by shifting the 64-bit group up by one byte.
+static inline void Interleave16BytesTo9BitNEON(const uint8_t *s, uint8_t *d)
+{
+  static const uint8_t dataBits[16] = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01, 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
+  static const int8_t shiftRight[16] = { -1, -2, -3, -4, -5, -6, -7, -8, -1, -2, -3, -4, -5, -6, -7, -8 };
+  static const int8_t shiftPrevLeft[16] = { 8, 7, 6, 5, 4, 3, 2, 1, 8, 7, 6, 5, 4, 3, 2, 1 };
+  uint8x16_t src = vld1q_u8(s);
+  uint8x16_t prev = vreinterpretq_u8_u64(vshlq_n_u64(vreinterpretq_u64_u8(src), 8)); // Byte k of each group gets input byte k-1 (and 0 for k=0)
+  uint8x16_t out = vorrq_u8(vld1q_u8(dataBits), vorrq_u8(vshlq_u8(src, vld1q_s8(shiftRight)), vshlq_u8(prev, vld1q_s8(shiftPrevLeft))));
+  // The ninth byte of each group is the last input byte of the group as is
+  vst1_u8(d, vget_low_u8(out));
+  vst1q_lane_u8(d+8, src, 7);
+  vst1_u8(d+9, vget_high_u8(out));
+  vst1q_lane_u8(d+17, src, 15);
+}
+#endif
+
 void Interleave8BitSPITaskTo9Bit(SPITask *task)
 {
   const uint32_t size8BitTask = task->size - task->sizeExpandedTaskWithPadding;
@@ -135,79 +194,35 @@ void Interleave8BitSPITaskTo9Bit(SPITask *task)
   // Pre-clear the 9*8=72 bit tail end of the memory to all zeroes to avoid having to pad source data to multiples of 9. (plus padding bytes, just to be safe)
   memset(dst + task->sizeExpandedTaskWithPadding - 9 - SPI_9BIT_TASK_PADDING_BYTES, 0, 9 + SPI_9BIT_TASK_PADDING_BYTES);
 
-  // Fill first command byte xxxxxxxx -> 0xxxxxxx x: (low 0 bit to indicate a command byte)
-  dst[0] = task->cmd >> 1;
-  dst[1] = task->cmd << 7;
-  int dstByte = 1;
-  int dstBitsUsed = 1;
-
-  int src = 0;
-
-  // Command bit above produced one byte. If there are at least 7 bytes in the data set, we can complete a set of 8 transferred bytes. Fast track
-  // that:
-  if (size8BitTask >= 7)
+  // First group: the command byte and up to 7 data bytes. Fill the command byte xxxxxxxx -> 0xxxxxxx x: (low 0 bit to indicate a command byte)
+  uint8_t firstGroup[8];
+  const int firstGroupDataBytes = MIN(size8BitTask, 7);
+  firstGroup[0] = task->cmd;
+  memcpy(firstGroup + 1, task->data, firstGroupDataBytes);
+  InterleavePartialGroupTo9Bit(firstGroup, firstGroupDataBytes + 1, dst);
+  dst[0] &= 0x7F;
+
+  // After the first group, each group is 8 data bytes, which can be expanded in bulk
+  const uint8_t *data = task->data;
+  uint8_t *d = dst + 9;
+  uint32_t src = 7;
+#ifdef SPI_USE_NEON
+  for(; src + 64 <= size8BitTask; src += 64, d += 72)
   {
-    dst[1] |= 0x40 |                        (task->data[0] >> 2);
-    dst[2]  = 0x20 | (task->data[0] << 6) | (task->data[1] >> 3);
-    dst[3]  = 0x10 | (task->data[1] << 5) | (task->data[2] >> 4);
-    dst[4]  = 0x08 | (task->data[2] << 4) | (task->data[3] >> 5);
-    dst[5]  = 0x04 | (task->data[3] << 3) | (task->data[4] >> 6);
-    dst[6]  = 0x02 | (task->data[4] << 2) | (task->data[5] >> 7);
-    dst[7]  = 0x01 | (task->data[5] << 1);
-    dst[8]  =        (task->data[6]     );
-    dstByte = 9;
-    dstBitsUsed = 0;
-    src = 7;
-
-    // More fast tracking: As long as we have multiples of 8 bytes left, fast fill them in
-    while(src <= size8BitTask - 8)
-    {
-      uint8_t *d = dst + dstByte;
-      dstByte += 9;
-      const uint8_t *s = task->data + src;
-      src += 8;
-
-      d[0] = 0x80 |               (s[0] >> 1);
-      d[1] = 0x40 | (s[0] << 7) | (s[1] >> 2);
-      d[2] = 0x20 | (s[1] << 6) | (s[2] >> 3);
-      d[3] = 0x10 | (s[2] << 5) | (s[3] >> 4);
-      d[4] = 0x08 | (s[3] << 4) | (s[4] >> 5);
-      d[5] = 0x04 | (s[4] << 3) | (s[5] >> 6);
-      d[6] = 0x02 | (s[5] << 2) | (s[6] >> 7);
-      d[7] = 0x01 | (s[6] << 1);
-      d[8] = (s[7]     );
-    }
-
-    // Pre-clear the next byte to be written - the slow loop below assumes it is continuing a middle of byte sequence
-    // N.B. This write could happen to memory that is not part of the task, so memory allocation of the 9-bit task needs to allocate one byte of padding
-    dst[dstByte] = 0;
+    Interleave16BytesTo9BitNEON(data + src,      d);
+    Interleave16BytesTo9BitNEON(data + src + 16, d + 18);
+    Interleave16BytesTo9BitNEON(data + src + 32, d + 36);
+    Interleave16BytesTo9BitNEON(data + src + 48, d + 54);
   }
+  for(; src + 16 <= size8BitTask; src += 16, d += 18)
+    Interleave16BytesTo9BitNEON(data + src, d);
+#endif
+  for(; src + 8 <= size8BitTask; src += 8, d += 9)
+    Interleave8BytesTo9Bit(data + src, d);
 
-  // Fill tail data bytes, slow path
-  while(src < size8BitTask)
-  {
-    uint8_t data = task->data[src++];
-
-    // High 1 bit to indicate a data byte
-    dst[dstByte] |= 1 << (7 - dstBitsUsed);
-    ++dstBitsUsed;
-    if (dstBitsUsed == 8) // Written data bit completes a full byte?
-    {
-      ++dstByte; // Advance to next byte
-      dstBitsUsed = 0;
-      // Now we are aligned, so can write the data byte directly
-      dst[dstByte++] = data;
-      dst[dstByte] = 0; // Clear old contents of the next byte to write
-    }
-    else
-    {
-      // 8 data bits
-      dst[dstByte++] |= data >> dstBitsUsed;
-      // This is the first write to the next byte, that should occur without ORring to clear old data in memory
-      // N.B. This write could happen to memory that is not part of the task, so memory allocation of the 9-bit task needs to allocate one byte of padding
-      dst[dstByte] = data << (8 - dstBitsUsed);
-    }
-  }
+  // Fill the remaining tail data bytes, if any
+  if (src < size8BitTask)
+    InterleavePartialGroupTo9Bit(data + src, size8BitTask - src, d);
 
 #if 0 // Enable to debug correctness:
 
@@ -234,6 +249,35 @@ void Interleave8BitSPITaskTo9Bit(SPITask *task)
 
 }
 
+#ifdef SPI_32BIT_COMMANDS
+
+// Each 16-bit data word goes out in the high half of a 32-bit word, prefixed with the 0x0015 data framing in the low half
+#define SPI_32BIT_DATA_PREFIX 0x1500
+
+// Widens 16-bit words to 32-bit data words, optionally byte swapping each word first, and optionally copying the source words to copy on the
+// same pass. Both are known at compile time at each call site, so the branches are hoisted away.
+static inline void Expand16BitWordsTo32Bit(const uint16_t *src, uint32_t *dst, uint32_t numWords, bool byteSwap, uint16_t *copy)
+{
+  uint32_t i = 0;
+#ifdef SPI_USE_NEON
+  // Store the prefix and the data as interleaved halfword pairs, which forms eight 32-bit words per store
+  uint16x8x2_t words;
+  words.val[0] = vdupq_n_u16(SPI_32BIT_DATA_PREFIX);
+  for(; i + 8 <= numWords; i += 8)
+  {
+    words.val[1] = vld1q_u16(src + i);
+    if (copy) vst1q_u16(copy + i, words.val[1]);
+    if (byteSwap) words.val[1] = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(words.val[1])));
+    vst2q_u16((uint16_t*)(dst + i), words);
+  }
+#endif
+  for(; i < numWords; ++i)
+  {
+    if (copy) copy[i] = src[i];
+    dst[i] = SPI_32BIT_DATA_PREFIX | ((uint32_t)(byteSwap ? __builtin_bswap16(src[i]) : src[i]) << 16);
+  }
+}
+
 void Interleave16BitSPITaskTo32Bit(SPITask *task)
 {
   const uint32_t size8BitTask = task->size - task->sizeExpandedTaskWithPadding;
@@ -242,12 +286,16 @@ void Interleave16BitSPITaskTo32Bit(SPITask *task)
   uint32_t *dst = (uint32_t *)(task->data + size8BitTask);
   *dst++ = task->cmd;
 
-  const uint32_t taskSizeU16 = size8BitTask >> 1;
-  uint16_t *src = (uint16_t*)task->data;
-  for(uint32_t i = 0; i < taskSizeU16; ++i)
-    dst[i] = 0x1500 | (src[i] << 16);
+  Expand16BitWordsTo32Bit((const uint16_t*)task->data, dst, size8BitTask >> 1, false, 0);
+}
+
+void ExpandPixelsTo32BitSPITask(const uint16_t *pixels, uint16_t *prevPixels, uint32_t *dst, uint32_t numPixels)
+{
+  Expand16BitWordsTo32Bit(pixels, dst, numPixels, true, prevPixels);
 }
 
+#endif // ~SPI_32BIT_COMMANDS
+
 #endif // ~SPI_3WIRE_PROTOCOL
 
 void WaitForPolledSPITransferToFinish()
@@ -260,7 +308,14 @@ void WaitForPolledSPITransferToFinish()
   if ((cs & BCM2835_SPI0_CS_RXD)) spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS;
 }
 
-#ifdef ALL_TASKS_SHOULD_DMA
+#if defined(SIMULATE_PERIPHERALS)
+
+void RunSPITask(SPITask *task)
+{
+  SimulateSPITask(task);
+}
+
+#elif defined(ALL_TASKS_SHOULD_DMA)
 
 #ifndef USE_DMA_TRANSFERS
 #error When building with #define ALL_TASKS_SHOULD_DMA enabled, -DUSE_DMA_TRANSFERS=ON should be set in CMake command line!
@@ -374,10 +429,6 @@ void RunSPITask(SPITask *task)
   SET_GPIO(GPIO_TFT_DATA_CONTROL);
 #endif // ~!SPI_3WIRE_PROTOCOL
 
-// For small transfers, using DMA is not worth it, but pushing through with polled SPI gives better bandwidth.
-// For larger transfers though that are more than this amount of bytes, using DMA is faster.
-// This cutoff number was experimentally tested to find where Polled SPI and DMA are as fast.
-#define DMA_IS_FASTER_THAN_POLLED_SPI 140
   // Do a DMA transfer if this task is suitable in size for DMA to handle
 #ifdef USE_DMA_TRANSFERS
   if (tEnd - tStart > DMA_IS_FASTER_THAN_POLLED_SPI)
@@ -407,32 +458,129 @@ void RunSPITask(SPITask *task)
 #endif
 
 SharedMemory *spiTaskMemory = 0;
+SPITaskBatch spiTaskBatch = {};
 volatile uint64_t spiThreadIdleUsecs = 0;
 volatile uint64_t spiThreadSleepStartTime = 0;
 volatile int spiThreadSleeping = 0;
+volatile uint64_t spiBytesSkipped = 0;
 double spiUsecsPerByte;
 
+// The frame that the SPI thread is currently sending, and the frames that have ended in the tasks taken from the queue since the last SignalFramesDone()
+static SPIFrameMarker frameBeingSent = {};
+#define MAX_FRAMES_ENDED_BEFORE_SIGNALING 4
+static SPIFrameMarker framesEnded[MAX_FRAMES_ENDED_BEFORE_SIGNALING];
+static int numFramesEnded = 0;
+
+#ifdef DROP_STALE_FRAMES
+// If true, the SPI thread is skipping the tasks of a dropped frame, until the marker that ends the frame
+static bool droppingFrame = false;
+static uint32_t frameBytesSkipped = 0;
+
+bool DropQueuedFrame(uint32_t frameNumber)
+{
+  // The main thread can only drop the frame right after the newest claimed one, i.e. when the SPI thread has started (or the main thread
+  // has dropped) the frame before it, but not this one yet
+  uint32_t claimed = __atomic_load_n(&spiTaskMemory->framesClaimed, __ATOMIC_RELAXED);
+  if (((claimed ^ (frameNumber - 1)) & ~SPI_FRAME_DROPPED) != 0) return false;
+  return __atomic_compare_exchange_n(&spiTaskMemory->framesClaimed, &claimed, frameNumber | SPI_FRAME_DROPPED, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// Called on the SPI thread when it reaches the start of a frame. Returns false if the main thread has dropped the frame.
+static bool ClaimFrame(uint32_t frameNumber)
+{
+  uint32_t claimed = __atomic_load_n(&spiTaskMemory->framesClaimed, __ATOMIC_RELAXED);
+  do
+  {
+    // The main thread may have dropped several frames in a row ahead of the SPI thread. (Compare without the flag bit, wrapping around)
+    if ((claimed & SPI_FRAME_DROPPED) && (int32_t)((claimed - frameNumber) << 1) >= 0) return false;
+  } while(!__atomic_compare_exchange_n(&spiTaskMemory->framesClaimed, &claimed, frameNumber, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return true;
+}
+#endif
+
+void ProcessFrameMarker(const SPIFrameMarker *marker)
+{
+  if (!marker->end)
+  {
+    frameBeingSent = *marker;
+#ifdef DROP_STALE_FRAMES
+    droppingFrame = !ClaimFrame(marker->frameNumber);
+    frameBeingSent.dropped = droppingFrame;
+#endif
+    return;
+  }
+  if (numFramesEnded == MAX_FRAMES_ENDED_BEFORE_SIGNALING) SignalFramesDone();
+  framesEnded[numFramesEnded] = frameBeingSent;
+  framesEnded[numFramesEnded++].bytes = marker->bytes;
+#ifdef DROP_STALE_FRAMES
+  if (droppingFrame)
+  {
+    framesEnded[numFramesEnded-1].bytes = frameBytesSkipped; // For dropped frames, report the bytes that were skipped instead
+#ifdef STATISTICS
+    __atomic_fetch_add(&spiBytesSkipped, frameBytesSkipped, __ATOMIC_RELAXED);
+#endif
+    frameBytesSkipped = 0;
+    droppingFrame = false;
+  }
+#endif
+}
+
+void SignalFramesDone()
+{
+  if (numFramesEnded == 0) return;
+#ifdef SIMULATE_PERIPHERALS
+  uint64_t now = tick();
+  for(int i = 0; i < numFramesEnded; ++i)
+    if (framesEnded[i].dropped) SimulatedFrameDropped(framesEnded[i].bytes);
+    else SimulatedFrameDone(now - framesEnded[i].captureTime);
+#endif
+  __atomic_store_n(&spiTaskMemory->framesDone, framesEnded[numFramesEnded-1].frameNumber, __ATOMIC_RELEASE);
+  numFramesEnded = 0;
+#if !defined(KERNEL_MODULE_CLIENT) && !defined(KERNEL_MODULE)
+  syscall(SYS_futex, &spiTaskMemory->framesDone, FUTEX_WAKE, 1, 0, 0, 0); // Wake the main thread if it was waiting for the frame to be done
+#endif
+}
+
 SPITask *GetTask() // Returns the first task in the queue, called in worker thread
 {
-  uint32_t head = spiTaskMemory->queueHead;
-  uint32_t tail = spiTaskMemory->queueTail;
-  if (head == tail) return 0;
-  SPITask *task = (SPITask*)(spiTaskMemory->buffer + head);
-  if (task->cmd == 0) // Wrapped around?
+  uint32_t head = __atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_RELAXED); // Only the SPI thread stores the head
+  uint32_t tail = __atomic_load_n(&spiTaskMemory->queueTail, __ATOMIC_ACQUIRE); // Pairs with the store in PublishTasks(), so that the task contents are visible
+  while(head != tail)
   {
-    spiTaskMemory->queueHead = 0;
-    __sync_synchronize();
-    if (tail == 0) return 0;
-    task = (SPITask*)spiTaskMemory->buffer;
+    SPITask *task = (SPITask*)(spiTaskMemory->buffer + head);
+    if (task->cmd != 0)
+    {
+#ifdef DROP_STALE_FRAMES
+      if (!droppingFrame) return task;
+      // Skip over the tasks of a dropped frame. Like DoneTask(), but without running the task
+      uint32_t bytes = task->PayloadSize()+1;
+      __atomic_fetch_sub(&spiTaskMemory->spiBytesQueued, bytes, __ATOMIC_RELAXED);
+      frameBytesSkipped += bytes;
+      head += SPI_TASK_SIZE_IN_QUEUE(task->size);
+#else
+      return task;
+#endif
+    }
+    else if (task->size == 0) // Wrapped around?
+      head = 0;
+    else
+    {
+      // Frame markers are consumed right here. They were not counted in spiBytesQueued, so no DoneTask() for them either
+      SPIFrameMarker marker;
+      memcpy(&marker, task->data, sizeof(marker));
+      ProcessFrameMarker(&marker);
+      head += SPI_TASK_SIZE_IN_QUEUE(task->size);
+    }
+    __atomic_store_n(&spiTaskMemory->queueHead, head, __ATOMIC_RELEASE);
   }
-  return task;
+  return 0;
 }
 
 void DoneTask(SPITask *task) // Frees the first SPI task from the queue, called in worker thread
 {
   __atomic_fetch_sub(&spiTaskMemory->spiBytesQueued, task->PayloadSize()+1, __ATOMIC_RELAXED);
-  spiTaskMemory->queueHead = (uint32_t)((uint8_t*)task - spiTaskMemory->buffer) + sizeof(SPITask) + task->size;
-  __sync_synchronize();
+  // Pairs with the acquire in AllocTask(), so that the main thread does not overwrite the task before it has been read
+  __atomic_store_n(&spiTaskMemory->queueHead, (uint32_t)((uint8_t*)task - spiTaskMemory->buffer) + SPI_TASK_SIZE_IN_QUEUE(task->size), __ATOMIC_RELEASE);
 }
 
 extern volatile bool programRunning;
@@ -443,14 +591,27 @@ void ExecuteSPITasks()
   BEGIN_SPI_COMMUNICATION();
 #endif
   {
-    while(programRunning && spiTaskMemory->queueTail != spiTaskMemory->queueHead)
+    while(programRunning && __atomic_load_n(&spiTaskMemory->queueTail, __ATOMIC_ACQUIRE) != __atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_RELAXED))
     {
+#ifdef SEND_FRAMES_AS_ONE_DMA_CHAIN
+      // Build all queued tasks into one DMA chain, and let the DMA controller send them while the CPU moves on
+      for(SPITask *task = GetTask(); task && AppendTaskToDMAChain(task); task = GetTask())
+        DoneTask(task);
+      if (previousTaskWasSPI)
+      {
+        WaitForPolledSPITransferToFinish();
+        previousTaskWasSPI = false;
+      }
+      SendDMAChain();
+#else
       SPITask *task = GetTask();
       if (task)
       {
         RunSPITask(task);
         DoneTask(task);
       }
+#endif
+      SignalFramesDone();
     }
   }
 #ifndef USE_DMA_TRANSFERS
@@ -469,7 +630,7 @@ void *spi_thread(void *unused)
 #endif
   while(programRunning)
   {
-    if (spiTaskMemory->queueTail != spiTaskMemory->queueHead)
+    if (__atomic_load_n(&spiTaskMemory->queueTail, __ATOMIC_ACQUIRE) != __atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_RELAXED))
     {
       ExecuteSPITasks();
     }
@@ -480,7 +641,7 @@ void *spi_thread(void *unused)
       spiThreadSleepStartTime = t0;
       __atomic_store_n(&spiThreadSleeping, 1, __ATOMIC_RELAXED);
 #endif
-      if (programRunning) syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAIT, spiTaskMemory->queueHead, 0, 0, 0); // Start sleeping until we get new tasks
+      if (programRunning) syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAIT, __atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_RELAXED), 0, 0, 0); // Start sleeping until we get new tasks
 #ifdef STATISTICS
       __atomic_store_n(&spiThreadSleeping, 0, __ATOMIC_RELAXED);
       uint64_t t1 = tick();
@@ -507,12 +668,17 @@ int InitSPI()
   gpio = (volatile GPIORegisterFile*)((uintptr_t)bcm2835);
 
 #else // Userland version
+#ifdef SIMULATE_PERIPHERALS
+  // Register writes go to plain memory, and RunSPITask() passes SPI tasks to the simulator instead
+  bcm2835 = InitSimulatedPeripherals();
+#else
   // Memory map GPIO and SPI peripherals for direct access
   mem_fd = open("/dev/mem", O_RDWR|O_SYNC);
   if (mem_fd < 0) FATAL_ERROR("can't open /dev/mem (run as sudo)");
   printf("bcm_host_get_peripheral_address: %p, bcm_host_get_peripheral_size: %u, bcm_host_get_sdram_address: %p\n", bcm_host_get_peripheral_address(), bcm_host_get_peripheral_size(), bcm_host_get_sdram_address());
   bcm2835 = mmap(NULL, bcm_host_get_peripheral_size(), (PROT_READ | PROT_WRITE), MAP_SHARED, mem_fd, bcm_host_get_peripheral_address());
   if (bcm2835 == MAP_FAILED) FATAL_ERROR("mapping /dev/mem failed");
+#endif
   spi = (volatile SPIRegisterFile*)((uintptr_t)bcm2835 + BCM2835_SPI0_BASE);
   gpio = (volatile GPIORegisterFile*)((uintptr_t)bcm2835 + BCM2835_GPIO_BASE);
   systemTimerRegister = (volatile uint64_t*)((uintptr_t)bcm2835 + BCM2835_TIMER_BASE + 0x04); // Generates an unaligned 64-bit pointer, but seems to be fine.
@@ -584,12 +750,18 @@ int InitSPI()
   dmaSourceMemory = (SharedMemory*)dma_alloc_writecombine(0, SHARED_MEMORY_SIZE, &spiTaskMemoryPhysical, GFP_KERNEL);
   LOG("Allocated DMA memory: mem: %p, phys: %p", spiTaskMemory, (void*)spiTaskMemoryPhysical);
   memset((void*)spiTaskMemory, 0, SHARED_MEMORY_SIZE);
+#else
+#ifdef SPI_TASK_QUEUE_IN_DMA_MEMORY
+  spiTaskMemory = (SharedMemory*)Malloc(sizeof(SharedMemory), "spi.cpp shared task memory"); // The queue itself is allocated in InitDMA()
 #else
   spiTaskMemory = (SharedMemory*)Malloc(SHARED_MEMORY_SIZE, "spi.cpp shared task memory");
+#endif
 #endif
 
-  spiTaskMemory->queueHead = spiTaskMemory->queueTail = spiTaskMemory->spiBytesQueued = 0;
+  spiTaskMemory->queueHead = spiTaskMemory->queueTail = spiTaskMemory->spiBytesQueued = spiTaskMemory->framesDone = spiTaskMemory->framesClaimed = 0;
 #endif
+  spiTaskBatch.tail = spiTaskMemory->queueTail;
+  spiTaskBatch.payloadBytes = 0;
 
 #ifdef USE_DMA_TRANSFERS
   InitDMA();
@@ -624,6 +796,15 @@ void DeinitSPI()
 #ifdef USE_SPI_THREAD
   pthread_join(spiThread, NULL);
   spiThread = (pthread_t)0;
+#endif
+#ifdef SIMULATE_PERIPHERALS
+  // Let the simulated display receive the rest of the queued tasks before reporting what it shows
+  for(SPITask *task = GetTask(); task; task = GetTask())
+  {
+    RunSPITask(task);
+    DoneTask(task);
+  }
+  PrintSimulatorReport();
 #endif
   DeinitSPIDisplay();
 #ifdef USE_DMA_TRANSFERS
@@ -645,7 +826,11 @@ void DeinitSPI()
 
   if (bcm2835)
   {
+#ifdef SIMULATE_PERIPHERALS
+    DeinitSimulatedPeripherals(bcm2835);
+#else
     munmap((void*)bcm2835, bcm_host_get_peripheral_size());
+#endif
     bcm2835 = 0;
   }
 
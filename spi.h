@@ -2,6 +2,7 @@
 
 #ifndef KERNEL_MODULE
 #include <inttypes.h>
+#include <memory.h>
 #include <sys/syscall.h>
 #endif
 #include <linux/futex.h>
@@ -101,6 +102,20 @@ extern volatile SPIRegisterFile *spi;
 #define MAX_SPI_TASK_SIZE 65528
 #endif
 
+// For small transfers, using DMA is not worth it, but pushing through with polled SPI gives better bandwidth.
+// For larger transfers though that are more than this amount of bytes, using DMA is faster.
+// This cutoff number was experimentally tested to find where Polled SPI and DMA are as fast.
+#define DMA_IS_FASTER_THAN_POLLED_SPI 140
+
+// Waking up from the DMA completion interrupt takes some tens of microseconds, so DMA transfers that are estimated to finish sooner
+// than this are waited for by spinning instead. (See DMA_COMPLETION_UIO_DEVICE in config.h)
+#define DMA_COMPLETION_INTERRUPT_MIN_USECS 250
+
+#if defined(SPI_TASK_QUEUE_IN_DMA_MEMORY) && defined(SPI_3WIRE_PROTOCOL)
+// 3-wire tasks are expanded from 8-bit to 9-bit in place, which would mean reading and writing the uncached queue memory byte by byte.
+#error SPI_TASK_QUEUE_IN_DMA_MEMORY is not compatible with 3-wire SPI displays!
+#endif
+
 typedef struct __attribute__((packed)) SPITask
 {
   uint32_t size; // Size, including both 8-bit and 9-bit tasks
@@ -111,12 +126,20 @@ typedef struct __attribute__((packed)) SPITask
   uint32_t cmd;
 #else
   uint8_t cmd;
+#endif
+#ifdef SPI_TASK_QUEUE_IN_DMA_MEMORY
+  uint8_t padding[3]; // The CPU faults on unaligned accesses to uncached memory, so keep dmaSpiHeader and data 4-byte aligned
 #endif
   uint32_t dmaSpiHeader;
 #ifdef OFFLOAD_PIXEL_COPY_TO_DMA_CPP
   uint8_t *fb;
   uint8_t *prevFb;
   uint16_t width;
+#endif
+#ifdef SEND_PIXELS_WITH_DMA_2D_STRIDE
+  uint32_t fbBusAddress; // If nonzero, the pixels of this task are sent from this bus address of the DMA framebuffer instead of from data[]
+  uint16_t width, height; // Size of the span rectangle, in pixels
+  uint16_t lastScanlineWidth; // The last scanline of the span may be shorter than the others
 #endif
   uint8_t data[]; // Contains both 8-bit and 9-bit tasks back to back, 8-bit first, then 9-bit.
 
@@ -134,6 +157,36 @@ typedef struct __attribute__((packed)) SPITask
 
 } SPITask;
 
+// Frame markers delimit the tasks of each frame in the SPI task queue, and carry the metadata of the frame. They are tasks with cmd=0
+// and this struct as their payload, which the SPI thread consumes itself instead of sending them to the display. (The end of buffer
+// sentinel also has cmd=0, but size=0)
+typedef struct SPIFrameMarker
+{
+  uint64_t captureTime; // tick() time when the frame was snapshotted
+  uint32_t frameNumber; // Running number of the frame, the first submitted frame is 1
+  uint32_t bytes; // Bytes of SPI traffic in the tasks of the frame. Only known in the end marker
+  uint8_t end; // 0 in the marker that begins the frame, 1 in the marker that ends it
+  uint8_t interlaced; // If nonzero, the frame only updates the scanlines of one field
+  uint8_t parity; // For interlaced frames, 0 if the frame updates the even scanlines, and 1 if the odd ones
+  uint8_t dropped; // Set by the SPI thread if it skipped the tasks of the frame, because the main thread dropped it (see DROP_STALE_FRAMES)
+} SPIFrameMarker;
+
+// Set in SharedMemory::framesClaimed when the frame number there was claimed by the main thread to be dropped
+#define SPI_FRAME_DROPPED 0x80000000U
+
+#ifdef SPI_TASK_QUEUE_IN_DMA_MEMORY
+// Tasks in the uncached queue are kept 4-byte aligned, see SPITask::padding
+#define SPI_TASK_SIZE_IN_QUEUE(payloadBytes) ((sizeof(SPITask) + (payloadBytes) + 3) & ~3U)
+#else
+#define SPI_TASK_SIZE_IN_QUEUE(payloadBytes) (sizeof(SPITask) + (payloadBytes))
+#endif
+
+#ifdef SIMULATE_PERIPHERALS
+// The simulated SPI bus has finished each task by the time RunSPITask() returns, so there is no transfer state to wait on
+#define BEGIN_SPI_COMMUNICATION() ((void)0)
+#define END_SPI_COMMUNICATION() ((void)0)
+#define WAIT_SPI_FINISHED() ((void)0)
+#else
 #define BEGIN_SPI_COMMUNICATION() do { spi->cs = BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS; } while(0)
 #define END_SPI_COMMUNICATION()  do { \
     uint32_t cs; \
@@ -153,6 +206,7 @@ typedef struct __attribute__((packed)) SPITask
         spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS; \
     } \
   } while(0)
+#endif
 
 
 // A convenience for defining and dispatching SPI task bytes inline
@@ -236,6 +290,8 @@ typedef struct __attribute__((packed)) SPITask
   } while(0)
 #endif
 
+#define SPI_QUEUE_CACHE_LINE_SIZE 64
+
 typedef struct SharedMemory
 {
 #ifdef USE_DMA_TRANSFERS
@@ -243,12 +299,27 @@ typedef struct SharedMemory
   volatile uint32_t dummyDMADestinationWriteAddress;
   volatile uint32_t dmaTxChannel, dmaRxChannel;
 #endif
-  volatile uint32_t queueHead;
-  volatile uint32_t queueTail;
+  // The SPI task queue is a single producer, single consumer ring buffer. The main thread publishes new tasks by storing queueTail with
+  // release semantics, and the SPI thread (or the kernel module) frees the tasks it has run by storing queueHead with release semantics,
+  // each side loading the other's index with acquire semantics. Each index is written by one side only, so keep them on cache lines of
+  // their own, or the two threads would keep stealing the line from each other on every task.
+  uint32_t queueHead;
+  uint32_t framesDone; // Number of the newest frame that the SPI thread has sent all tasks of. The main thread can sleep on this with a futex
+  // Number of the newest frame that the SPI thread has started to send, or with SPI_FRAME_DROPPED, the newest frame that the main thread
+  // has dropped before the SPI thread got to it. Both threads claim frames in order with a compare and swap, so each queued frame is
+  // either sent or dropped, never both. Only used with DROP_STALE_FRAMES
+  uint32_t framesClaimed;
+  uint8_t queueHeadPadding[SPI_QUEUE_CACHE_LINE_SIZE - 3*sizeof(uint32_t)];
+  uint32_t queueTail;
+  uint8_t queueTailPadding[SPI_QUEUE_CACHE_LINE_SIZE - sizeof(uint32_t)];
   volatile uint32_t spiBytesQueued; // Number of actual payload bytes in the queue
   volatile uint32_t interruptsRaised;
   volatile uintptr_t sharedMemoryBaseInPhysMemory;
+#ifdef SPI_TASK_QUEUE_IN_DMA_MEMORY
+  volatile uint8_t *buffer; // SPI_QUEUE_SIZE bytes of uncached GPU memory, allocated in InitDMA()
+#else
   volatile uint8_t buffer[];
+#endif
 } SharedMemory;
 
 #ifdef KERNEL_MODULE
@@ -258,12 +329,22 @@ extern dma_addr_t spiTaskMemoryPhysical;
 extern SharedMemory *spiTaskMemory;
 extern double spiUsecsPerByte;
 
+// State of the producer side of the SPI task queue, only accessed by the main thread
+typedef struct SPITaskBatch
+{
+  uint32_t tail; // End of the last committed task. Runs ahead of spiTaskMemory->queueTail while a batch is open
+  uint32_t payloadBytes; // Bytes of the committed tasks that have not yet been added to spiTaskMemory->spiBytesQueued
+  int open; // If nonzero, committed tasks are only handed over to the SPI thread in EndTaskBatch()
+} SPITaskBatch;
+extern SPITaskBatch spiTaskBatch;
+
 extern SharedMemory *dmaSourceMemory; // TODO: Optimize away the need to have this at all, instead DMA directly from SPI ring buffer if possible
 
 #ifdef STATISTICS
 extern volatile uint64_t spiThreadIdleUsecs;
 extern volatile uint64_t spiThreadSleepStartTime;
 extern volatile int spiThreadSleeping;
+extern volatile uint64_t spiBytesSkipped; // Bytes of SPI tasks that the SPI thread skipped in dropped frames
 #endif
 
 extern int mem_fd;
@@ -273,9 +354,15 @@ extern int mem_fd;
 // Converts the given SPI task in-place from an 8-bit task to a 9-bit task.
 void Interleave8BitSPITaskTo9Bit(SPITask *task);
 
+#ifdef SPI_32BIT_COMMANDS
 // Converts the given SPI task in-place from a 16-bit task to a 32-bit task.
 void Interleave16BitSPITaskTo32Bit(SPITask *task);
 
+// Writes the given RGB565 pixels of the framebuffer out as the 32-bit data words of a pixel task, converting them to big endian on the way.
+// The pixels are also copied to prevPixels on the same pass, to update the previous framebuffer.
+void ExpandPixelsTo32BitSPITask(const uint16_t *pixels, uint16_t *prevPixels, uint32_t *dst, uint32_t numPixels);
+#endif
+
 // If the given display is a 3-wire SPI display (9 bits/task instead of 8 bits/task), this function computes the byte size of the 8-bit task when it is converted to a 9-bit task.
 uint32_t NumBytesNeededFor9BitSPITask(uint32_t byteSizeFor8BitTask);
 
@@ -284,30 +371,58 @@ uint32_t NumBytesNeededFor32BitSPITask(uint32_t byteSizeFor8BitTask);
 
 #endif
 
-static inline SPITask *AllocTask(uint32_t bytes) // Returns a pointer to a new SPI task block, called on main thread
+#if defined(SEND_FRAMES_AS_ONE_DMA_CHAIN) && !defined(USE_SPI_THREAD)
+void ExecuteSPITasks(void);
+#endif
+
+// Called on the SPI thread when it reaches a frame marker in the task queue
+void ProcessFrameMarker(const SPIFrameMarker *marker);
+// Called on the SPI thread after it has sent the tasks that it has taken from the queue, to report the frames that ended in them as done
+void SignalFramesDone(void);
+
+#ifdef DROP_STALE_FRAMES
+// Called on the main thread to drop the newest queued frame. Succeeds if the SPI thread has not yet started to send it, in which
+// case the SPI thread will skip its tasks. Returns false if the frame is already being sent.
+bool DropQueuedFrame(uint32_t frameNumber);
+#endif
+
+static inline void PublishTasks() // Hands all committed tasks over to the SPI thread, called on main thread
 {
+  uint32_t tail = __atomic_load_n(&spiTaskMemory->queueTail, __ATOMIC_RELAXED); // Only the main thread stores the tail
+  if (tail == spiTaskBatch.tail) return;
+  __atomic_fetch_add(&spiTaskMemory->spiBytesQueued, spiTaskBatch.payloadBytes, __ATOMIC_RELAXED);
+  spiTaskBatch.payloadBytes = 0;
+  // Sequentially consistent instead of release, so that the store of the tail cannot be reordered after the load of the head below.
+  // Otherwise the SPI thread could find the queue empty and go to sleep, while this thread sees the old head and skips the wake.
+  __atomic_store_n(&spiTaskMemory->queueTail, spiTaskBatch.tail, __ATOMIC_SEQ_CST);
+#if !defined(KERNEL_MODULE_CLIENT) && !defined(KERNEL_MODULE)
+  if (__atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_SEQ_CST) == tail) syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0); // Wake the SPI thread if it was sleeping to get new tasks
+#endif
+}
+
 #ifdef SPI_3WIRE_PROTOCOL
+// Returns a pointer to a new SPI task block with room for 'bytes' bytes of 8-bit/16-bit data, followed by sizeExpandedTaskWithPadding
+// bytes for the expanded 9-bit/32-bit task, called on main thread
+static inline SPITask *AllocTask(uint32_t bytes, uint32_t sizeExpandedTaskWithPadding)
+{
   // For 3-wire/9-bit tasks, store the converted task right at the end of the 8-bit task.
-#ifdef SPI_32BIT_COMMANDS
-  uint32_t sizeExpandedTaskWithPadding = NumBytesNeededFor32BitSPITask(bytes) + SPI_9BIT_TASK_PADDING_BYTES;
-#else
-  uint32_t sizeExpandedTaskWithPadding = NumBytesNeededFor9BitSPITask(bytes) + SPI_9BIT_TASK_PADDING_BYTES;
-#endif
   bytes += sizeExpandedTaskWithPadding;
 #else
-//  const uint32_t totalBytesFor9BitTask = 0;
+static inline SPITask *AllocTask(uint32_t bytes) // Returns a pointer to a new SPI task block, called on main thread
+{
 #endif
 
-  uint32_t bytesToAllocate = sizeof(SPITask) + bytes;// + totalBytesFor9BitTask;
-  uint32_t tail = spiTaskMemory->queueTail;
+  uint32_t bytesToAllocate = SPI_TASK_SIZE_IN_QUEUE(bytes);// + totalBytesFor9BitTask;
+  uint32_t tail = spiTaskBatch.tail;
   uint32_t newTail = tail + bytesToAllocate;
   // Is the new task too large to write contiguously into the ring buffer, that it's split into two parts? We never split,
   // but instead write a sentinel at the end of the ring buffer, and jump the tail back to the beginning of the buffer and
   // allocate the new task there. However in doing so, we must make sure that we don't write over the head marker.
   if (newTail + sizeof(SPITask)/*Add extra SPITask size so that there will always be room for eob marker*/ >= SPI_QUEUE_SIZE)
   {
-    uint32_t head = spiTaskMemory->queueHead;
+    uint32_t head = __atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_ACQUIRE);
     // Write a sentinel, but wait for the head to advance first so that it is safe to write.
+    if (head > tail || head == 0) PublishTasks(); // The SPI thread can only advance over the tasks that it has been handed
     while(head > tail || head == 0/*Head must move > 0 so that we don't stomp on it*/)
     {
 #if defined(KERNEL_MODULE_CLIENT) && !defined(KERNEL_MODULE)
@@ -317,30 +432,36 @@ static inline SPITask *AllocTask(uint32_t bytes) // Returns a pointer to a new S
       // At this point the SPI queue may actually be quite empty, so don't sleep (except for now in kernel client app)
       usleep(100);
 #endif
-      head = spiTaskMemory->queueHead;
+#if defined(SEND_FRAMES_AS_ONE_DMA_CHAIN) && !defined(USE_SPI_THREAD)
+      // Tasks are only sent once the frame has been submitted, so there is no one else to empty the queue
+      ExecuteSPITasks();
+#endif
+      head = __atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_ACQUIRE);
     }
     SPITask *endOfBuffer = (SPITask*)(spiTaskMemory->buffer + tail);
     endOfBuffer->cmd = 0; // Use cmd=0x00 to denote "end of buffer, wrap to beginning"
-    __sync_synchronize();
-    spiTaskMemory->queueTail = 0;
-    __sync_synchronize();
-#if !defined(KERNEL_MODULE_CLIENT) && !defined(KERNEL_MODULE)
-    if (spiTaskMemory->queueHead == tail) syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0); // Wake the SPI thread if it was sleeping to get new tasks
-#endif
+    endOfBuffer->size = 0; // (Frame markers also have cmd=0x00, but carry a payload)
+    spiTaskBatch.tail = 0;
+    if (!spiTaskBatch.open) PublishTasks();
     tail = 0;
     newTail = bytesToAllocate;
   }
 
   // If the SPI task queue is full, wait for the SPI thread to process some tasks. This throttles the main thread to not run too fast.
-  uint32_t head = spiTaskMemory->queueHead;
+  uint32_t head = __atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_ACQUIRE);
+  if (head > tail && head <= newTail) PublishTasks();
   while(head > tail && head <= newTail)
   {
 #if defined(KERNEL_MODULE_CLIENT) && !defined(KERNEL_MODULE)
       // Hack: Pump the kernel module to start transferring in case it has stopped. TODO: Remove this line:
     if (!(spi->cs & BCM2835_SPI0_CS_TA)) spi->cs |= BCM2835_SPI0_CS_TA;
 #endif
+#if defined(SEND_FRAMES_AS_ONE_DMA_CHAIN) && !defined(USE_SPI_THREAD)
+    ExecuteSPITasks();
+#else
     usleep(100); // Since the SPI queue is full, we can afford to sleep a bit on the main thread without introducing lag.
-    head = spiTaskMemory->queueHead;
+#endif
+    head = __atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_ACQUIRE);
   }
 
   SPITask *task = (SPITask*)(spiTaskMemory->buffer + tail);
@@ -351,10 +472,34 @@ static inline SPITask *AllocTask(uint32_t bytes) // Returns a pointer to a new S
 #ifdef OFFLOAD_PIXEL_COPY_TO_DMA_CPP
   task->fb = &task->data[0];
   task->prevFb = 0;
+#endif
+#ifdef SEND_PIXELS_WITH_DMA_2D_STRIDE
+  task->fbBusAddress = 0;
 #endif
   return task;
 }
 
+#ifdef SPI_3WIRE_PROTOCOL
+static inline SPITask *AllocTask(uint32_t bytes) // Returns a pointer to a new SPI task block, called on main thread
+{
+#ifdef SPI_32BIT_COMMANDS
+  return AllocTask(bytes, NumBytesNeededFor32BitSPITask(bytes) + SPI_9BIT_TASK_PADDING_BYTES);
+#else
+  return AllocTask(bytes, NumBytesNeededFor9BitSPITask(bytes) + SPI_9BIT_TASK_PADDING_BYTES);
+#endif
+}
+#endif
+
+#ifdef SPI_32BIT_COMMANDS
+// Returns a pixel task that only has room for the expanded 32-bit task. The caller writes the data words straight after the command word
+// at capture time (see ExpandPixelsTo32BitSPITask()), so that CommitTask() only needs to fill in the command word, instead of making a
+// second pass over the task memory to expand it.
+static inline SPITask *AllocExpandedTask(uint32_t bytes)
+{
+  return AllocTask(0, NumBytesNeededFor32BitSPITask(bytes) + SPI_9BIT_TASK_PADDING_BYTES);
+}
+#endif
+
 static inline void CommitTask(SPITask *task) // Advertises the given SPI task from main thread to worker, called on main thread
 {
 #ifdef SPI_3WIRE_PROTOCOL
@@ -364,19 +509,45 @@ static inline void CommitTask(SPITask *task) // Advertises the given SPI task fr
   Interleave8BitSPITaskTo9Bit(task);
 #endif
 #endif
-  __sync_synchronize();
-#if !defined(KERNEL_MODULE_CLIENT) && !defined(KERNEL_MODULE)
-  uint32_t tail = spiTaskMemory->queueTail;
+  spiTaskBatch.tail = (uint32_t)((uint8_t*)task - spiTaskMemory->buffer) + SPI_TASK_SIZE_IN_QUEUE(task->size);
+  spiTaskBatch.payloadBytes += task->PayloadSize()+1;
+  if (!spiTaskBatch.open) PublishTasks();
+}
+
+// Starts collecting committed tasks into a batch, which EndTaskBatch() then hands over to the SPI thread with one store to the queue tail
+// and at most one wake. Single threaded builds run each task right after committing it, so they cannot batch, and this does nothing.
+static inline void BeginTaskBatch()
+{
+#if defined(USE_SPI_THREAD) || defined(SEND_FRAMES_AS_ONE_DMA_CHAIN)
+  spiTaskBatch.open = 1;
 #endif
-  spiTaskMemory->queueTail = (uint32_t)((uint8_t*)task - spiTaskMemory->buffer) + sizeof(SPITask) + task->size;
-  __atomic_fetch_add(&spiTaskMemory->spiBytesQueued, task->PayloadSize()+1, __ATOMIC_RELAXED);
-  __sync_synchronize();
-#if !defined(KERNEL_MODULE_CLIENT) && !defined(KERNEL_MODULE)
-  if (spiTaskMemory->queueHead == tail) syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0); // Wake the SPI thread if it was sleeping to get new tasks
+}
+
+static inline void EndTaskBatch()
+{
+  spiTaskBatch.open = 0;
+  PublishTasks();
+}
+
+// Queues a marker that begins or ends the tasks of a frame, called on main thread
+static inline void QueueFrameMarker(const SPIFrameMarker *marker)
+{
+#if defined(USE_SPI_THREAD) || defined(SEND_FRAMES_AS_ONE_DMA_CHAIN)
+  SPITask *task = AllocTask(sizeof(SPIFrameMarker));
+  task->cmd = 0;
+  memcpy(task->data, marker, sizeof(SPIFrameMarker)); // The payload of a task is not necessarily 8-byte aligned
+  // Like CommitTask(), but the marker is not sent to the display, so it is not counted in spiBytesQueued
+  spiTaskBatch.tail = (uint32_t)((uint8_t*)task - spiTaskMemory->buffer) + SPI_TASK_SIZE_IN_QUEUE(task->size);
+  if (!spiTaskBatch.open) PublishTasks();
+#else
+  // Single threaded builds have already run the tasks of the frame as they were committed
+  ProcessFrameMarker(marker);
+  SignalFramesDone();
 #endif
 }
 
-#ifdef USE_SPI_THREAD
+#if defined(USE_SPI_THREAD) || defined(SEND_FRAMES_AS_ONE_DMA_CHAIN)
+// With SEND_FRAMES_AS_ONE_DMA_CHAIN, a single threaded build sends the tasks of the whole frame at once after they have been submitted
 #define IN_SINGLE_THREADED_MODE_RUN_TASK() ((void)0)
 #else
 #define IN_SINGLE_THREADED_MODE_RUN_TASK() { \
@@ -66,11 +66,13 @@ char cpuTemperatureText[32] = {};
 uint16_t cpuTemperatureColor = 0;
 char gpuPollingWastedText[32] = {};
 uint16_t gpuPollingWastedColor = 0;
+char spiBytesSkippedText[32] = {};
 
 char cpuMemoryUsedText[32] = {};
 char gpuMemoryUsedText[32] = {};
 
 uint64_t statsLastPrint = 0;
+uint32_t statsOverlayGeneration = 0;
 
 void UpdateStatisticsNumbers()
 {
@@ -97,6 +99,9 @@ void DrawStatisticsOverlay(uint16_t *framebuffer)
 #endif
 #ifdef USE_SPI_THREAD
   DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, spiUsagePercentageText, 75, 10, spiUsageColor, 0);
+#endif
+#ifdef DROP_STALE_FRAMES
+  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, spiBytesSkippedText, 100, 10, RGB565(31,0,0), 0);
 #endif
   DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, spiBusDataRateText, 60, 1, 0xFFFF, 0);
 #endif
@@ -192,6 +197,15 @@ void RefreshStatisticsOverlayText()
   spiThreadUtilizationRate = MIN(1.0, MAX(0.0, 1.0 - spiThreadIdleFor / (double)STATISTICS_REFRESH_INTERVAL));
   int spiRate = (int)MIN(100, (spiThreadUtilizationRate*100.0));
   sprintf(spiUsagePercentageText, "%d%%", spiRate);
+#endif
+#ifdef DROP_STALE_FRAMES
+  // Bytes in dropped frames were submitted, but never sent over the bus. Show them as a percentage of all submitted bytes.
+  uint64_t bytesSkipped = __atomic_load_n(&spiBytesSkipped, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&spiBytesSkipped, bytesSkipped, __ATOMIC_RELAXED);
+  bytesSkipped = MIN(bytesSkipped, statsBytesTransferred);
+  if (bytesSkipped > 0) sprintf(spiBytesSkippedText, "-%d%%", (int)MIN(99, bytesSkipped * 100 / statsBytesTransferred));
+  else spiBytesSkippedText[0] = '\0';
+  statsBytesTransferred -= bytesSkipped;
 #endif
   spiBusDataRate = (double)8.0 * statsBytesTransferred * 1000.0 / (elapsed / 1000.0);
 
@@ -232,6 +246,7 @@ void RefreshStatisticsOverlayText()
   else gpuPollingWastedText[0] = '\0';
 
   statsLastPrint = now;
+  ++statsOverlayGeneration;
 
   if (frameTimeHistorySize >= 3)
   {
@@ -287,6 +302,7 @@ void RefreshStatisticsOverlayText()
 #endif
 }
 #else
+uint32_t statsOverlayGeneration = 0;
 void RefreshStatisticsOverlayText() {}
 void DrawStatisticsOverlay(uint16_t *) {}
 #endif // ~STATISTICS
@@ -7,6 +7,9 @@
 void RefreshStatisticsOverlayText(void);
 void DrawStatisticsOverlay(uint16_t *framebuffer);
 
+// Incremented each time the overlay text is refreshed, i.e. whenever DrawStatisticsOverlay() may start drawing different pixels than before.
+extern uint32_t statsOverlayGeneration;
+
 #ifdef STATISTICS
 
 extern volatile uint64_t timeWastedPollingGPU;
@@ -42,5 +45,6 @@ extern char cpuTemperatureText[32];
 extern uint16_t cpuTemperatureColor;
 extern char gpuPollingWastedText[32];
 extern uint16_t gpuPollingWastedColor;
+extern char spiBytesSkippedText[32];
 
 #endif
@@ -0,0 +1,47 @@
+// Measures the time to diff typical frames with the scanline diffing functions of diff.cpp, and with the scalar reference implementations
+// for comparison. Pass the frame width and height on the command line, 320x240 by default.
+
+#include "diff_reference.h"
+
+#define NUM_FRAMES 200
+
+int main(int argc, char **argv)
+{
+  uint16_t *framebuffer = 0, *prevFramebuffer = 0;
+#ifdef PARALLEL_PIXEL_DIFF
+  InitDiffThreads();
+#endif
+  SetTestFrameSize(argc > 2 ? atoi(argv[1]) : 320, argc > 2 ? atoi(argv[2]) : 240, 0, &framebuffer, &prevFramebuffer);
+
+  // Sparse changes, like a mostly static UI, and a frame where every scanline has changed, like a playing video or a scrolling game
+  static uint16_t *frames[2][NUM_FRAMES];
+  for(int i = 0; i < NUM_FRAMES; ++i)
+  {
+    frames[0][i] = TestAllocFramebuffer(gpuFramebufferScanlineStrideBytes, gpuFrameHeight);
+    RandomlyChangeFramebuffer(frames[0][i], gpuFrameHeight / 8);
+    frames[1][i] = TestAllocFramebuffer(gpuFramebufferScanlineStrideBytes, gpuFrameHeight);
+    for(int p = 0; p < gpuFramebufferSizeBytes/2; ++p) frames[1][i][p] = (TestRandom() % 4 == 0) ? (uint16_t)TestRandom() : 0;
+  }
+  static Span output[1024*(1024/2+1)];
+  const char *contentNames[2] = { "sparse", "dense" };
+  for(int content = 0; content < 2; ++content)
+  {
+    uint64_t t0 = TestTimeUsecs();
+    int numSpans = 0;
+    for(int i = 0; i < NUM_FRAMES; ++i) numSpans += ReferenceDiffScanlineSpansExact(frames[content][i], prevFramebuffer, false, 0, output);
+    uint64_t t1 = TestTimeUsecs();
+    Span *head;
+    for(int i = 0; i < NUM_FRAMES; ++i) DiffFramebuffersToScanlineSpansExact(frames[content][i], prevFramebuffer, false, 0, head);
+    uint64_t t2 = TestTimeUsecs();
+    for(int i = 0; i < NUM_FRAMES; ++i) numSpans += ReferenceDiffScanlineSpansFastAndCoarse4Wide(frames[content][i], prevFramebuffer, false, 0, output);
+    uint64_t t3 = TestTimeUsecs();
+    for(int i = 0; i < NUM_FRAMES; ++i) DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(frames[content][i], prevFramebuffer, false, 0, head);
+    uint64_t t4 = TestTimeUsecs();
+    printf("%dx%d %s frames (%d spans): exact %.1f usecs/frame (reference %.1f), coarse %.1f usecs/frame (reference %.1f)\n", gpuFrameWidth, gpuFrameHeight,
+      contentNames[content], numSpans, (double)(t2-t1)/NUM_FRAMES, (double)(t1-t0)/NUM_FRAMES, (double)(t4-t3)/NUM_FRAMES, (double)(t3-t2)/NUM_FRAMES);
+  }
+#ifdef PARALLEL_PIXEL_DIFF
+  DeinitDiffThreads();
+#endif
+  return 0;
+}
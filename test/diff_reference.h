@@ -0,0 +1,147 @@
+#pragma once
+
+// Straightforward scalar implementations of the pixel diffing functions in diff.cpp, which the optimized versions are tested against,
+// and helpers to produce frames to diff.
+
+#include "test.h"
+#include "util.h"
+#include "diff.h"
+#include "display.h"
+#include "gpu.h"
+
+// Produces the spans of DiffFramebuffersToScanlineSpansExact() one pixel at a time: pixels are scanned in pairs, a span starts at the
+// first pair that has a changed pixel, and ends at the last changed pixel that is followed by more than SPAN_MERGE_THRESHOLD unchanged
+// pixels, after which the scan resumes.
+static int ReferenceDiffScanlineSpansExact(const uint16_t *framebuffer, const uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *output)
+{
+  int numSpans = 0;
+  const int W = gpuFrameWidth, stride = gpuFramebufferScanlineStrideBytes>>1;
+  for(int y = interlacedDiff ? interlacedFieldParity : 0; y < gpuFrameHeight; y += interlacedDiff ? 2 : 1)
+  {
+    const uint16_t *scanline = framebuffer + y*stride, *prevScanline = prevFramebuffer + y*stride;
+    int x = 0;
+    while(x < W)
+    {
+      if (scanline[x] == prevScanline[x] && (x+1 >= W || scanline[x+1] == prevScanline[x+1]))
+      {
+        x += 2;
+        continue;
+      }
+      int spanStart = x, spanEnd = x, numUnchanged = 0;
+      for(; x < W; ++x)
+        if (scanline[x] != prevScanline[x])
+        {
+          spanEnd = x+1;
+          numUnchanged = 0;
+        }
+        else if (++numUnchanged > SPAN_MERGE_THRESHOLD)
+        {
+          ++x;
+          break;
+        }
+      Span *span = output + numSpans++;
+      span->x = spanStart;
+      span->endX = span->lastScanEndX = spanEnd;
+      span->y = y;
+      span->endY = y+1;
+      span->size = spanEnd - spanStart;
+    }
+  }
+  return numSpans;
+}
+
+// Produces the spans of DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(): scanlines are compared in blocks of 4 pixels, a span runs
+// from the first changed pixel of a changed block to the last changed pixel of the last consecutive changed block, or to the end of the
+// scanline if the changed blocks run up to the last whole block. The 0-3 pixels past the last whole block are not compared. (Like the
+// original implementation, a span that ends in the middle of the scanline includes one unchanged pixel after its last changed pixel)
+static int ReferenceDiffScanlineSpansFastAndCoarse4Wide(const uint16_t *framebuffer, const uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *output)
+{
+  int numSpans = 0;
+  const int W = gpuFrameWidth & ~3, stride = gpuFramebufferScanlineStrideBytes>>1;
+  for(int y = interlacedDiff ? interlacedFieldParity : 0; y < gpuFrameHeight; y += interlacedDiff ? 2 : 1)
+  {
+    const uint16_t *scanline = framebuffer + y*stride, *prevScanline = prevFramebuffer + y*stride;
+    for(int x = 0; x < W; x += 4)
+    {
+      if (!memcmp(scanline + x, prevScanline + x, 8))
+        continue;
+      int spanStart = x;
+      while(scanline[spanStart] == prevScanline[spanStart]) ++spanStart;
+      while(x + 4 < W && memcmp(scanline + x + 4, prevScanline + x + 4, 8)) x += 4;
+      int spanEnd = x + 4;
+      if (spanEnd == W) spanEnd = gpuFrameWidth;
+      else
+      {
+        while(scanline[spanEnd-1] == prevScanline[spanEnd-1]) --spanEnd;
+        ++spanEnd;
+      }
+      Span *span = output + numSpans++;
+      span->x = spanStart;
+      span->endX = span->lastScanEndX = spanEnd;
+      span->y = y;
+      span->endY = y+1;
+      span->size = spanEnd - spanStart;
+      x += 4; // The block after the span is unchanged
+    }
+  }
+  return numSpans;
+}
+
+// Compares the span list that starts at head to the array of numSpans expected spans, and returns true if they are the same.
+static bool SpanListEquals(const Span *head, const Span *expected, int numSpans)
+{
+  for(int i = 0; i < numSpans; ++i, head = head->next)
+    if (!head || head->x != expected[i].x || head->endX != expected[i].endX || head->y != expected[i].y || head->endY != expected[i].endY
+      || head->lastScanEndX != expected[i].lastScanEndX || head->size != expected[i].size)
+      return false;
+  return head == 0;
+}
+
+// Sets up the frame size globals of gpu.cpp, and allocates the span array and the two framebuffers for that frame size.
+static void SetTestFrameSize(int width, int height, int extraStrideBytes, uint16_t **framebuffer, uint16_t **prevFramebuffer)
+{
+  gpuFrameWidth = width;
+  gpuFrameHeight = height;
+  gpuFramebufferScanlineStrideBytes = ((width*2 + 31) & ~31) + extraStrideBytes;
+  gpuFramebufferSizeBytes = gpuFramebufferScanlineStrideBytes * height;
+  changedScanlinesStart = 0;
+  changedScanlinesEnd = height;
+  free(spans);
+  spans = (Span *)calloc(height * MAX_SPANS_PER_SCANLINE, sizeof(Span));
+  free(*framebuffer);
+  free(*prevFramebuffer);
+  *framebuffer = TestAllocFramebuffer(gpuFramebufferScanlineStrideBytes, height);
+  *prevFramebuffer = TestAllocFramebuffer(gpuFramebufferScanlineStrideBytes, height);
+}
+
+// Randomly changes pixels of the framebuffer in patterns that exercise the edge cases of diffing: isolated pixels, runs of pixels, gaps
+// of unchanged pixels around SPAN_MERGE_THRESHOLD, both ends of scanlines, and whole scanlines.
+static void RandomlyChangeFramebuffer(uint16_t *framebuffer, int numChanges)
+{
+  const int W = gpuFrameWidth, stride = gpuFramebufferScanlineStrideBytes>>1;
+  for(int i = 0; i < numChanges; ++i)
+  {
+    uint16_t *scanline = framebuffer + TestRandomRange(0, gpuFrameHeight-1) * stride;
+    int x = TestRandomRange(0, W-1);
+    switch(TestRandom() % 6)
+    {
+    case 0: scanline[x] ^= 1 << TestRandomRange(0, 15); break;
+    case 1:
+    {
+      int end = x + TestRandomRange(1, 40);
+      for(; x < MIN(W, end); ++x) scanline[x] = (uint16_t)TestRandom();
+      break;
+    }
+    case 2:
+    {
+      int gap = SPAN_MERGE_THRESHOLD + TestRandomRange(-1, 1);
+      scanline[x] = ~scanline[x];
+      if (x + gap + 1 < W) scanline[x + gap + 1] = ~scanline[x + gap + 1];
+      break;
+    }
+    case 3: scanline[x % 5] ^= 0x8000; break;
+    case 4: scanline[W - 1 - x % 5] ^= 0x8000; break;
+    case 5: if (TestRandom() % 8 == 0) for(x = 0; x < W; ++x) scanline[x] = (uint16_t)TestRandom(); break;
+    }
+  }
+}
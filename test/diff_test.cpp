@@ -0,0 +1,45 @@
+// Tests the scanline diffing functions of diff.cpp against the scalar reference implementations in diff_reference.h, over random changes
+// to frames of different widths, strides and interlacing.
+
+#include "diff_reference.h"
+
+static uint16_t *framebuffer = 0, *prevFramebuffer = 0;
+
+static void TestScanlineDiff(bool interlacedDiff, int interlacedFieldParity)
+{
+  static Span expected[1024*(1024/2+1)];
+  Span *head = 0;
+
+  int numExpected = ReferenceDiffScanlineSpansExact(framebuffer, prevFramebuffer, interlacedDiff, interlacedFieldParity, expected);
+  DiffFramebuffersToScanlineSpansExact(framebuffer, prevFramebuffer, interlacedDiff, interlacedFieldParity, head);
+  CHECK(SpanListEquals(head, expected, numExpected));
+
+  numExpected = ReferenceDiffScanlineSpansFastAndCoarse4Wide(framebuffer, prevFramebuffer, interlacedDiff, interlacedFieldParity, expected);
+  DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(framebuffer, prevFramebuffer, interlacedDiff, interlacedFieldParity, head);
+  CHECK(SpanListEquals(head, expected, numExpected));
+}
+
+int main()
+{
+#ifdef PARALLEL_PIXEL_DIFF
+  InitDiffThreads();
+#endif
+  const int sizes[][3] = { { 320, 240, 0 }, { 240, 320, 0 }, { 480, 320, 0 }, { 321, 17, 0 }, { 318, 9, 32 }, { 17, 5, 0 }, { 1, 3, 0 }, { 2, 4, 0 }, { 35, 64, 64 } };
+  for(auto &size : sizes)
+  {
+    SetTestFrameSize(size[0], size[1], size[2], &framebuffer, &prevFramebuffer);
+    for(int i = 0; i < 200; ++i)
+    {
+      memcpy(framebuffer, prevFramebuffer, gpuFramebufferSizeBytes);
+      RandomlyChangeFramebuffer(framebuffer, TestRandomRange(0, 1 + gpuFrameHeight * (i % 4)));
+      TestScanlineDiff(false, 0);
+      TestScanlineDiff(true, 0);
+      TestScanlineDiff(true, 1);
+      memcpy(prevFramebuffer, framebuffer, gpuFramebufferSizeBytes);
+    }
+  }
+#ifdef PARALLEL_PIXEL_DIFF
+  DeinitDiffThreads();
+#endif
+  return TestResult();
+}
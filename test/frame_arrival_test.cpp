@@ -0,0 +1,88 @@
+// Tests the phase-locked loop that predicts frame arrivals (AddFrameArrivalSample(), EstimateFrameRateInterval() and
+// PredictNextFrameArrivalTime()) on a synthetic stream of arrival times: content at 60fps with jitter, a dropped frame and a single late
+// frame, which must not throw the loop off lock, then a switch to 24fps and back to 60fps, which the loop must relock to within a few
+// frames. The predictors compare against the current time, so the stream is laid out to end just before the test starts feeding it.
+
+#include "test.h"
+
+#include "config.h"
+#include "display.h"
+#include "gpu.h"
+#include "tick.h"
+
+#define INTERVAL_60FPS 16667
+#define INTERVAL_24FPS 41667
+#define JITTER 1000
+#define MAX_FRAMES 256
+
+static uint64_t arrivals[MAX_FRAMES];
+static int numArrivals = 0, numFed = 0;
+static uint64_t lastSlot = 0; // Arrival time of the most recent frame without jitter
+
+// Appends numFrames frames that arrive interval usecs apart, give or take JITTER. The frame at dropFrame is not delivered, and the frame at
+// lateFrame arrives half of the way to the next one.
+static void AddFrames(int interval, int numFrames, int dropFrame = -1, int lateFrame = -1)
+{
+  for(int i = 0; i < numFrames; ++i)
+  {
+    lastSlot += interval;
+    if (i == dropFrame) continue;
+    arrivals[numArrivals++] = lastSlot + JITTER + TestRandomRange(-JITTER, JITTER) + (i == lateFrame ? interval/2 : 0);
+  }
+}
+
+static void FeedFrames(int numFrames)
+{
+  for(int i = 0; i < numFrames; ++i) AddFrameArrivalSample(arrivals[numFed++]);
+}
+
+static void CheckInterval(int expected, int tolerance)
+{
+  const int64_t interval = (int64_t)EstimateFrameRateInterval();
+  if (interval < expected - tolerance || interval > expected + tolerance)
+    fprintf(stderr, "After %d frames, estimated frame interval is %lld usecs, expected %d +/- %d usecs\n", numFed, (long long)interval, expected, tolerance);
+  CHECK(interval >= expected - tolerance && interval <= expected + tolerance);
+}
+
+int main()
+{
+  CHECK_EQ(EstimateFrameRateInterval(), 1000000/TARGET_FRAME_RATE);
+
+  AddFrames(INTERVAL_60FPS, 120, 60, 90);
+  const int numFrames60fps = numArrivals;
+  AddFrames(INTERVAL_24FPS, 24);
+  const int numFrames24fps = numArrivals - numFrames60fps;
+  AddFrames(INTERVAL_60FPS, 60);
+
+  // Shift the stream so that its last frame arrived a quarter of a frame ago, i.e. about 4.5 seconds of frames in total
+  const uint64_t now = tick();
+  const uint64_t shift = now - INTERVAL_60FPS/4 - lastSlot - JITTER;
+  for(int i = 0; i < numArrivals; ++i) arrivals[i] += shift;
+  lastSlot += shift + JITTER;
+
+  // One frame only gives the phase, so the loop waits for the next one at the lowest tracked frame rate of 10fps, and the second
+  // frame gives the interval
+  FeedFrames(1);
+  CheckInterval(100000, 0);
+  FeedFrames(1);
+  CheckInterval(INTERVAL_60FPS, 2*JITTER);
+
+  FeedFrames(numFrames60fps - 2);
+  CheckInterval(INTERVAL_60FPS, 300);
+
+  FeedFrames(5);
+  CheckInterval(INTERVAL_24FPS, 2*JITTER);
+  FeedFrames(numFrames24fps - 5);
+  CheckInterval(INTERVAL_24FPS, 300);
+
+  FeedFrames(5);
+  CheckInterval(INTERVAL_60FPS, 2*JITTER);
+  FeedFrames(numArrivals - numFed);
+  CheckInterval(INTERVAL_60FPS, 300);
+
+  // The next frame is expected one interval after the last one
+  const int64_t error = (int64_t)(PredictNextFrameArrivalTime() - (lastSlot + INTERVAL_60FPS));
+  if (error < -2*JITTER || error > 2*JITTER) fprintf(stderr, "Next frame arrival predicted %lld usecs off\n", (long long)error);
+  CHECK(error >= -2*JITTER && error <= 2*JITTER);
+  return TestResult();
+}
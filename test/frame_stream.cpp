@@ -0,0 +1,245 @@
+// Generates frame replay streams (see frame_source.h) for the end to end tests, and compares what the simulated display shows at the end of a
+// run against the last frame of the stream. Usage:
+//   frame_stream random <width> <height> <numFrames> <frameIntervalUsecs> [seed] > stream.fbcp
+//   frame_stream collision <width> <height> <numFrames> <frameIntervalUsecs> rows|columns [numChangedLines] > stream.fbcp
+//   frame_stream scroll <width> <height> <numFrames> <frameIntervalUsecs> rows|columns [seed] > stream.fbcp
+//   frame_stream compare <stream.fbcp> <display.fbcp>
+// The streams end abruptly on their last frame instead of repeating it, so the program needs to have sent all of it by the time it quits.
+
+#include "test.h"
+
+#include "frame_source.h"
+#include "util.h"
+
+static void WriteStreamHeader(int width, int height)
+{
+  uint32_t size[2] = { (uint32_t)width, (uint32_t)height };
+  fwrite(FRAME_SOURCE_REPLAY_MAGIC, 1, 4, stdout);
+  fwrite(size, sizeof(size), 1, stdout);
+}
+
+static void WriteStreamFrame(uint64_t time, const uint16_t *frame, int width, int height)
+{
+  fwrite(&time, sizeof(time), 1, stdout);
+  fwrite(frame, sizeof(uint16_t), width*height, stdout);
+}
+
+// Random rectangles of odd sizes, now and then a scroll of the whole frame by a few scanlines, and now and then a frame full of noise,
+// which is too much to update progressively and so also exercises interlacing. The last few frames are noise as well, so that the
+// program is likely to still be busy sending their fields when the stream ends.
+static int GenerateRandomStream(int width, int height, int numFrames, int frameIntervalUsecs)
+{
+  uint16_t *frame = (uint16_t *)calloc(width*height, sizeof(uint16_t));
+  uint16_t *scrolled = (uint16_t *)calloc(width*height, sizeof(uint16_t));
+  WriteStreamHeader(width, height);
+  uint64_t time = 0;
+  for(int f = 0; f < numFrames; ++f)
+  {
+    if (f % 7 == 3)
+    {
+      const int dy = MIN(3, height);
+      memcpy(scrolled, frame + dy*width, (height-dy)*width*sizeof(uint16_t));
+      memcpy(scrolled + (height-dy)*width, frame, dy*width*sizeof(uint16_t));
+      memcpy(frame, scrolled, width*height*sizeof(uint16_t));
+    }
+    if (f % 11 == 5 || f >= numFrames-3)
+      for(int i = 0; i < width*height; ++i) frame[i] = (uint16_t)TestRandom();
+    for(int r = TestRandomRange(1, 6); r > 0; --r)
+    {
+      const int x0 = TestRandomRange(0, width-1), y0 = TestRandomRange(0, height-1);
+      const int w = TestRandomRange(1, MAX(1, width/2)), h = TestRandomRange(1, MAX(1, height/3));
+      const int x1 = MIN(width, x0 + w), y1 = MIN(height, y0 + h);
+      const uint16_t color = (uint16_t)TestRandom();
+      for(int y = y0; y < y1; ++y)
+        for(int x = x0; x < x1; ++x)
+          frame[y*width + x] = (uint16_t)(color + x*7 + y*13);
+    }
+    time += frameIntervalUsecs;
+    WriteStreamFrame(time, frame, width, height);
+  }
+  free(scrolled);
+  free(frame);
+  return 0;
+}
+
+// A frame of noise for the first half of the stream, so that the program has shown it by the time the second half starts, after which each
+// frame only flips the most significant red bit of pixels 1 and 5 on one more scanline in the bottom half of the frame. Such a pair of flips
+// cancelled out in the FNV-1a scanline hash that HashScanline() in gpu.h replaced, so the program would not have noticed these frames at all.
+// Programs that transpose the frames to portrait (DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE) hash the columns of the stream instead, so for them,
+// the flips are made on rows 1 and 5 of one more column in the right half of the frame.
+static void FlipPairedRedBits(uint16_t *frame, int width, int height, int n, bool columns)
+{
+  if (columns)
+  {
+    const int x = width/2 + n % (width - width/2);
+    frame[MIN(1, height-1)*width + x] ^= 0x8000;
+    frame[MIN(5, height-1)*width + x] ^= 0x8000;
+  }
+  else
+  {
+    uint16_t *scanline = frame + (height/2 + n % (height - height/2)) * width;
+    scanline[MIN(1, width-1)] ^= 0x8000;
+    scanline[MIN(5, width-1)] ^= 0x8000;
+  }
+}
+
+// Visibly changes the first numLines rows, or columns, of the frame. The flips above are made outside of these, so a hash that misses them
+// would also narrow down the range of changed scanlines that the main loop diffs to exclude them.
+static void ChangeFirstLines(uint16_t *frame, int width, int height, int numLines, int f, bool columns)
+{
+  for(int y = 0; y < (columns ? height : MIN(numLines, height/2)); ++y)
+    for(int x = 0; x < (columns ? MIN(numLines, width/2) : width); ++x)
+      frame[y*width + x] = (uint16_t)(f*0x0841 + x*7 + y*13);
+}
+
+static int GenerateCollisionStream(int width, int height, int numFrames, int frameIntervalUsecs, bool columns, int numChangedLines)
+{
+  uint16_t *frame = (uint16_t *)calloc(width*height, sizeof(uint16_t));
+  WriteStreamHeader(width, height);
+  uint64_t time = 0;
+  for(int f = 0; f < numFrames; ++f)
+  {
+    if (f == 0)
+      for(int i = 0; i < width*height; ++i) frame[i] = (uint16_t)TestRandom();
+    else if (f >= numFrames/2)
+    {
+      FlipPairedRedBits(frame, width, height, f - numFrames/2, columns);
+      ChangeFirstLines(frame, width, height, numChangedLines, f, columns);
+    }
+    time += frameIntervalUsecs;
+    WriteStreamFrame(time, frame, width, height);
+  }
+  free(frame);
+  return 0;
+}
+
+// Pixel x of line id of the scroll stream. Each line has its own pattern, so that no two lines look the same
+static uint16_t ScrollLinePixel(uint32_t id, int x)
+{
+  uint32_t h = id * 2654435761u + (uint32_t)x * 40503u;
+  h ^= h >> 15;
+  h *= 0x2C1B3C6Du;
+  h ^= h >> 12;
+  return (uint16_t)h;
+}
+
+// Scrolls the contents of the frame by a few rows, or columns, each frame, and fills the exposed lines with new content. The direction
+// changes every now and then, and now and then a small rectangle changes as well. The program can only scroll the panel in hardware along its
+// scanlines, which are the columns of the stream on programs that transpose the frames to portrait (DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE).
+static int GenerateScrollStream(int width, int height, int numFrames, int frameIntervalUsecs, bool columns)
+{
+  const int numLines = columns ? width : height, lineLength = columns ? height : width;
+  uint32_t *lineIds = (uint32_t *)calloc(numLines, sizeof(uint32_t));
+  uint32_t nextId = 0;
+  for(int i = 0; i < numLines; ++i) lineIds[i] = nextId++;
+  uint16_t *frame = (uint16_t *)calloc(width*height, sizeof(uint16_t));
+  WriteStreamHeader(width, height);
+  uint64_t time = 0;
+  for(int f = 0; f < numFrames; ++f)
+  {
+    if (f > 0)
+    {
+      const int dy = MIN(TestRandomRange(1, 6), numLines) * ((f / 15) % 2 ? -1 : 1);
+      if (dy > 0)
+      {
+        memmove(lineIds, lineIds + dy, (numLines - dy)*sizeof(uint32_t));
+        for(int i = numLines - dy; i < numLines; ++i) lineIds[i] = nextId++;
+      }
+      else
+      {
+        memmove(lineIds - dy, lineIds, (numLines + dy)*sizeof(uint32_t));
+        for(int i = 0; i < -dy; ++i) lineIds[i] = nextId++;
+      }
+    }
+    for(int i = 0; i < numLines; ++i)
+      for(int j = 0; j < lineLength; ++j)
+        frame[columns ? j*width + i : i*width + j] = ScrollLinePixel(lineIds[i], j);
+    if (f % 5 == 2)
+    {
+      const int x0 = TestRandomRange(0, width-1), y0 = TestRandomRange(0, height-1);
+      const int x1 = MIN(width, x0 + TestRandomRange(1, 16)), y1 = MIN(height, y0 + TestRandomRange(1, 16));
+      for(int y = y0; y < y1; ++y)
+        for(int x = x0; x < x1; ++x)
+          frame[y*width + x] = (uint16_t)TestRandom();
+    }
+    time += frameIntervalUsecs;
+    WriteStreamFrame(time, frame, width, height);
+  }
+  free(frame);
+  free(lineIds);
+  return 0;
+}
+
+// Reads the header of a stream, and the pixels of its last frame
+static uint16_t *ReadLastFrame(const char *filename, int *width, int *height)
+{
+  FILE *handle = fopen(filename, "rb");
+  if (!handle) { fprintf(stderr, "Failed to open %s\n", filename); exit(1); }
+  char magic[4];
+  uint32_t size[2];
+  if (fread(magic, 1, 4, handle) != 4 || memcmp(magic, FRAME_SOURCE_REPLAY_MAGIC, 4) || fread(size, sizeof(size), 1, handle) != 1)
+  {
+    fprintf(stderr, "%s is not a frame replay stream\n", filename);
+    exit(1);
+  }
+  *width = (int)size[0];
+  *height = (int)size[1];
+  uint16_t *frame = (uint16_t *)malloc(*width * *height * sizeof(uint16_t));
+  int numFrames = 0;
+  uint64_t time;
+  while(fread(&time, sizeof(time), 1, handle) == 1 && fread(frame, sizeof(uint16_t), *width * *height, handle) == (size_t)(*width * *height))
+    ++numFrames;
+  fclose(handle);
+  if (numFrames == 0) { fprintf(stderr, "%s has no frames\n", filename); exit(1); }
+  return frame;
+}
+
+// The display may be mounted in portrait orientation, in which case the landscape frames are shown transposed on it
+static int CompareDisplayToStream(const char *streamFilename, const char *displayFilename)
+{
+  int width, height, displayWidth, displayHeight;
+  uint16_t *frame = ReadLastFrame(streamFilename, &width, &height);
+  uint16_t *display = ReadLastFrame(displayFilename, &displayWidth, &displayHeight);
+  const bool transposed = (displayWidth != width);
+  if (transposed ? (displayWidth != height || displayHeight != width) : displayHeight != height)
+  {
+    fprintf(stderr, "Frames of size %dx%d cannot be compared to a display of size %dx%d\n", width, height, displayWidth, displayHeight);
+    return 1;
+  }
+  int numDifferentPixels = 0;
+  for(int y = 0; y < height; ++y)
+    for(int x = 0; x < width; ++x)
+    {
+      uint16_t shown = transposed ? display[x*displayWidth + y] : display[y*displayWidth + x];
+      if (shown != frame[y*width + x])
+      {
+        if (++numDifferentPixels <= 10) fprintf(stderr, "Pixel (%d,%d) shows 0x%04X instead of 0x%04X\n", x, y, shown, frame[y*width + x]);
+      }
+    }
+  free(display);
+  free(frame);
+  if (numDifferentPixels) fprintf(stderr, "%d pixels of the display differ from the last frame of the stream\n", numDifferentPixels);
+  else printf("The display shows the last frame of the stream\n");
+  return numDifferentPixels ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc >= 6 && !strcmp(argv[1], "random"))
+  {
+    if (argc > 6) testRandomState = MAX(1, atoi(argv[6]));
+    return GenerateRandomStream(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+  }
+  if (argc >= 7 && !strcmp(argv[1], "collision") && (!strcmp(argv[6], "rows") || !strcmp(argv[6], "columns")))
+    return GenerateCollisionStream(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]), !strcmp(argv[6], "columns"), argc > 7 ? atoi(argv[7]) : 0);
+  if (argc >= 7 && !strcmp(argv[1], "scroll") && (!strcmp(argv[6], "rows") || !strcmp(argv[6], "columns")))
+  {
+    if (argc > 7) testRandomState = MAX(1, atoi(argv[7]));
+    return GenerateScrollStream(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]), !strcmp(argv[6], "columns"));
+  }
+  if (argc == 4 && !strcmp(argv[1], "compare"))
+    return CompareDisplayToStream(argv[2], argv[3]);
+  fprintf(stderr, "Usage: %s random <width> <height> <numFrames> <frameIntervalUsecs> [seed]\n       %s collision <width> <height> <numFrames> <frameIntervalUsecs> rows|columns [numChangedLines]\n"
+    "       %s scroll <width> <height> <numFrames> <frameIntervalUsecs> rows|columns [seed]\n       %s compare <stream> <display>\n", argv[0], argv[0], argv[0], argv[0]);
+  return 2;
+}
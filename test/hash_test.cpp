@@ -0,0 +1,67 @@
+// Tests that HashScanline() detects the changes that the pixel diffing is skipped for: any change within a 4-pixel group, and pairs of
+// flipped high bits anywhere on the scanline, and that single bit flips avalanche to about half of the hash bits.
+
+#include "test.h"
+#include "gpu.h"
+
+static uint16_t scanline[1024];
+
+static void RandomizeScanline(int width)
+{
+  for(int x = 0; x < width; ++x) scanline[x] = (uint16_t)TestRandom();
+}
+
+int main()
+{
+  // Every single bit flip of every pixel, on widths that exercise the 8, 4 and 0-3 pixel tails
+  for(int width = 1; width <= 40; ++width)
+  {
+    RandomizeScanline(width);
+    uint64_t hash = HashScanline(scanline, width);
+    for(int x = 0; x < width; ++x)
+      for(int bit = 0; bit < 16; ++bit)
+      {
+        scanline[x] ^= 1 << bit;
+        CHECK(HashScanline(scanline, width) != hash);
+        scanline[x] ^= 1 << bit;
+      }
+    CHECK(HashScanline(scanline, width) == hash);
+  }
+
+  // Pairs of pixels that get the same most significant bit of the red, green or blue channel flipped, e.g. an antialiased edge that moved.
+  // (A lane of independent 32-bit FNV-1a rounds would miss the flips of bit 15 of two pixels that are 4 pixels apart)
+  const int width = 320;
+  RandomizeScanline(width);
+  const uint64_t hash = HashScanline(scanline, width);
+  const uint16_t channelMsbs[3] = { 0x8000, 0x0400, 0x0010 };
+  for(uint16_t msb : channelMsbs)
+    for(int x = 0; x < width; ++x)
+      for(int x2 = x+1; x2 < width; ++x2)
+      {
+        scanline[x] ^= msb;
+        scanline[x2] ^= msb;
+        CHECK(HashScanline(scanline, width) != hash);
+        scanline[x] ^= msb;
+        scanline[x2] ^= msb;
+      }
+
+  // Avalanche: on average, a single bit flip should flip half of the 64 hash bits, and each hash bit should flip about half of the time
+  int numFlips = 0, numFlipsOfBit[64] = {};
+  const int numSamples = 20000;
+  for(int i = 0; i < numSamples; ++i)
+  {
+    RandomizeScanline(width);
+    uint64_t h = HashScanline(scanline, width);
+    scanline[TestRandomRange(0, width-1)] ^= 1 << TestRandomRange(0, 15);
+    uint64_t flipped = h ^ HashScanline(scanline, width);
+    numFlips += __builtin_popcountll(flipped);
+    for(int bit = 0; bit < 64; ++bit) numFlipsOfBit[bit] += (flipped >> bit) & 1;
+  }
+  double averageFlips = (double)numFlips / numSamples;
+  printf("Average number of hash bits flipped by a single bit flip: %.2f/64\n", averageFlips);
+  CHECK(averageFlips > 31.5 && averageFlips < 32.5);
+  for(int bit = 0; bit < 64; ++bit)
+    CHECK(numFlipsOfBit[bit] > numSamples * 45 / 100 && numFlipsOfBit[bit] < numSamples * 55 / 100);
+
+  return TestResult();
+}
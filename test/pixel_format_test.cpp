@@ -0,0 +1,74 @@
+// Tests that CopyPixelsToSPITask() converts RGB565 framebuffer pixels to the bytes that the display takes: big endian RGB565, or on displays
+// like the ILI9488 that take R6X2G6X2B6X2, one byte per color channel with red and blue widened from 5 to 6 bits by repeating their top bit.
+// Every pixel value is converted once, and every number of pixels up to several bulk blocks at both alignments of the source pixels, with
+// and without updating the previous framebuffer. Bytes past the converted pixels must be left alone.
+
+#include "test.h"
+
+#include "config.h"
+#include "display.h"
+#include "spi.h"
+
+#define MAX_PIXELS 100
+#define CANARY 0x5A
+
+static uint16_t allPixels[65536];
+static uint8_t allConverted[65536*SPI_BYTESPERPIXEL];
+static uint16_t pixels[MAX_PIXELS+1], prevPixels[MAX_PIXELS+1];
+static uint8_t converted[MAX_PIXELS*SPI_BYTESPERPIXEL + 64];
+
+static void ConvertPixelReference(uint16_t pixel, uint8_t *dst)
+{
+#ifdef DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2
+  const uint8_t r5 = pixel >> 11, g6 = (pixel >> 5) & 0x3F, b5 = pixel & 0x1F;
+  dst[0] = (uint8_t)((r5 << 3) | (r5 >> 2));
+  dst[1] = (uint8_t)(g6 << 2);
+  dst[2] = (uint8_t)((b5 << 3) | (b5 >> 2));
+#else
+  dst[0] = (uint8_t)(pixel >> 8);
+  dst[1] = (uint8_t)pixel;
+#endif
+}
+
+static void TestPixels(int numPixels, int offset, bool updatePrev)
+{
+  for(int i = 0; i < MAX_PIXELS+1; ++i) pixels[i] = (uint16_t)TestRandom();
+  memset(prevPixels, 0, sizeof(prevPixels));
+  memset(converted, CANARY, sizeof(converted));
+
+  CopyPixelsToSPITask(pixels + offset, updatePrev ? prevPixels + offset : 0, converted, numPixels);
+
+  uint8_t expected[SPI_BYTESPERPIXEL];
+  for(int i = 0; i < numPixels; ++i)
+  {
+    ConvertPixelReference(pixels[offset + i], expected);
+    CHECK(!memcmp(converted + i*SPI_BYTESPERPIXEL, expected, SPI_BYTESPERPIXEL));
+  }
+  for(size_t i = numPixels*SPI_BYTESPERPIXEL; i < sizeof(converted); ++i) CHECK_EQ(converted[i], CANARY);
+  for(int i = 0; i < MAX_PIXELS+1; ++i)
+    CHECK_EQ(prevPixels[i], (updatePrev && i >= offset && i < offset + numPixels) ? pixels[i] : 0);
+}
+
+int main()
+{
+  for(int i = 0; i < 65536; ++i) allPixels[i] = (uint16_t)i;
+  CopyPixelsToSPITask(allPixels, 0, allConverted, 65536);
+  uint8_t expected[SPI_BYTESPERPIXEL];
+  int numWrongPixels = 0;
+  for(int i = 0; i < 65536; ++i)
+  {
+    ConvertPixelReference((uint16_t)i, expected);
+    if (memcmp(allConverted + i*SPI_BYTESPERPIXEL, expected, SPI_BYTESPERPIXEL) && ++numWrongPixels <= 10)
+      fprintf(stderr, "Pixel 0x%04X is converted wrong\n", i);
+  }
+  CHECK_EQ(numWrongPixels, 0);
+
+  for(int round = 0; round < 10; ++round)
+    for(int numPixels = 0; numPixels <= MAX_PIXELS; ++numPixels)
+      for(int offset = 0; offset < 2; ++offset)
+      {
+        TestPixels(numPixels, offset, true);
+        TestPixels(numPixels, offset, false);
+      }
+  return TestResult();
+}
@@ -0,0 +1,74 @@
+// Times writing the pixels of a frame into SPI tasks the way SPI_TASK_QUEUE_IN_DMA_MEMORY does, with CopyPixelsToSPITaskWords() straight
+// to the task, against converting each scanline to a scanline buffer with CopyPixelsToSPITask() and memcpy()ing it to the task, which is
+// what the option did before. On the host the task memory is cached, so this only shows the cost of the conversion itself: on the Pi,
+// the task queue is uncached and the memcpy() pass of the old approach is what costs most.
+
+#include "test.h"
+
+#include "config.h"
+#include "display.h"
+#include "spi.h"
+#include "util.h"
+
+#define WIDTH 320
+#define HEIGHT 240
+#define NUM_FRAMES 50
+#define NUM_ROUNDS 20
+
+static uint16_t framebuffer[HEIGHT*WIDTH], prevFramebuffer[HEIGHT*WIDTH];
+static uint32_t task[(HEIGHT*WIDTH*SPI_BYTESPERPIXEL+3)/4 + 1];
+
+// Writes the frame as spans of spanHeight scanlines and spanWidth pixels each, starting at an odd x so that the source is not aligned
+static void CopyFrameWithScanlineBuffer(int spanWidth, int spanHeight)
+{
+  uint32_t scanlineBuffer[(WIDTH*SPI_BYTESPERPIXEL+3)/4];
+  for(int y0 = 0; y0 + spanHeight <= HEIGHT; y0 += spanHeight)
+    for(int x = 1; x + spanWidth <= WIDTH; x += spanWidth)
+    {
+      uint8_t *taskData = (uint8_t*)task;
+      for(int y = y0; y < y0 + spanHeight; ++y)
+      {
+        CopyPixelsToSPITask(framebuffer + y*WIDTH + x, prevFramebuffer + y*WIDTH + x, (uint8_t*)scanlineBuffer, spanWidth);
+        memcpy(taskData, scanlineBuffer, spanWidth*SPI_BYTESPERPIXEL);
+        taskData += spanWidth*SPI_BYTESPERPIXEL;
+      }
+    }
+}
+
+static void CopyFrameWithWords(int spanWidth, int spanHeight)
+{
+  for(int y0 = 0; y0 + spanHeight <= HEIGHT; y0 += spanHeight)
+    for(int x = 1; x + spanWidth <= WIDTH; x += spanWidth)
+    {
+      SPITaskWordWriter writer = { task, 0, 0 };
+      for(int y = y0; y < y0 + spanHeight; ++y)
+        CopyPixelsToSPITaskWords(framebuffer + y*WIDTH + x, prevFramebuffer + y*WIDTH + x, &writer, spanWidth);
+      FlushSPITaskWords(&writer);
+    }
+}
+
+// The host may be busy with other things, so report the fastest of several rounds of each
+static void Bench(const char *name, int spanWidth, int spanHeight)
+{
+  double scanlineBufferUsecs = 1e9, wordsUsecs = 1e9;
+  for(int round = 0; round < NUM_ROUNDS; ++round)
+  {
+    uint64_t t0 = TestTimeUsecs();
+    for(int i = 0; i < NUM_FRAMES; ++i) CopyFrameWithScanlineBuffer(spanWidth, spanHeight);
+    uint64_t t1 = TestTimeUsecs();
+    for(int i = 0; i < NUM_FRAMES; ++i) CopyFrameWithWords(spanWidth, spanHeight);
+    uint64_t t2 = TestTimeUsecs();
+    scanlineBufferUsecs = MIN(scanlineBufferUsecs, (double)(t1-t0)/NUM_FRAMES);
+    wordsUsecs = MIN(wordsUsecs, (double)(t2-t1)/NUM_FRAMES);
+  }
+  printf("%-28s scanline buffer + memcpy: %6.1f usecs/frame, aligned words: %6.1f usecs/frame\n", name, scanlineBufferUsecs, wordsUsecs);
+}
+
+int main()
+{
+  for(int i = 0; i < HEIGHT*WIDTH; ++i) framebuffer[i] = (uint16_t)TestRandom();
+  Bench("full width spans (319x1):", WIDTH-1, 1);
+  Bench("odd sized spans (37x5):", 37, 5);
+  Bench("narrow spans (7x3):", 7, 3);
+  return 0;
+}
@@ -0,0 +1,65 @@
+// Tests that CopyPixelsToSPITaskWords() writes the same bytes as CopyPixelsToSPITask() when the scanlines of a span are written back to
+// back, with every alignment of the source pixels and every number of pixels left over at the ends of the scanlines, and that it updates
+// the previous framebuffer the same way and does not write past the last word of the span.
+
+#include "test.h"
+
+#include "config.h"
+#include "display.h"
+#include "spi.h"
+
+#define MAX_SCANLINES 5
+#define MAX_WIDTH 41
+#define CANARY 0xDEADBEEFU
+
+static uint16_t pixels[MAX_SCANLINES*(MAX_WIDTH+1)];
+static uint16_t prevReference[MAX_SCANLINES*(MAX_WIDTH+1)], prevWords[MAX_SCANLINES*(MAX_WIDTH+1)];
+static uint8_t reference[MAX_SCANLINES*MAX_WIDTH*SPI_BYTESPERPIXEL];
+static uint32_t words[(MAX_SCANLINES*MAX_WIDTH*SPI_BYTESPERPIXEL+3)/4 + 4];
+
+static void TestSpan(int numScanlines, const int *widths, int offset, bool updatePrev)
+{
+  for(size_t i = 0; i < sizeof(pixels)/sizeof(pixels[0]); ++i) pixels[i] = (uint16_t)TestRandom();
+  memset(prevReference, 0, sizeof(prevReference));
+  memset(prevWords, 0, sizeof(prevWords));
+  for(size_t i = 0; i < sizeof(words)/sizeof(words[0]); ++i) words[i] = CANARY;
+
+  uint8_t *data = reference;
+  SPITaskWordWriter writer = { words, 0, 0 };
+  for(int y = 0; y < numScanlines; ++y)
+  {
+    const int start = y*(MAX_WIDTH+1) + offset;
+    CopyPixelsToSPITask(pixels + start, updatePrev ? prevReference + start : 0, data, widths[y]);
+    data += widths[y] * SPI_BYTESPERPIXEL;
+    CopyPixelsToSPITaskWords(pixels + start, updatePrev ? prevWords + start : 0, &writer, widths[y]);
+  }
+  FlushSPITaskWords(&writer);
+
+  const int bytes = (int)(data - reference);
+  const int numWords = (bytes + 3) / 4;
+  CHECK_EQ(writer.dst - words, numWords);
+  CHECK(!memcmp(words, reference, bytes));
+  for(size_t i = numWords; i < sizeof(words)/sizeof(words[0]); ++i) CHECK_EQ(words[i], CANARY);
+  CHECK(!memcmp(prevWords, prevReference, sizeof(prevWords)));
+}
+
+int main()
+{
+  int widths[MAX_SCANLINES];
+  // All single scanline widths, and all pairs of widths on two scanlines, at both alignments of the source pixels
+  for(int offset = 0; offset < 2; ++offset)
+    for(widths[0] = 0; widths[0] <= MAX_WIDTH; ++widths[0])
+    {
+      TestSpan(1, widths, offset, true);
+      for(widths[1] = 0; widths[1] <= MAX_WIDTH; ++widths[1])
+        TestSpan(2, widths, offset, true);
+    }
+  // Random spans of several scanlines, both with and without updating the previous framebuffer
+  for(int i = 0; i < 2000; ++i)
+  {
+    const int numScanlines = TestRandomRange(1, MAX_SCANLINES);
+    for(int y = 0; y < numScanlines; ++y) widths[y] = TestRandomRange(0, MAX_WIDTH);
+    TestSpan(numScanlines, widths, TestRandomRange(0, 1), (i & 1) != 0);
+  }
+  return TestResult();
+}
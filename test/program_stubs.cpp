@@ -0,0 +1,7 @@
+// The state that fbcp-ili9341.cpp owns for the other source files, for the test programs that link against the program sources without main().
+#include <inttypes.h>
+
+uint64_t displayContentsLastChanged = 0;
+bool displayOff = false;
+
+volatile bool programRunning = true;
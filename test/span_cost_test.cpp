@@ -0,0 +1,15 @@
+// Checks that the SPI bus cost model of diff.h gives the calibrated span merge threshold for the display and DMA configuration that this
+// test is compiled with.
+
+#include "test.h"
+#include "config.h"
+#include "display.h"
+#include "diff.h"
+
+int main()
+{
+  CHECK_EQ(SPAN_MERGE_THRESHOLD, EXPECTED_SPAN_MERGE_THRESHOLD);
+  // Submitting a span must cost more than sending its pixels alone
+  CHECK(SPAN_COST_CURSOR_MOVE_TASK > 0 && SPAN_COST_SET_WINDOW_TASK >= SPAN_COST_CURSOR_MOVE_TASK && SPAN_COST_WRITE_PIXELS_TASK > 0);
+  return TestResult();
+}
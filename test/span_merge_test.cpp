@@ -0,0 +1,79 @@
+// Tests MergeScanlineSpanList(): spans on the same scanline are merged exactly when the gap between them is at most SPAN_MERGE_THRESHOLD
+// pixels, and merging the spans of random diffs never loses a changed pixel or increases the predicted SPI bus cost of the frame.
+
+#include "diff_reference.h"
+#include "spi.h"
+
+// The cost model of PredictSpanSubmitCost() in diff.cpp
+static int SpanCost(const Span *span)
+{
+  return SPAN_COST_CURSOR_MOVE_TASK + ((span->endY > span->y+1) ? SPAN_COST_SET_WINDOW_TASK : SPAN_COST_CURSOR_MOVE_TASK) + SPAN_COST_WRITE_PIXELS_TASK + span->size*SPI_BYTESPERPIXEL;
+}
+
+static int SpanListCost(const Span *head)
+{
+  int cost = 0;
+  for(; head; head = head->next) cost += SpanCost(head);
+  return cost;
+}
+
+static bool SpanCoversPixel(const Span *span, int x, int y)
+{
+  if (y < span->y || y >= span->endY || x < span->x) return false;
+  return x < ((y == span->endY-1) ? span->lastScanEndX : span->endX);
+}
+
+static void TestMergeGap(int gap)
+{
+  Span list[2] = {};
+  list[0].x = 10; list[0].endX = list[0].lastScanEndX = 20; list[0].y = 5; list[0].endY = 6; list[0].size = 10; list[0].next = &list[1];
+  list[1].x = 20 + gap; list[1].endX = list[1].lastScanEndX = 30 + gap; list[1].y = 5; list[1].endY = 6; list[1].size = 10; list[1].next = 0;
+  MergeScanlineSpanList(list);
+  if (gap <= SPAN_MERGE_THRESHOLD)
+  {
+    CHECK(list[0].next == 0);
+    CHECK_EQ(list[0].endX, 30 + gap);
+    CHECK_EQ(list[0].size, 20 + gap);
+  }
+  else
+    CHECK(list[0].next == &list[1]);
+}
+
+int main()
+{
+  for(int gap = 0; gap <= SPAN_MERGE_THRESHOLD + 2; ++gap)
+    TestMergeGap(gap);
+
+  uint16_t *framebuffer = 0, *prevFramebuffer = 0;
+  SetTestFrameSize(320, 240, 0, &framebuffer, &prevFramebuffer);
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  for(int i = 0; i < 300; ++i)
+  {
+    memcpy(framebuffer, prevFramebuffer, gpuFramebufferSizeBytes);
+    RandomlyChangeFramebuffer(framebuffer, TestRandomRange(1, 1 + gpuFrameHeight * (i % 4)));
+    Span *head = 0;
+    DiffFramebuffersToScanlineSpansExact(framebuffer, prevFramebuffer, false, 0, head);
+    int costBefore = SpanListCost(head);
+    MergeScanlineSpanList(head);
+    CHECK(SpanListCost(head) <= costBefore);
+
+    static uint8_t covered[320*240];
+    memset(covered, 0, sizeof(covered));
+    for(Span *s = head; s; s = s->next)
+    {
+      CHECK(s->x < s->endX && s->lastScanEndX <= s->endX && s->y < s->endY && s->endY <= gpuFrameHeight);
+      CHECK_EQ(s->size, (s->endX - s->x)*(s->endY - s->y - 1) + (s->lastScanEndX - s->x));
+      CHECK(s->size*SPI_BYTESPERPIXEL <= MAX_SPI_TASK_SIZE);
+      if (s->next) CHECK(s->next->y >= s->y);
+      for(int y = s->y; y < s->endY; ++y)
+        for(int x = s->x; x < s->endX; ++x)
+          if (SpanCoversPixel(s, x, y)) covered[y*gpuFrameWidth + x] = 1;
+    }
+    for(int y = 0; y < gpuFrameHeight; ++y)
+      for(int x = 0; x < gpuFrameWidth; ++x)
+        if (framebuffer[y*stride + x] != prevFramebuffer[y*stride + x])
+          CHECK(covered[y*gpuFrameWidth + x]);
+    memcpy(prevFramebuffer, framebuffer, gpuFramebufferSizeBytes);
+  }
+  return TestResult();
+}
@@ -0,0 +1,98 @@
+// Tests the expansion of tasks to the 32-bit words of displays with SPI_32BIT_COMMANDS (KeDei v6.3), where each 16-bit data word goes out
+// in the high half of a 32-bit word with the data framing in the low half. Interleave16BitSPITaskTo32Bit() and ExpandPixelsTo32BitSPITask()
+// are compared against a scalar reference for every number of words up to several bulk blocks, at both alignments of the source pixels.
+// Pixel tasks expanded at capture time must also match the older path of copying the pixels to the task and expanding it on commit.
+
+#include "test.h"
+
+#include "config.h"
+#include "display.h"
+#include "spi.h"
+
+#define MAX_WORDS 100
+#define CANARY 0xDEADBEEFU
+#define CANARY_BYTE 0x5A
+
+static uint32_t taskMemory[(sizeof(SPITask) + MAX_WORDS*2 + MAX_WORDS*4 + 64) / 4];
+static uint32_t reference[MAX_WORDS + 1];
+static uint32_t expanded[MAX_WORDS + 8];
+static uint16_t pixels[MAX_WORDS + 1], prevReference[MAX_WORDS + 1], prevExpanded[MAX_WORDS + 1];
+
+static uint32_t DataWordReference(uint16_t word)
+{
+  return 0x1500 | ((uint32_t)word << 16);
+}
+
+// Sets up a task with room for numDataBytes of 16-bit data followed by its 32-bit expansion, like AllocTask() does
+static SPITask *PrepareTask(uint32_t numDataBytes)
+{
+  memset(taskMemory, CANARY_BYTE, sizeof(taskMemory));
+  SPITask *task = (SPITask *)taskMemory;
+  task->sizeExpandedTaskWithPadding = NumBytesNeededFor32BitSPITask(numDataBytes) + SPI_9BIT_TASK_PADDING_BYTES;
+  task->size = numDataBytes + task->sizeExpandedTaskWithPadding;
+  task->cmd = DISPLAY_WRITE_PIXELS;
+  return task;
+}
+
+static void CheckCanaries(SPITask *task)
+{
+  // The 16-bit data before the expanded task is not necessarily a multiple of 4 bytes, so the end of the task is not word aligned
+  const uint8_t *end = (const uint8_t *)taskMemory + sizeof(taskMemory);
+  for(const uint8_t *p = task->PayloadEnd(); p < end; ++p)
+    if (*p != CANARY_BYTE)
+    {
+      CHECK_EQ(*p, CANARY_BYTE);
+      break;
+    }
+}
+
+// Command tasks, e.g. the cursor and window commands, are expanded on commit
+static void TestCommandTask(uint32_t numWords)
+{
+  SPITask *task = PrepareTask(numWords*2);
+  task->cmd = TestRandom();
+  uint16_t *data = (uint16_t *)task->data;
+  for(uint32_t i = 0; i < numWords; ++i) data[i] = (uint16_t)TestRandom();
+  reference[0] = task->cmd;
+  for(uint32_t i = 0; i < numWords; ++i) reference[i+1] = DataWordReference(data[i]);
+
+  Interleave16BitSPITaskTo32Bit(task);
+
+  CHECK_EQ(task->PayloadSize(), (numWords+1)*4);
+  CHECK(!memcmp(task->PayloadStart(), reference, (numWords+1)*4));
+  CheckCanaries(task);
+}
+
+// Pixel tasks are expanded from the framebuffer at capture time, converting the pixels to big endian on the way
+static void TestPixels(uint32_t numPixels, int offset)
+{
+  for(uint32_t i = 0; i < MAX_WORDS + 1; ++i) pixels[i] = (uint16_t)TestRandom();
+  memset(prevReference, 0, sizeof(prevReference));
+  memset(prevExpanded, 0, sizeof(prevExpanded));
+  for(size_t i = 0; i < sizeof(expanded)/sizeof(expanded[0]); ++i) expanded[i] = CANARY;
+
+  ExpandPixelsTo32BitSPITask(pixels + offset, prevExpanded + offset, expanded, numPixels);
+
+  for(uint32_t i = 0; i < numPixels; ++i) CHECK_EQ(expanded[i], DataWordReference(__builtin_bswap16(pixels[offset + i])));
+  for(size_t i = numPixels; i < sizeof(expanded)/sizeof(expanded[0]); ++i) CHECK_EQ(expanded[i], CANARY);
+
+  // The same words as copying the pixels to a 16-bit task and expanding the whole task
+  SPITask *task = PrepareTask(numPixels*2);
+  CopyPixelsToSPITask(pixels + offset, prevReference + offset, task->data, numPixels);
+  Interleave16BitSPITaskTo32Bit(task);
+  CHECK(!memcmp((uint32_t *)task->PayloadStart() + 1, expanded, numPixels*4));
+  CHECK(!memcmp(prevExpanded, prevReference, sizeof(prevExpanded)));
+  CheckCanaries(task);
+}
+
+int main()
+{
+  for(int round = 0; round < 20; ++round)
+    for(uint32_t n = 0; n <= MAX_WORDS; ++n)
+    {
+      TestCommandTask(n);
+      TestPixels(n, 0);
+      TestPixels(n, 1);
+    }
+  return TestResult();
+}
@@ -0,0 +1,63 @@
+// Tests that Interleave8BitSPITaskTo9Bit() expands the tasks of 3-wire SPI displays to the same bits as a plain bit by bit reference, for
+// every task size up to several bulk blocks, so that every number of data bytes left over after the bulk loops is covered. Bytes past the
+// expanded task must be left alone.
+
+#include "test.h"
+
+#include "config.h"
+#include "display.h"
+#include "spi.h"
+
+#define MAX_DATA_BYTES 300
+#define CANARY 0x5A
+
+static uint32_t taskMemory[(sizeof(SPITask) + MAX_DATA_BYTES*3 + 64) / 4];
+static uint8_t reference[MAX_DATA_BYTES*2 + 16];
+
+// Writes the command as a 9-bit symbol with a low data/command bit, followed by each data byte as a 9-bit symbol with a high data/command
+// bit, most significant bit first, and pads the result with zero bits to outBytes.
+static void Interleave9BitReference(uint8_t cmd, const uint8_t *data, uint32_t numDataBytes, uint8_t *out, uint32_t outBytes)
+{
+  memset(out, 0, outBytes);
+  uint32_t bit = 0;
+  for(uint32_t i = 0; i <= numDataBytes; ++i)
+  {
+    const uint32_t symbol = (i == 0) ? cmd : (0x100 | data[i-1]);
+    for(int b = 8; b >= 0; --b, ++bit)
+      if (symbol & (1u << b)) out[bit >> 3] |= 0x80 >> (bit & 7);
+  }
+}
+
+static void TestTask(uint32_t numDataBytes)
+{
+  const uint32_t expandedBytes = NumBytesNeededFor9BitSPITask(numDataBytes);
+  SPITask *task = (SPITask *)taskMemory;
+  memset(taskMemory, CANARY, sizeof(taskMemory));
+  task->size = numDataBytes + expandedBytes + SPI_9BIT_TASK_PADDING_BYTES;
+  task->sizeExpandedTaskWithPadding = expandedBytes + SPI_9BIT_TASK_PADDING_BYTES;
+  task->cmd = (uint8_t)TestRandom();
+  for(uint32_t i = 0; i < numDataBytes; ++i) task->data[i] = (uint8_t)TestRandom();
+
+  Interleave8BitSPITaskTo9Bit(task);
+
+  CHECK_EQ(task->PayloadSize(), expandedBytes);
+  CHECK_EQ(expandedBytes*8 % 72, 0);
+  CHECK(expandedBytes*8 >= (numDataBytes+1)*9);
+  Interleave9BitReference(task->cmd, task->data, numDataBytes, reference, expandedBytes);
+  CHECK(!memcmp(task->PayloadStart(), reference, expandedBytes));
+  const uint8_t *end = (const uint8_t *)taskMemory + sizeof(taskMemory);
+  for(const uint8_t *p = task->data + task->size; p < end; ++p)
+    if (*p != CANARY)
+    {
+      CHECK_EQ(*p, CANARY);
+      break;
+    }
+}
+
+int main()
+{
+  for(int round = 0; round < 20; ++round)
+    for(uint32_t numDataBytes = 0; numDataBytes <= MAX_DATA_BYTES; ++numDataBytes)
+      TestTask(numDataBytes);
+  return TestResult();
+}
@@ -0,0 +1,111 @@
+// Stress tests the SPI task queue with the main thread side (AllocTask(), CommitTask() and task batches) and the SPI thread side
+// (GetTask() and DoneTask()) on separate threads. The producer queues tasks of random sizes, so that the queue keeps wrapping around
+// and filling up, both one by one and in batches delimited by frame markers. The consumer checks that it receives every task in order
+// and intact. Build with -DFBCP_TEST_TSAN=ON to have ThreadSanitizer check the memory ordering of the queue as well.
+
+#include "test.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "config.h"
+#include "spi.h"
+#include "util.h"
+
+#define NUM_TASKS 200000
+
+static volatile bool producerDone = false;
+static uint32_t numTasksReceived = 0;
+
+static uint8_t TaskCommand(uint32_t taskNumber)
+{
+  return (uint8_t)(taskNumber % 255 + 1); // cmd=0 is reserved for frame markers and the end of buffer sentinel
+}
+
+static uint8_t TaskByte(uint32_t taskNumber, uint32_t i)
+{
+  return (uint8_t)(taskNumber * 31 + i);
+}
+
+static void *ConsumerThread(void *)
+{
+  for(;;)
+  {
+    // The producer has published all of its tasks before it is done, so if the queue is empty after that, there are no more tasks to come
+    const bool done = __atomic_load_n(&producerDone, __ATOMIC_ACQUIRE);
+    SPITask *task = GetTask();
+    if (!task)
+    {
+      // Like the SPI thread, report the frames done once the queue has been emptied
+      SignalFramesDone();
+      if (done) break;
+      sched_yield();
+      continue;
+    }
+    uint32_t taskNumber;
+    CHECK(task->size >= sizeof(taskNumber));
+    memcpy(&taskNumber, task->data, sizeof(taskNumber));
+    CHECK_EQ(taskNumber, numTasksReceived);
+    CHECK_EQ(task->cmd, TaskCommand(taskNumber));
+    for(uint32_t i = sizeof(taskNumber); i < task->size; ++i)
+      if (task->data[i] != TaskByte(taskNumber, i))
+      {
+        CHECK_EQ(task->data[i], TaskByte(taskNumber, i));
+        break;
+      }
+    ++numTasksReceived;
+    DoneTask(task);
+  }
+  return 0;
+}
+
+static void QueueTestTask(uint32_t taskNumber)
+{
+  // Mostly small tasks like the cursor and window commands, and now and then large pixel tasks
+  uint32_t size = (TestRandom() % 8 == 0) ? TestRandomRange(1000, SPI_QUEUE_SIZE/8) : TestRandomRange(4, 64);
+  SPITask *task = AllocTask(size);
+  task->cmd = TaskCommand(taskNumber);
+  memcpy(task->data, &taskNumber, sizeof(taskNumber));
+  for(uint32_t i = sizeof(taskNumber); i < size; ++i)
+    task->data[i] = TaskByte(taskNumber, i);
+  CommitTask(task);
+}
+
+int main()
+{
+  spiTaskMemory = (SharedMemory *)calloc(1, SHARED_MEMORY_SIZE);
+  spiTaskBatch.tail = spiTaskMemory->queueTail;
+
+  pthread_t consumer;
+  pthread_create(&consumer, 0, ConsumerThread, 0);
+
+  uint32_t taskNumber = 0, frameNumber = 0;
+  while(taskNumber < NUM_TASKS)
+  {
+    const int batchSize = TestRandomRange(1, 40);
+    const int numTasks = MIN(batchSize, NUM_TASKS - (int)taskNumber);
+    if (TestRandom() % 4 == 0)
+    {
+      // Tasks handed over one by one, as single threaded builds do
+      for(int i = 0; i < numTasks; ++i) QueueTestTask(taskNumber++);
+      continue;
+    }
+    // A frame of tasks, handed over at once in the end like the main loop does
+    SPIFrameMarker marker = {};
+    marker.frameNumber = ++frameNumber;
+    BeginTaskBatch();
+    QueueFrameMarker(&marker);
+    for(int i = 0; i < numTasks; ++i) QueueTestTask(taskNumber++);
+    marker.end = 1;
+    QueueFrameMarker(&marker);
+    EndTaskBatch();
+  }
+  __atomic_store_n(&producerDone, true, __ATOMIC_RELEASE);
+  pthread_join(consumer, 0);
+
+  CHECK_EQ(numTasksReceived, NUM_TASKS);
+  CHECK_EQ(spiTaskMemory->queueHead, spiTaskMemory->queueTail);
+  CHECK_EQ(spiTaskMemory->spiBytesQueued, 0);
+  CHECK_EQ(spiTaskMemory->framesDone, frameNumber);
+  return TestResult();
+}
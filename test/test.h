@@ -0,0 +1,54 @@
+#pragma once
+
+// Minimal helpers shared by the host side tests. The tests are plain programs that return nonzero if any CHECK fails.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static int numFailedChecks = 0;
+
+#define CHECK(cond) do { if (!(cond)) { ++numFailedChecks; if (numFailedChecks <= 20) fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); } } while(0)
+
+#define CHECK_EQ(a, b) do { long long a_ = (long long)(a), b_ = (long long)(b); if (a_ != b_) { ++numFailedChecks; if (numFailedChecks <= 20) fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__, __LINE__, #a, #b, a_, b_); } } while(0)
+
+static inline int TestResult()
+{
+  if (numFailedChecks) fprintf(stderr, "%d checks failed\n", numFailedChecks);
+  else printf("All checks passed\n");
+  return numFailedChecks ? 1 : 0;
+}
+
+// xorshift, so that the tests produce the same sequence on every host
+static uint32_t testRandomState = 1;
+static inline uint32_t TestRandom()
+{
+  testRandomState ^= testRandomState << 13;
+  testRandomState ^= testRandomState >> 17;
+  testRandomState ^= testRandomState << 5;
+  return testRandomState;
+}
+
+// Returns a random integer in [lo, hi]
+static inline int TestRandomRange(int lo, int hi)
+{
+  return lo + (int)(TestRandom() % (uint32_t)(hi - lo + 1));
+}
+
+static inline uint64_t TestTimeUsecs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Allocates a framebuffer of the given stride, aligned like the framebuffers of the program.
+static inline uint16_t *TestAllocFramebuffer(int strideBytes, int height)
+{
+  void *ptr = 0;
+  if (posix_memalign(&ptr, 32, strideBytes * height)) abort();
+  memset(ptr, 0, strideBytes * height);
+  return (uint16_t *)ptr;
+}
@@ -0,0 +1,70 @@
+// Tests that the spans of DiffFramebuffersToTiledSpans() cover all changed pixels with whole tiles, and that there are never more of them
+// than MaxNumTiledDiffSpans(). The tile bitmap of diff.cpp is sized on first use, so each run tests a single frame size, given on the
+// command line.
+
+#include "diff_reference.h"
+
+static uint16_t *framebuffer = 0, *prevFramebuffer = 0;
+
+static int TestTiledDiff(bool interlacedDiff, int interlacedFieldParity)
+{
+  Span *head = 0;
+  DiffFramebuffersToTiledSpans(framebuffer, prevFramebuffer, interlacedDiff, interlacedFieldParity, head);
+
+  static uint8_t covered[1024*1024];
+  memset(covered, 0, gpuFrameWidth*gpuFrameHeight);
+  int numSpans = 0;
+  for(Span *i = head; i; i = i->next, ++numSpans)
+  {
+    CHECK(i->x % DIFF_TILE_SIZE == 0);
+    CHECK(i->endX % DIFF_TILE_SIZE == 0 || i->endX == gpuFrameWidth);
+    CHECK(i->x < i->endX && i->endX <= gpuFrameWidth && i->y < i->endY && i->endY <= gpuFrameHeight);
+    CHECK(i->size == (uint32_t)((i->endX - i->x) * (i->endY - i->y)));
+    if (interlacedDiff) CHECK(i->endY == i->y + 1 && (i->y & 1) == interlacedFieldParity);
+    for(int y = i->y; y < i->endY; ++y)
+      for(int x = i->x; x < i->endX; ++x)
+        covered[y*gpuFrameWidth + x] = 1;
+  }
+  CHECK(numSpans <= MaxNumTiledDiffSpans());
+
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  for(int y = interlacedDiff ? interlacedFieldParity : 0; y < gpuFrameHeight; y += interlacedDiff ? 2 : 1)
+    for(int x = 0; x < gpuFrameWidth; ++x)
+      if (framebuffer[y*stride + x] != prevFramebuffer[y*stride + x])
+        CHECK(covered[y*gpuFrameWidth + x]);
+  return numSpans;
+}
+
+static void TestAllFields()
+{
+  TestTiledDiff(false, 0);
+  TestTiledDiff(true, 0);
+  TestTiledDiff(true, 1);
+}
+
+int main(int argc, char **argv)
+{
+  SetTestFrameSize(argc > 2 ? atoi(argv[1]) : 320, argc > 2 ? atoi(argv[2]) : 240, 0, &framebuffer, &prevFramebuffer);
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+
+  for(int i = 0; i < 200; ++i)
+  {
+    memcpy(framebuffer, prevFramebuffer, gpuFramebufferSizeBytes);
+    RandomlyChangeFramebuffer(framebuffer, TestRandomRange(0, 1 + gpuFrameHeight * (i % 4)));
+    TestAllFields();
+    memcpy(prevFramebuffer, framebuffer, gpuFramebufferSizeBytes);
+  }
+
+  // The worst case: every second tile changes on every scanline
+  for(int y = 0; y < gpuFrameHeight; ++y)
+    for(int x = 0; x < gpuFrameWidth; x += 2*DIFF_TILE_SIZE)
+      framebuffer[y*stride + x] = ~prevFramebuffer[y*stride + x];
+  TestAllFields();
+#ifdef NO_INTERLACING
+  CHECK_EQ(TestTiledDiff(false, 0), MaxNumTiledDiffSpans());
+#else
+  CHECK_EQ(TestTiledDiff(true, 0), MaxNumTiledDiffSpans());
+#endif
+
+  return TestResult();
+}
@@ -0,0 +1,53 @@
+// Times transposing a captured 320x240 landscape frame to the 240x320 portrait panel with TransposeFramebuffer(), which goes through the
+// frame in 8x8 blocks, against a plain pixel by pixel transpose that strides through the whole source frame for each scanline it writes.
+// Both are timed with and without hashing the transposed scanlines, like SnapshotFramebuffer() does.
+
+#include "test.h"
+
+#include "config.h"
+#include "display.h"
+#include "gpu.h"
+#include "util.h"
+
+#define SRC_WIDTH 320
+#define SRC_HEIGHT 240
+#define NUM_FRAMES 50
+#define NUM_ROUNDS 20
+
+static uint16_t src[SRC_HEIGHT*SRC_WIDTH], dst[SRC_WIDTH*SRC_HEIGHT];
+static uint64_t hashes[SRC_WIDTH];
+
+static void TransposePixelByPixel(const uint16_t *src, int srcStride, uint16_t *destination, int dstStride, int width, int height, uint64_t *scanlineHashes)
+{
+  for(int y = 0; y < height; ++y)
+  {
+    for(int x = 0; x < width; ++x)
+      destination[y*dstStride+x] = src[x*srcStride+y];
+    if (scanlineHashes) scanlineHashes[y] = HashScanline(destination + y*dstStride, width);
+  }
+}
+
+// The host may be busy with other things, so report the fastest of several rounds of each
+static void Bench(const char *name, uint64_t *scanlineHashes)
+{
+  double pixelUsecs = 1e9, blockUsecs = 1e9;
+  for(int round = 0; round < NUM_ROUNDS; ++round)
+  {
+    uint64_t t0 = TestTimeUsecs();
+    for(int i = 0; i < NUM_FRAMES; ++i) TransposePixelByPixel(src, SRC_WIDTH, dst, SRC_HEIGHT, SRC_HEIGHT, SRC_WIDTH, scanlineHashes);
+    uint64_t t1 = TestTimeUsecs();
+    for(int i = 0; i < NUM_FRAMES; ++i) TransposeFramebuffer(src, SRC_WIDTH, dst, SRC_HEIGHT, SRC_HEIGHT, SRC_WIDTH, scanlineHashes);
+    uint64_t t2 = TestTimeUsecs();
+    pixelUsecs = MIN(pixelUsecs, (double)(t1-t0)/NUM_FRAMES);
+    blockUsecs = MIN(blockUsecs, (double)(t2-t1)/NUM_FRAMES);
+  }
+  printf("%-20s pixel by pixel: %6.1f usecs/frame, 8x8 blocks: %6.1f usecs/frame\n", name, pixelUsecs, blockUsecs);
+}
+
+int main()
+{
+  for(int i = 0; i < SRC_HEIGHT*SRC_WIDTH; ++i) src[i] = (uint16_t)TestRandom();
+  Bench("transpose:", 0);
+  Bench("transpose + hash:", hashes);
+  return 0;
+}
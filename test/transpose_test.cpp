@@ -0,0 +1,46 @@
+// Tests that TransposeFramebuffer() writes every pixel of the captured frame to the transposed position, like a plain pixel by pixel
+// transpose, and the same scanline hashes as HashScanline() of the transposed scanlines. All sizes up to a few 8x8 blocks in both directions
+// are covered, so that every number of pixels left over after the blocks is, and strides with padding after each scanline, which must not
+// be written.
+
+#include "test.h"
+
+#include "config.h"
+#include "display.h"
+#include "gpu.h"
+
+#define MAX_SIZE 27
+#define CANARY 0xA5A5
+
+static uint16_t src[(MAX_SIZE+5)*(MAX_SIZE+5)], dst[(MAX_SIZE+7)*(MAX_SIZE+7)];
+static uint64_t hashes[MAX_SIZE+7];
+
+static void TestTranspose(int width, int height, int srcPadding, int dstPadding, bool hash)
+{
+  const int srcStride = height + srcPadding, dstStride = width + dstPadding;
+  for(size_t i = 0; i < sizeof(src)/sizeof(src[0]); ++i) src[i] = (uint16_t)TestRandom();
+  for(size_t i = 0; i < sizeof(dst)/sizeof(dst[0]); ++i) dst[i] = CANARY;
+  for(int i = 0; i < MAX_SIZE+7; ++i) hashes[i] = 0;
+
+  TransposeFramebuffer(src, srcStride, dst, dstStride, width, height, hash ? hashes : 0);
+
+  for(int y = 0; y < height; ++y)
+  {
+    for(int x = 0; x < width; ++x) CHECK_EQ(dst[y*dstStride + x], src[x*srcStride + y]);
+    for(int x = width; x < dstStride; ++x) CHECK_EQ(dst[y*dstStride + x], CANARY);
+    CHECK_EQ(hashes[y], hash ? HashScanline(dst + y*dstStride, width) : 0);
+  }
+  for(size_t i = height*dstStride; i < sizeof(dst)/sizeof(dst[0]); ++i) CHECK_EQ(dst[i], CANARY);
+  for(int i = height; i < MAX_SIZE+7; ++i) CHECK_EQ(hashes[i], 0);
+}
+
+int main()
+{
+  for(int width = 1; width <= MAX_SIZE; ++width)
+    for(int height = 1; height <= MAX_SIZE; ++height)
+    {
+      TestTranspose(width, height, 0, 0, true);
+      TestTranspose(width, height, TestRandomRange(1, 5), TestRandomRange(1, 7), (width + height) & 1);
+    }
+  return TestResult();
+}
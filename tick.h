@@ -6,7 +6,14 @@
 
 // Initialized in spi.cpp along with the rest of the BCM2835 peripheral:
 extern volatile uint64_t *systemTimerRegister;
+
+#ifdef SIMULATE_PERIPHERALS
+#include <time.h>
+// There is no BCM2835 system timer to read when the peripherals are simulated, so read the monotonic clock in usecs instead
+static inline uint64_t tick() { timespec t; clock_gettime(CLOCK_MONOTONIC, &t); return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000; }
+#else
 #define tick() (*systemTimerRegister)
+#endif
 
 #endif
 
@@ -0,0 +1,166 @@
+#include "config.h"
+#include "vertical_scroll.h"
+
+#ifdef DISPLAY_VERTICAL_SCROLL_DETECTION
+
+#include "spi.h"
+#include "util.h"
+#include "mem_alloc.h"
+
+#include <memory.h>
+#include <stdio.h>
+
+int displayScrollOffset = 0;
+
+// Hashes of each scanline of the current and the previous framebuffer
+static uint32_t *rowHashes = 0;
+static uint32_t *prevRowHashes = 0;
+// If true, prevRowHashes is up to date with the contents of the previous framebuffer, and does not need to be recomputed
+static bool prevRowHashesValid = false;
+
+// Don't bother scrolling unless it saves repainting at least this many scanlines
+#define MIN_SCANLINES_SAVED_BY_SCROLLING (gpuFrameHeight / 8)
+// Max number of scanlines to search for a vertical displacement, both up and down
+#define MAX_SCROLL_DISTANCE (gpuFrameHeight / 2)
+// Number of scanlines to look up from the previous frame to find candidate displacements
+#define NUM_SCROLL_PROBES 8
+
+void InitVerticalScroll()
+{
+  rowHashes = (uint32_t*)Malloc(gpuFrameHeight * sizeof(uint32_t), "vertical_scroll.cpp row hashes");
+  prevRowHashes = (uint32_t*)Malloc(gpuFrameHeight * sizeof(uint32_t), "vertical_scroll.cpp prev row hashes");
+
+  // Scroll only the area of the display that the framebuffer is drawn to, and leave the letterboxed borders above and below it fixed
+  int topFixedArea = displayYOffset;
+  int scrollArea = gpuFrameHeight;
+  int bottomFixedArea = DISPLAY_SCROLL_MEMORY_HEIGHT - topFixedArea - scrollArea;
+  QUEUE_SPI_TRANSFER(0x33/*VSCRDEF: Vertical Scrolling Definition*/, (uint8_t)(topFixedArea >> 8), (uint8_t)(topFixedArea & 0xFF), (uint8_t)(scrollArea >> 8), (uint8_t)(scrollArea & 0xFF), (uint8_t)(bottomFixedArea >> 8), (uint8_t)(bottomFixedArea & 0xFF));
+  QUEUE_SPI_TRANSFER(0x37/*VSCRSADD: Vertical Scrolling Start Address*/, (uint8_t)(topFixedArea >> 8), (uint8_t)(topFixedArea & 0xFF));
+  displayScrollOffset = 0;
+  printf("Vertical scroll detection enabled, scrolling display scanlines %d-%d\n", topFixedArea, topFixedArea + scrollArea - 1);
+}
+
+static void HashScanlines(uint16_t *framebuffer, uint32_t *hashes)
+{
+  const int stride = gpuFramebufferScanlineStrideBytes >> 1;
+  for(int y = 0; y < gpuFrameHeight; ++y, framebuffer += stride)
+  {
+    // FNV-1a over the pixels of the scanline, two pixels at a time
+    uint32_t hash = 2166136261u;
+    int x = 0;
+    for(; x + 2 <= gpuFrameWidth; x += 2)
+      hash = (hash ^ *(uint32_t*)(framebuffer + x)) * 16777619u;
+    if (x < gpuFrameWidth)
+      hash = (hash ^ framebuffer[x]) * 16777619u;
+    hashes[y] = hash;
+  }
+}
+
+// Returns the net number of scanlines that would not need to be repainted if the display was scrolled up by dy scanlines
+static int ScanlinesSavedByScrolling(int dy)
+{
+  int saved = 0;
+  for(int y = 0; y < gpuFrameHeight; ++y)
+  {
+    bool matchesWithoutScroll = (rowHashes[y] == prevRowHashes[y]);
+    bool matchesWithScroll = (y + dy >= 0 && y + dy < gpuFrameHeight && rowHashes[y] == prevRowHashes[y + dy]);
+    saved += (int)matchesWithScroll - (int)matchesWithoutScroll;
+  }
+  return saved;
+}
+
+int DetectVerticalScroll(uint16_t *framebuffer, uint16_t *prevFramebuffer)
+{
+  HashScanlines(framebuffer, rowHashes);
+  if (!prevRowHashesValid)
+    HashScanlines(prevFramebuffer, prevRowHashes);
+
+  // Find candidate displacements by looking up where some of the changed scanlines of the current frame were in the previous frame.
+  // Skip scanlines that are identical to the scanline above them, since flat areas would match at any displacement.
+  int candidates[NUM_SCROLL_PROBES];
+  int numCandidates = 0;
+  for(int i = 0; i < NUM_SCROLL_PROBES; ++i)
+  {
+    int y = (2*i + 1) * gpuFrameHeight / (2*NUM_SCROLL_PROBES);
+    if (y == 0 || rowHashes[y] == prevRowHashes[y] || rowHashes[y] == rowHashes[y-1])
+      continue;
+
+    for(int d = 1; d <= MAX_SCROLL_DISTANCE; ++d)
+    {
+      int dy = (y + d < gpuFrameHeight && rowHashes[y] == prevRowHashes[y + d]) ? d
+             : ((y - d >= 0 && rowHashes[y] == prevRowHashes[y - d]) ? -d : 0);
+      if (dy)
+      {
+        bool alreadyFound = false;
+        for(int j = 0; j < numCandidates; ++j)
+          if (candidates[j] == dy) alreadyFound = true;
+        if (!alreadyFound) candidates[numCandidates++] = dy;
+        break;
+      }
+    }
+  }
+
+  int bestDy = 0;
+  int bestSaved = MIN_SCANLINES_SAVED_BY_SCROLLING - 1;
+  for(int i = 0; i < numCandidates; ++i)
+  {
+    int saved = ScanlinesSavedByScrolling(candidates[i]);
+    if (saved > bestSaved)
+    {
+      bestSaved = saved;
+      bestDy = candidates[i];
+    }
+  }
+  return bestDy;
+}
+
+void ScrollDisplayVertically(int dy, uint16_t *framebuffer, uint16_t *prevFramebuffer)
+{
+  displayScrollOffset = (displayScrollOffset + dy) % gpuFrameHeight;
+  if (displayScrollOffset < 0) displayScrollOffset += gpuFrameHeight;
+  int scrollStart = displayYOffset + displayScrollOffset;
+  QUEUE_SPI_TRANSFER(0x37/*VSCRSADD: Vertical Scrolling Start Address*/, (uint8_t)(scrollStart >> 8), (uint8_t)(scrollStart & 0xFF));
+
+  // The display now shows the previous frame moved up by dy scanlines, so move the previous framebuffer to match
+  const int stride = gpuFramebufferScanlineStrideBytes >> 1;
+  const int numMoved = gpuFrameHeight - ABS(dy);
+  int exposedY, exposedEndY;
+  if (dy > 0)
+  {
+    memmove(prevFramebuffer, prevFramebuffer + dy*stride, numMoved*gpuFramebufferScanlineStrideBytes);
+    memmove(prevRowHashes, prevRowHashes + dy, numMoved*sizeof(uint32_t));
+    exposedY = numMoved;
+    exposedEndY = gpuFrameHeight;
+  }
+  else
+  {
+    memmove(prevFramebuffer - dy*stride, prevFramebuffer, numMoved*gpuFramebufferScanlineStrideBytes);
+    memmove(prevRowHashes - dy, prevRowHashes, numMoved*sizeof(uint32_t));
+    exposedY = 0;
+    exposedEndY = -dy;
+  }
+
+  // The exposed scanlines show stale content that wrapped around from the other end of the scroll area, so fill them
+  // in the previous framebuffer with data that differs from every pixel of the current frame to have them repainted.
+  for(int y = exposedY; y < exposedEndY; ++y)
+  {
+    uint16_t *scanline = framebuffer + y*stride;
+    uint16_t *prevScanline = prevFramebuffer + y*stride;
+    for(int x = 0; x < gpuFrameWidth; ++x)
+      prevScanline[x] = ~scanline[x];
+    prevRowHashes[y] = ~rowHashes[y];
+  }
+}
+
+void VerticalScrollPrevFramebufferUpdated(bool matchesLastDetectedFrame)
+{
+  if (matchesLastDetectedFrame)
+  {
+    uint32_t *tmp = prevRowHashes;
+    prevRowHashes = rowHashes;
+    rowHashes = tmp;
+  }
+  prevRowHashesValid = matchesLastDetectedFrame;
+}
+
+#endif
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+#include "display.h"
+#include "gpu.h"
+
+#ifdef DISPLAY_VERTICAL_SCROLL_DETECTION
+
+// Current hardware vertical scroll offset of the display, in scanlines in the range [0, gpuFrameHeight[.
+extern int displayScrollOffset;
+
+// Returns the scanline of the display controller memory that framebuffer scanline y is currently written to.
+static inline int ScrolledScanline(int y)
+{
+  y += displayScrollOffset;
+  return y >= gpuFrameHeight ? y - gpuFrameHeight : y;
+}
+
+// Returns true if the scanline range [y, endY[ wraps around the bottom of the scroll area in display controller memory. Such spans
+// cannot be written with a single write window.
+static inline bool SpanCrossesScrollWrap(int y, int endY)
+{
+  int wrapY = gpuFrameHeight - displayScrollOffset;
+  return y < wrapY && endY > wrapY;
+}
+
+// Sets up the vertical scroll area of the display to cover the framebuffer area. Call after InitGPU().
+void InitVerticalScroll(void);
+
+// Estimates by how many scanlines the contents of the previous frame have moved up (positive) or down (negative) in the current
+// frame. Returns 0 if there is no clear vertical displacement that would be worth scrolling for.
+int DetectVerticalScroll(uint16_t *framebuffer, uint16_t *prevFramebuffer);
+
+// Queues a hardware scroll command to move the display contents up by dy scanlines, and shifts prevFramebuffer to match the new
+// contents of the display. The newly exposed scanlines are marked changed so that the diff will repaint them.
+void ScrollDisplayVertically(int dy, uint16_t *framebuffer, uint16_t *prevFramebuffer);
+
+// Call after submitting a frame to tell whether the previous framebuffer now fully matches the frame that DetectVerticalScroll()
+// was last called with, or if it was modified in some other way (e.g. due to an interlaced update).
+void VerticalScrollPrevFramebufferUpdated(bool matchesLastDetectedFrame);
+
+#else
+
+#define ScrolledScanline(y) (y)
+#define SpanCrossesScrollWrap(y, endY) false
+
+#endif